@@ -19,8 +19,26 @@
 */
 
 #include "utils.h"
+#include "bvh.h"
+#include "packet.h"
+#include "scheduler.h"
+#include "lights.h"
+#include "sampler.h"
+#include "film.h"
+#include "raster.h"
+#include "texture.h"
+#define SHADOW_RAYS 5		// Default most shadow rays per light with soft shadows (cone sampled)
+#define MAX_SHADOW_RAYS 64	// Cap on -shadowrays
+#define SHADOW_PROBES MAX_SHADOW_RAYS	// Default shadow rays per light before checking for a
+				// penumbra, i.e. adaptive sampling is off unless asked for
+#define LIGHT_COMPARE_REF 64	// Shadow rays per light of the references of -comparelights
+#define MAX_TRACE_DEPTH 64	// Cap on the recursion depth, sizes the stack of rayTrace()
+#define TRACE_THRESHOLD (1.0/512)	// Default weight below which secondary rays are dropped
+#define ROULETTE_THRESHOLD .05	// Default weight below which secondary rays play Russian roulette
+#define PILOT_SAMPLES 4		// Default samples per pixel before checking whether it needs more
+#define PROGRESSIVE_STEP 16	// Pixel spacing of the first pass of -progressive
+#define SLANT_MIN .01		// Cosine below which slanted surfaces stretch texture footprints no more
 #include "assert.h"
-#define maxlight 10
 //#define DEBUGTEXT
 //#define DEBUGRGB
 
@@ -28,13 +46,48 @@
 // maximum recursion depth
 struct object3D *object_list;
 struct object3D *light_list;
-double light_radius[maxlight];
-int numLight;
 struct object3D *backgroundObj;
 int MAX_DEPTH;
 int antialiasing;	// Flag to determine whether antialiaing is enabled or disabled
+struct lightTable *sceneLights;	// Table of the lights in light_list, see lights.h
+int lightTreeMin;	// Lights above which shadow rays pick lights from the light tree
+int lightSampling;	// LIGHT_SAMPLE_CONE or LIGHT_SAMPLE_VOLUME, see lights.h
+int shadowRays;		// Most shadow rays per light with soft shadows on
+int shadowProbes;	// Shadow rays per light before checking for a penumbra
+double penumbraThreshold;	// Spread of the probes above which all shadowRays are traced
+int compareLights;	// Flag to compare the light samplers instead of rendering once
+int samplerKind;	// SAMPLER_* used for every pixel
+int spp;		// Samples per pixel
+uint64_t seed;		// Seed of every random number, see sampler.h
+double traceThreshold;	// Weight below which secondary rays are dropped
+double rouletteThreshold;	// Weight below which secondary rays may be ended at random
+double adaptiveThreshold;	// Spread of the pilot samples above which a pixel gets all its samples, 0 for off
+int pilotSamples;	// Samples every pixel gets with adaptive sampling
+int filterKind;		// FILTER_* used to reconstruct the pixels
+double filterRadius;	// Radius of the filter, 0 for its default
+double exposure;	// Scale of every pixel's weighted mean, 1 by default (-exposure)
+int progressive;	// Flag to render in passes, writing the image after each
+int shareSamples;	// Flag to trace the grid samples neighbouring pixels share once (0 with -noshare)
+int useRaster;		// Flag to resolve primary rays with the raster pre-pass (-raster)
+int numSceneLights;	// Lights scattered over the scene with -lights, 0 for the default pair
+struct bvh *sceneBVH;	// Hierarchy over object_list, NULL to walk the list instead
+int useBVH;		// Flag to build and use the BVH (set to 0 with -nobvh)
+int packetSize;		// Primary rays traced together (4, 8 or 16), 0 traces them one by one
+int tileOrder;		// TILE_ORDER_* the tiles are rendered in, see scheduler.h
+int shadeBench;		// Flag to run the shading micro-benchmark instead of rendering
+int texFilter;		// TEX_FILTER_* the textures are sampled with, see texture.h
+double pixelSpread;	// Angle between neighbouring primary rays, for the footprints on textures
 FILE *debugUV;
 
+// The pixel sample being shaded by this thread. Every random number the
+// shader uses is drawn from it (see sampler.h), so it only depends on the
+// pixel and the sample, not on the thread or the order of the tiles.
+static thread_local struct pixelSample shadeSample;
+
+static inline double nextRandom(void){
+    return(sample1D(&shadeSample));
+}
+
 //generate weights from Gaussian normal function
 //size is always odd
 void gen_Gaussian_weight(double *table,int center){
@@ -61,7 +114,7 @@ struct object3D* buildAvator(void){
 /* struct object3D *top, *o;
 
  top=newBox(1,1,1,1,1,1,1,1,1,10); //top level bounding box
- invert(&top->T[0][0],&top->Tinv[0][0]);
+ invertObject(top);
  insertObject(top,&object_list);
 */
 
@@ -71,7 +124,7 @@ struct object3D* buildAvator(void){
  Scale(o,.4,1.8,.4);
  RotateZ(o,PI/5);
  Translate(o,-5.3,2.3,-3.5);
- invert(&o->T[0][0],&o->Tinv[0][0]);
+ invertObject(o);
  //insert this object into the boudning box object list
  //insertObject(o,&(top->children));
  insertObject(o,&object_list);
@@ -80,7 +133,7 @@ struct object3D* buildAvator(void){
  o=newSphere(.4,.8,.05,.8,.94,.5,.5,1,1.52,10);
  Scale(o,.5,.5,.5);
  Translate(o,-4,.5,-3.5);
- invert(&o->T[0][0],&o->Tinv[0][0]);
+ invertObject(o);
  //insertObject(o,&(top->children));
  insertObject(o,&object_list);
 
@@ -90,7 +143,7 @@ struct object3D* buildAvator(void){
  Scale(o,1,2,1);
  RotateZ(o,-PI/12);
  Translate(o,-4,-.1,-3.5);
- invert(&o->T[0][0],&o->Tinv[0][0]);
+ invertObject(o);
 // insertObject(o,&(top->children));
  insertObject(o,&object_list);
 
@@ -114,7 +167,7 @@ void buildBuilding(){
  top=newBox(.2,.95,.95,.5,.94,.5,.5,1,1.52,10);
  Scale(top,2.5,2.5,2);
  Translate(top,bx,by,bz);
- invert(&top->T[0][0],&top->Tinv[0][0]);
+ invertObject(top);
  insertObject(top,&object_list);
 
 
@@ -126,7 +179,7 @@ void buildBuilding(){
 //	RotateY(o,PI/4);
 //	RotateZ(o,PI/10.0);
         Translate(o,(bx+i),(by-(double)j*0.8),bz);
-        invert(&o->T[0][0],&o->Tinv[0][0]);
+        invertObject(o);
         insertObject(o,&(top->children));
 
 	if(j<dimension-1){
@@ -135,7 +188,7 @@ void buildBuilding(){
 	    RotateY(o,PI/2);
 //	    RotateZ(o,PI/10.0);
             Translate(o,bx+1,(by-0.4-(double)j*0.8),bz-0.8+i);
-            invert(&o->T[0][0],&o->Tinv[0][0]);
+            invertObject(o);
             insertObject(o,&(top->children));
 	}
      }
@@ -166,7 +219,7 @@ void buildScene(void)
  backgroundObj = newSphere(0,0,0,0,0,0,0,0,0,0);
  Scale(backgroundObj,15,30,30);
  RotateZ(backgroundObj,PI/2);
- invert(&backgroundObj->T[0][0],&backgroundObj->Tinv[0][0]);
+ invertObject(backgroundObj);
  //loadTexture(backgroundObj,"texture/starSphere.ppm");
  loadTexture(backgroundObj,"texture/space.ppm");
 
@@ -186,7 +239,7 @@ void buildScene(void)
  Translate(o,0,-1,9);
  loadTexture(o,"texture/medium_check.ppm");
  //loadTexture(o,"texture/lake1.ppm");
- invert(&o->T[0][0],&o->Tinv[0][0]);		// Very important! compute
+ invertObject(o);		// Very important! compute
 						// and store the inverse
 						// transform for this object!
  insertObject(o,&object_list);			// Insert into object list
@@ -196,7 +249,7 @@ void buildScene(void)
  Scale(o,.75,.5,1.5);
  RotateX(o,PI/6);
  Translate(o,6,0,-4);
- invert(&o->T[0][0],&o->Tinv[0][0]);
+ invertObject(o);
  insertObject(o,&object_list);
 
 
@@ -205,7 +258,7 @@ void buildScene(void)
  Scale(o,.5,1.8,1.0);
  RotateZ(o,PI/7.5);
  Translate(o,4.5,-0.5,-2.5);
- invert(&o->T[0][0],&o->Tinv[0][0]);
+ invertObject(o);
  insertObject(o,&object_list);
 
 
@@ -218,7 +271,7 @@ void buildScene(void)
  RotateX(o,-PI/2);
  //RotateZ(o,-PI/12);
  Translate(o,8,10,3);
- invert(&o->T[0][0],&o->Tinv[0][0]);
+ invertObject(o);
  insertObject(o,&object_list);
 
  //another mirror (back center)
@@ -228,7 +281,7 @@ void buildScene(void)
 // RotateX(o,-PI/4);
  RotateX(o,-PI/5.5);
  Translate(o,-3,10,5);
- invert(&o->T[0][0],&o->Tinv[0][0]);	
+ invertObject(o);	
  insertObject(o,&object_list);		
 
 
@@ -240,7 +293,7 @@ void buildScene(void)
 // RotateZ(o,-PI/12);
  RotateX(o,PI/6);
  Translate(o,-10,8,2);
- invert(&o->T[0][0],&o->Tinv[0][0]);	
+ invertObject(o);	
  insertObject(o,&object_list);		
 
 
@@ -252,7 +305,7 @@ void buildScene(void)
  RotateZ(o,-PI/12);
  RotateX(o,PI/2);
  Translate(o,-10,0,0);
- invert(&o->T[0][0],&o->Tinv[0][0]);	
+ invertObject(o);	
  insertObject(o,&object_list);		
 
 
@@ -261,7 +314,7 @@ void buildScene(void)
  Scale(o,2,1.5,1);
  RotateX(o,-PI/5.5);
  Translate(o,5,5,8);
- invert(&o->T[0][0],&o->Tinv[0][0]);	
+ invertObject(o);	
  insertObject(o,&object_list);		
 
 
@@ -271,21 +324,21 @@ void buildScene(void)
  Scale(o,1.3,1.3,1.3);
  Translate(o,-5,4,1);
  o->isMirror = 1; 			
- invert(&o->T[0][0],&o->Tinv[0][0]);
+ invertObject(o);
  insertObject(o,&object_list);
 
 
  o=newSphere(.1,.1,.4,.8,1,1,1,.2,1.42,10);
  Scale(o,1.3,1.3,1.3);
  Translate(o,-2,3,2);
- invert(&o->T[0][0],&o->Tinv[0][0]);
+ invertObject(o);
  insertObject(o,&object_list);
 
  //an refractive sphere
  o=newSphere(.1,.1,.4,1,1,1,1,1,1.42,10);
  Scale(o,1.3,1.3,1.3);
  Translate(o,-7.5,0,-1);
- invert(&o->T[0][0],&o->Tinv[0][0]);
+ invertObject(o);
  insertObject(o,&object_list);
 
 
@@ -294,26 +347,41 @@ void buildScene(void)
  buildBuilding();
 
 
+ if (numSceneLights>0)
+ {
+  // Many small lights scattered over the sky (-lights N), with their
+  // colours adding up to those of the two lights below
+  for (int i=0;i<numSceneLights;i++)
+  {
+   double c=1.65/numSceneLights;
+   double x=-12+24*(double)rand()/RAND_MAX;
+   double y=10+6*(double)rand()/RAND_MAX;
+   double z=-4+20*(double)rand()/RAND_MAX;
+   o=newSphere(0,0,0,0,c,c,c,1,0,0);
+   o->isLightSource=1;
+   Scale(o,.2,.2,.2);
+   Translate(o,x,y,z);
+   insertObject(o,&light_list);
+  }
+  return;
+ }
+
  // Insert a sphere light source as sphere (top sky)
  double r1=3;
- light_radius[numLight]=r1;
  o=newSphere(0,0,0,0,.95,.95,.95,1,0,0);
  o->isLightSource=1;
  Scale(o,r1,r1,r1);
  Translate(o,2,15,6);
  insertObject(o,&light_list);
- numLight++;
 
 
  // Insert a another sphere light source (right floor)
  r1=.2;
- light_radius[numLight]=r1;
  o=newSphere(0,0,0,0,.7,.7,.7,1,0,0);
  o->isLightSource=1;
  Scale(o,r1,r1,r1);
  Translate(o,5,1.5,-1.5);
  insertObject(o,&light_list);
- numLight++;
 
 
  // Remember: A lot of the quality of your scene will depend on how much care you have put into defining
@@ -325,60 +393,1069 @@ void buildScene(void)
 
 
 
+static struct object3D *traceRay(struct ray3D *ray, int depth, struct colourRGB *col,
+			struct object3D *Os);
+static void shadePrimary(const struct ray3D *ray, struct object3D *hitObj, double lambda,
+			struct colourRGB *col);
+
+// Position (u,v) in pixel of the sample ps, which may be outside the
+// pixel with a reconstruction filter (see film.h)
+static inline void samplePosition(struct renderJob *job, struct pixelSample *ps, double *u, double *v)
+{
+ *u=sample1D(ps);
+ *v=sample1D(ps);
+ if (job->filter)
+ {
+  *u=.5+filterSample(job->filter,*u);
+  *v=.5+filterSample(job->filter,*v);
+ }
+}
+
+// Weight of the sample at (u,v): f/pdf of the reconstruction filter, or
+// the Gaussian of the default 3x3 grid evaluated at (u,v).
+static inline double sampleWeight(struct renderJob *job, int index, double u, double v)
+{
+ if (job->filter) return(filterWeight(job->filter,u-.5)*filterWeight(job->filter,v-.5));
+ if (job->sampler->type==SAMPLER_GRID) return(job->weight[index]);
+ double x=2*u-1;
+ double y=2*v-1;
+ return(exp(-(x*x+y*y)/2)/(2*PI));
+}
+
+// Whether pixel (i,j) is rendered by the pass of job: every step-th pixel
+// along x and y from the corner of the crop window, except those a
+// coarser pass (every skipStep-th) did
+static inline int pixelInPass(struct renderJob *job, int i, int j)
+{
+ if (job->step==1 && !job->skipStep) return(1);
+ i-=job->x0;
+ j-=job->y0;
+ if (i%job->step || j%job->step) return(0);
+ return(!job->skipStep || i%job->skipStep || j%job->skipStep);
+}
+
+// Adds the weighted sum of the samples of pixel (i,j) to the film, wsum
+// is the sum of their weights
+static inline void finishPixel(struct renderJob *job, int i, int j, struct colourRGB *col, double wsum)
+{
+ filmAdd(job->film,i,j,col,wsum);
+}
+
+// Index of the k-th sample of a pixel to trace. With adaptive sampling
+// the grid's corners come first, so the pilot samples span the pixel;
+// the other samplers spread any prefix of their samples over the pixel.
+static inline int sampleIndex(const struct sampler *smp, int k)
+{
+ if (adaptiveThreshold<=0 || smp->type!=SAMPLER_GRID) return(k);
+ int n=smp->nx,last=n*n-1;
+ if (k<4)
+ {
+  const int corner[4]={0,last,n-1,last-(n-1)};
+  return(corner[k]);
+ }
+ //the rest in order, skipping the corners
+ int s=k-3;
+ if (s>=n-1) s++;
+ if (s>=last-(n-1)) s++;
+ return(s);
+}
+
+// Unweighted mean and spread of the pilot samples of a pixel, and whether
+// they hit different objects
+struct pixelStats{
+	struct colourRGB sum;
+	struct colourRGB sum2;	// Sum of the squares
+	struct object3D *obj;	// Object hit by the first pilot sample
+	int edge;		// Flag set if the pilot samples hit different objects
+	int n;			// Pilot samples so far
+};
+
+static inline void addPilot(struct pixelStats *st, const struct colourRGB *col, struct object3D *obj)
+{
+ if (st->n==0) st->obj=obj;
+ else if (obj!=st->obj) st->edge=1;
+ st->sum.R+=col->R; st->sum.G+=col->G; st->sum.B+=col->B;
+ st->sum2.R+=col->R*col->R; st->sum2.G+=col->G*col->G; st->sum2.B+=col->B*col->B;
+ st->n++;
+}
+
+// Whether the pixel needs more than its pilot samples: they straddle an
+// object boundary, or the standard deviation of a channel is above
+// adaptiveThreshold
+static inline int refinePixel(const struct pixelStats *st)
+{
+ if (st->edge) return(1);
+ if (st->n<2) return(0);
+ double t=adaptiveThreshold*adaptiveThreshold*(st->n-1);
+ return(st->sum2.R-st->sum.R*st->sum.R/st->n>t ||
+	st->sum2.G-st->sum.G*st->sum.G/st->n>t ||
+	st->sum2.B-st->sum.B*st->sum.B/st->n>t);
+}
+
+/*
+   Samples of the pixels of one row of a tile, see newSampleCache(). The
+   grid sampler's samples on the edge between two pixels are the same
+   sample for both (see sampler.h), so they share a slot and are traced
+   once. The bottom row of the grid of one row of pixels is the top row
+   of the next one, and is kept when moving on to it.
+*/
+#define SLOT_EMPTY 0
+#define SLOT_QUEUED 1		// Waiting in a packet
+#define SLOT_DONE 2
+
+struct cachedSample{
+	struct colourRGB col;	// Colour, not weighted
+	struct object3D *obj;	// Object hit by the primary ray
+	double u, v;		// Position in the pixel that traced it
+	int state;		// SLOT_*
+};
+
+struct sampleCache{
+	int ns;			// Grid size if samples are shared, 0 otherwise
+	int spp;
+	int stride;		// Slots per row
+	int rows;
+	struct cachedSample *slots;
+};
+
+// Cache for a row of width pixels of job, NULL if out of memory
+static struct sampleCache *newSampleCache(struct renderJob *job, int width)
+{
+ const struct sampler *smp=job->sampler;
+ struct sampleCache *c=(struct sampleCache *)calloc(1,sizeof(struct sampleCache));
+ if (!c) return(NULL);
+ c->spp=smp->spp;
+ if (smp->type==SAMPLER_GRID && shareSamples && !job->filter)
+ {
+  c->ns=smp->nx;
+  c->stride=width*(c->ns-1)+1;
+  c->rows=c->ns;
+ }
+ else
+ {
+  c->stride=width*smp->spp;
+  c->rows=1;
+ }
+ c->slots=(struct cachedSample *)calloc(c->stride*c->rows,sizeof(struct cachedSample));
+ if (!c->slots)
+ {
+  free(c);
+  return(NULL);
+ }
+ return(c);
+}
+
+static void deleteSampleCache(struct sampleCache *c)
+{
+ if (!c) return;
+ free(c->slots);
+ free(c);
+}
+
+// Slot of sample s of pixel x (counted from the left of the row)
+static inline struct cachedSample *cacheSlot(struct sampleCache *c, int x, int s)
+{
+ if (!c->ns) return(&c->slots[x*c->spp+s]);
+ return(&c->slots[(s/c->ns)*c->stride+x*(c->ns-1)+s%c->ns]);
+}
+
+// Moves on to the next row of pixels
+static void nextCacheRow(struct sampleCache *c)
+{
+ if (c->ns) memcpy(c->slots,&c->slots[(c->rows-1)*c->stride],c->stride*sizeof(struct cachedSample));
+ for (int k=c->ns?c->stride:0;k<c->stride*c->rows;k++) c->slots[k].state=SLOT_EMPTY;
+}
+
+// Adds a traced sample s to its pixel's sums
+static inline void addSample(struct renderJob *job, int s, const struct cachedSample *slot, int pilot,
+			struct colourRGB *col_avg, double *wsum, struct pixelStats *st)
+{
+ struct colourRGB col=slot->col;
+ if (pilot) addPilot(st,&col,slot->obj);
+
+ //average the col with Gaussian weight
+ double wt=sampleWeight(job,s,slot->u,slot->v);
+ mult_col(wt,&col);
+ add_col(&col,col_avg);
+ *wsum+=wt;
+}
+
+// Primary rays waiting to be traced as a packet, with the cache slot
+// each one goes to
+struct sampleQueue{
+	struct rayPacket pk;
+	struct pixelSample ps[MAX_PACKET];	// Sample of each lane, shading goes on from it
+	struct cachedSample *slot[MAX_PACKET];
+	int lanes;
+	long rays;			// Rays traced so far
+	long rasterRays;		// Rays the raster resolved
+};
+
+// Pads the packet to a multiple of 4 lanes by repeating the last ray, and
+// finds the closest hit of every lane
+static void packetHits(struct rayPacket *pk, int used)
+{
+ int lanes=used;
+ while(lanes%4){
+    pk->ox[lanes]=pk->ox[lanes-1]; pk->oy[lanes]=pk->oy[lanes-1]; pk->oz[lanes]=pk->oz[lanes-1];
+    pk->dx[lanes]=pk->dx[lanes-1]; pk->dy[lanes]=pk->dy[lanes-1]; pk->dz[lanes]=pk->dz[lanes-1];
+    lanes++;
+ }
+ pk->n=lanes;
+ packetFirstHit(sceneBVH,pk);
+ pk->n=used;
+}
+
+// Same as packetHits(), but the lanes the raster resolves are not traced,
+// the others go through the BVH in a packet of their own
+static void packetHitsRaster(struct raster *r, struct sampleQueue *q)
+{
+ struct rayPacket *pk=&q->pk;
+ struct rayPacket rest;
+ int lane[MAX_PACKET];
+ int n=0;
+ for(int k=0;k<pk->n;++k){
+    struct ray3D ray;
+    ray.p0.px=pk->ox[k]; ray.p0.py=pk->oy[k]; ray.p0.pz=pk->oz[k]; ray.p0.pw=1;
+    ray.d.px=pk->dx[k];  ray.d.py=pk->dy[k];  ray.d.pz=pk->dz[k];  ray.d.pw=0;
+    ray.rayPos=&rayPosition;
+    if(rasterFirstHit(r,q->ps[k].x,q->ps[k].y,&ray,&pk->t[k],&pk->obj[k])){
+	q->rasterRays++;
+	continue;
+    }
+    rest.ox[n]=pk->ox[k]; rest.oy[n]=pk->oy[k]; rest.oz[n]=pk->oz[k];
+    rest.dx[n]=pk->dx[k]; rest.dy[n]=pk->dy[k]; rest.dz[n]=pk->dz[k];
+    lane[n++]=k;
+ }
+ if(n==0) return;
+ packetHits(&rest,n);
+ for(int k=0;k<n;++k){
+    pk->t[lane[k]]=rest.t[k];
+    pk->obj[lane[k]]=rest.obj[k];
+ }
+}
+
+// Traces the queued rays into their slots
+static void flushQueue(struct renderJob *job, struct sampleQueue *q)
+{
+ struct rayPacket *pk=&q->pk;
+ struct colourRGB col[MAX_PACKET];
+ int used=q->lanes;
+ if (used==0) return;
+
+ if (job->raster)
+ {
+  pk->n=used;
+  packetHitsRaster(job->raster,q);
+ }
+ else packetHits(pk,used);
+ rayTracePacket(pk,q->ps,col);
+ for(int k=0;k<used;++k){
+    q->slot[k]->col=col[k];
+    q->slot[k]->obj=pk->obj[k];
+    q->slot[k]->state=SLOT_DONE;
+ }
+ q->rays+=used;
+ q->lanes=0;
+}
+
+// Queues sample s of pixel (i,j) unless its slot is traced or queued
+// already, and traces the queue once it is full
+static void queueSample(struct renderJob *job, struct tile *t, struct sampleCache *c, struct sampleQueue *q,
+			int i, int j, int s)
+{
+ struct cachedSample *slot=cacheSlot(c,i-t->x0,s);
+ if (slot->state!=SLOT_EMPTY) return;
+
+ struct view *cam=job->cam;
+ struct rayPacket *pk=&q->pk;
+ int lane=q->lanes;
+ startSample(&q->ps[lane],job->sampler,i,j,s);
+ double u,v;
+ samplePosition(job,&q->ps[lane],&u,&v);
+
+ //camera space direction, and origin pushed 0.001*d out as newRay() does
+ struct point3D d={cam->wl+(i+u)*job->du,cam->wt+(j+v)*job->dv,cam->f,0};
+ struct point3D p0={0.001*d.px,0.001*d.py,0.001*d.pz,1};
+ matVecMult(cam->C2W,&p0);
+ matVecMult(cam->C2W,&d);
+
+ pk->ox[lane]=p0.px; pk->oy[lane]=p0.py; pk->oz[lane]=p0.pz;
+ pk->dx[lane]=d.px;  pk->dy[lane]=d.py;  pk->dz[lane]=d.pz;
+ slot->u=u;
+ slot->v=v;
+ slot->state=SLOT_QUEUED;
+ q->slot[lane]=slot;
+ q->lanes++;
+ if (q->lanes==packetSize) flushQueue(job,q);
+}
+
+// Same as renderTile() below, but the primary rays of each row of the tile
+// are traced packetSize at a time: first the pilot samples of every pixel,
+// then the rest of the samples of the pixels that need them. The samples
+// of each pixel are added up in the same order as in renderTile(), so the
+// output is the same.
+static void renderTilePackets(struct renderJob *job, struct tile *t, struct sampleCache *c)
+{
+ const struct sampler *smp=job->sampler;
+ struct sampleQueue q;
+ struct colourRGB col_avg[TILE_SIZE];
+ double wsum[TILE_SIZE];
+ struct pixelStats st[TILE_SIZE];
+ int refine[TILE_SIZE];
+ int first=job->firstSample,end=job->endSample;
+ int pilot=adaptiveThreshold>0?pilotSamples:end;
+
+ q.lanes=0;
+ q.rays=0;
+ q.rasterRays=0;
+ for (int j=t->y0;j<t->y1;j++)
+ {
+  memset(col_avg,0,sizeof(col_avg));
+  memset(wsum,0,sizeof(wsum));
+  memset(st,0,sizeof(st));
+  for (int i=t->x0;i<t->x1;i++)
+   if (pixelInPass(job,i,j))
+    for(int k=first;k<pilot;++k)
+     queueSample(job,t,c,&q,i,j,sampleIndex(smp,k));
+  flushQueue(job,&q);
+  for (int i=t->x0;i<t->x1;i++)
+   for(int k=first;k<pilot && pixelInPass(job,i,j);++k)
+   {
+    int s=sampleIndex(smp,k);
+    addSample(job,s,cacheSlot(c,i-t->x0,s),1,&col_avg[i-t->x0],&wsum[i-t->x0],&st[i-t->x0]);
+   }
+
+  if (pilot<end)
+  {
+   for (int i=t->x0;i<t->x1;i++)
+   {
+    refine[i-t->x0]=pixelInPass(job,i,j) && refinePixel(&st[i-t->x0]);
+    if (!refine[i-t->x0]) continue;
+    for(int k=pilot;k<end;++k)
+     queueSample(job,t,c,&q,i,j,sampleIndex(smp,k));
+   }
+   flushQueue(job,&q);
+   for (int i=t->x0;i<t->x1;i++)
+    if (refine[i-t->x0])
+     for(int k=pilot;k<end;++k)
+     {
+      int s=sampleIndex(smp,k);
+      addSample(job,s,cacheSlot(c,i-t->x0,s),0,&col_avg[i-t->x0],&wsum[i-t->x0],&st[i-t->x0]);
+     }
+  }
+
+  for (int i=t->x0;i<t->x1;i++)
+   if (pixelInPass(job,i,j)) finishPixel(job,i,j,&col_avg[i-t->x0],wsum[i-t->x0]);
+  nextCacheRow(c);
+ }
+ #pragma omp atomic
+ job->primaryRays+=q.rays;
+ #pragma omp atomic
+ job->rasterRays+=q.rasterRays;
+}
+
+// Renders all pixels of one tile into job->im. Only reads shared scene data,
+// so tiles can be rendered concurrently.
+void renderTile(struct renderJob *job, struct tile *t)
+{
+ struct sampleCache *c=newSampleCache(job,t->x1-t->x0);
+ if (!c)
+ {
+  fprintf(stderr,"Unable to allocate the sample cache, out of memory!\n");
+  return;
+ }
+ if (packetSize>0 && sceneBVH && t->x1-t->x0<=TILE_SIZE)
+ {
+  renderTilePackets(job,t,c);
+  deleteSampleCache(c);
+  return;
+ }
+
+ struct view *cam=job->cam;
+ const struct sampler *smp=job->sampler;
+ //with adaptive sampling, every pixel takes pilot samples first and the
+ //rest only if refinePixel() says so
+ int first=job->firstSample,end=job->endSample;
+ int pilot=adaptiveThreshold>0?pilotSamples:end;
+ long rays=0,rasterRays=0;
+
+ //initialize points and vectors in the camera space
+ struct point3D origin;
+ origin.px=0;
+ origin.py=0;
+ origin.pz=0;
+ origin.pw=1;
+
+ for (int j=t->y0;j<t->y1;j++)		// For each of the pixels in the tile
+ {
+   for (int i=t->x0;i<t->x1;i++)
+  {
+    if (!pixelInPass(job,i,j)) continue;
+    struct colourRGB col_avg={0,0,0};
+    double wsum=0;
+    struct pixelStats st;
+    memset(&st,0,sizeof(st));
+    //anti-aliasing by supersampling, the sampler spreads the samples over the pixel
+    for(int k=first;k<end;++k){
+	if(k==pilot && !refinePixel(&st)) break;
+	int s=sampleIndex(smp,k);
+	struct cachedSample *slot=cacheSlot(c,i-t->x0,s);
+	if(slot->state!=SLOT_DONE){
+	    //not traced by a neighbour yet
+	    struct colourRGB col={0,0,0};
+	    startSample(&shadeSample,smp,i,j,s);
+	    double u,v;
+	    samplePosition(job,&shadeSample,&u,&v);
+
+	    //construct the primary ray, direction: sample position-origin
+	    struct point3D d={cam->wl+(i+u)*job->du,cam->wt+(j+v)*job->dv,cam->f,0}; //note: dv is negative
+	    struct ray3D ray;
+	    initRay(&ray,&origin,&d);
+
+	    //transform the ray into the world space
+	    matRayMult(cam->C2W,&ray);
+	    double lambda;
+	    struct object3D *hitObj;
+	    if(job->raster && rasterFirstHit(job->raster,i,j,&ray,&lambda,&hitObj)){
+		shadePrimary(&ray,hitObj,lambda,&col);
+		slot->obj=hitObj;
+		rasterRays++;
+	    }
+	    else slot->obj=traceRay(&ray,0,&col,NULL);
+	    slot->col=col;
+	    slot->u=u;
+	    slot->v=v;
+	    slot->state=SLOT_DONE;
+	    rays++;
+	}
+	addSample(job,s,slot,k<pilot,&col_avg,&wsum,&st);
+    }
+
+    //set color of this pixel
+    finishPixel(job,i,j,&col_avg,wsum);
+  } // end of this row
+  nextCacheRow(c);
+ } // end for j
+ deleteSampleCache(c);
+ #pragma omp atomic
+ job->primaryRays+=rays;
+ #pragma omp atomic
+ job->rasterRays+=rasterRays;
+}
+
+// Primary ray counts of the last pass of job
+static void reportRays(struct renderJob *job, const char *prefix)
+{
+ if ((adaptiveThreshold>0 || (shareSamples && job->sampler->type==SAMPLER_GRID)) &&
+     job->step==1 && job->firstSample==0 && job->endSample==job->sampler->spp)
+ {
+  long full=(long)job->im->sx*job->im->sy*job->sampler->spp;
+  fprintf(stderr,"%sTraced %ld primary rays, %.1f%% of %ld\n",
+		prefix,job->primaryRays,100.0*job->primaryRays/full,full);
+ }
+ if (job->raster && job->primaryRays>0)
+  fprintf(stderr,"%sThe raster resolved %.1f%% of the %ld primary rays traced\n",
+		prefix,100.0*job->rasterRays/job->primaryRays,job->primaryRays);
+}
+
+// Renders the pass of every job[0..numViews-1] (see renderJob) on
+// numThreads threads, adding the samples to their films, and resolves
+// each film into its image. The views share the scene and the threads,
+// a thread done with its tiles of one view steals tiles of any view.
+// All the views have the same size. Returns the render time in seconds,
+// or -1 if the tiles could not be set up.
+static double renderImage(struct renderJob *job, int numViews, int numThreads)
+{
+ struct tileScheduler *sched=newTileScheduler(job->x0,job->y0,job->x1,job->y1,numViews,TILE_SIZE,tileOrder,
+					numThreads);
+ if (sched==NULL) return(-1);
+
+ if (numViews>1) fprintf(stderr,"Rendering %d tiles of %d views on %d threads ",sched->numTiles,numViews,numThreads);
+ else fprintf(stderr,"Rendering %d tiles on %d threads ",sched->numTiles,numThreads);
+ for (int v=0;v<numViews;v++)
+ {
+  job[v].primaryRays=0;
+  job[v].rasterRays=0;
+ }
+ double renderStart=omp_get_wtime();
+
+ //each thread renders tiles from its own deque, then steals from the others
+ #pragma omp parallel num_threads(numThreads)
+ {
+  struct tile *t;
+  while ((t=nextTile(sched,omp_get_thread_num()))!=NULL)
+   renderTile(&job[t->view],t);
+ }
+ for (int v=0;v<numViews;v++)
+  resolveFilm(job[v].film,job[v].im,exposure,job[v].step);
+
+ double renderTime=omp_get_wtime()-renderStart;
+ fprintf(stderr,"\nDone! Render time: %.2f s\n",renderTime);
+ for (int v=0;v<numViews;v++)
+ {
+  char prefix[32]="";
+  if (numViews>1) snprintf(prefix,sizeof(prefix),"View %d: ",v);
+  reportRays(&job[v],prefix);
+ }
+ deleteTileScheduler(sched);
+ return(renderTime);
+}
+
+// Quality vs time of the two light samplers (-comparelights). For each
+// sampler, renders a reference with LIGHT_COMPARE_REF shadow rays per
+// light, then the image with fewer rays, and reports the render time and
+// the RMS error (in 0-255 levels) against that sampler's reference.
+// Adaptive shadow sampling is off. The cone sampler's reference is
+// written to output_name.
+static void compareLightSampling(struct renderJob *job, int numThreads, const char *output_name)
+{
+ static const int rays[]={1,2,5,10};
+ shadowProbes=MAX_SHADOW_RAYS;	// No adaptive sampling, every sampler traces all its rays
+ const int numCounts=sizeof(rays)/sizeof(rays[0]);
+ const char *samplerName[2]={"volume","cone"};
+ double renderTime[2][numCounts],rmsError[2][numCounts];
+ int size=job->im->sx*job->im->sy*3;
+ unsigned char *rgb=(unsigned char *)job->im->rgbdata;
+ unsigned char *ref=(unsigned char *)calloc(size,sizeof(unsigned char));
+ if (!ref)
+ {
+  fprintf(stderr,"Unable to allocate the reference image, out of memory!\n");
+  return;
+ }
+
+ for (int m=0;m<2;m++)
+ {
+  lightSampling=m?LIGHT_SAMPLE_CONE:LIGHT_SAMPLE_VOLUME;
+  fprintf(stderr,"%s sampler, reference with %d rays per light\n",samplerName[m],LIGHT_COMPARE_REF);
+  shadowRays=LIGHT_COMPARE_REF;
+  clearFilm(job->film);
+  if (renderImage(job,1,numThreads)<0) break;
+  memcpy(ref,rgb,size);
+  if (lightSampling==LIGHT_SAMPLE_CONE) imageOutput(job->im,output_name);
+
+  for (int k=0;k<numCounts;k++)
+  {
+   shadowRays=rays[k];
+   clearFilm(job->film);
+   renderTime[m][k]=renderImage(job,1,numThreads);
+   double err=0;
+   for (int i=0;i<size;i++) err+=(rgb[i]-ref[i])*(rgb[i]-ref[i]);
+   rmsError[m][k]=sqrt(err/size);
+  }
+ }
+ free(ref);
+
+ fprintf(stderr,"sampler rays/light  time (s)  RMS error\n");
+ for (int m=0;m<2;m++)
+  for (int k=0;k<numCounts;k++)
+   fprintf(stderr,"%7s %10d %9.2f %10.2f\n",samplerName[m],rays[k],renderTime[m][k],rmsError[m][k]);
+}
+
+// Writes im to name through a temporary file, so a viewer reloading the
+// file never sees a partly written image
+static void writePreview(struct image *im, const char *name)
+{
+ char tmp[1100];
+ snprintf(tmp,sizeof(tmp),"%s.tmp",name);
+ imageOutput(im,tmp);
+ if (rename(tmp,name)!=0) fprintf(stderr,"Unable to rename %s to %s\n",tmp,name);
+}
+
+// Renders one pass of -progressive and writes the image. Returns -1 if
+// the pass could not be rendered.
+static int progressivePass(struct renderJob *job, int numThreads, const char *output_name, int pass,
+			double *total)
+{
+ double t=renderImage(job,1,numThreads);
+ if (t<0) return(-1);
+ *total+=t;
+ writePreview(job->im,output_name);
+ fprintf(stderr,"Pass %d: every %d pixel(s), samples %d to %d of %d, %.2f s so far, written to %s\n",
+		pass,job->step,job->firstSample,job->endSample,job->sampler->spp,*total,output_name);
+ return(0);
+}
+
+// Progressive rendering (-progressive). The first pass traces one sample
+// at every PROGRESSIVE_STEP-th pixel along x and y, and each pass after
+// that halves the spacing, tracing only the pixels the coarser passes
+// skipped, until every pixel has its first sample. The next passes add
+// samples [1,2), [2,4), [4,8)... of every pixel until all the samples
+// of the sampler are in. The film keeps the samples of every pass, so
+// no sample is traced twice, and the image is written to output_name
+// after each pass. Returns -1 if a pass could not be rendered.
+static int renderProgressive(struct renderJob *job, int numThreads, const char *output_name)
+{
+ int spp=job->sampler->spp;
+ int first=PROGRESSIVE_STEP;
+ while (first>1 && (first>=job->im->sx || first>=job->im->sy)) first/=2;
+ int pass=1;
+ double total=0;
+
+ clearFilm(job->film);
+ job->firstSample=0;
+ job->endSample=1;
+ for (int step=first;step>=1;step/=2)
+ {
+  job->step=step;
+  job->skipStep=step<first?2*step:0;
+  if (progressivePass(job,numThreads,output_name,pass++,&total)<0) return(-1);
+ }
+
+ job->step=1;
+ job->skipStep=0;
+ for (int begin=1;begin<spp;begin=job->endSample)
+ {
+  job->firstSample=begin;
+  job->endSample=2*begin<spp?2*begin:spp;
+  if (progressivePass(job,numThreads,output_name,pass++,&total)<0) return(-1);
+ }
+ job->firstSample=0;
+ return(0);
+}
+
+// A camera to render the scene from, and the file its image goes to
+struct viewSpec{
+	struct point3D e;	// Camera centre
+	struct point3D g;	// Gaze direction
+	struct point3D up;
+	char name[1024];
+};
+
+// Reads the views of -views from file, one per line:
+//   ex ey ez  lx ly lz  [ux uy uz]  output_name
+// with the camera at e looking at the point l, and the Y axis up unless
+// an up vector is given. Empty lines and lines starting with # are
+// skipped, and so are lines that do not give a camera (e at l, or an up
+// vector along the gaze). Returns the number of views, or -1 if the file
+// can not be read or has no views.
+static int readViews(const char *file, struct viewSpec **views)
+{
+ FILE *f=fopen(file,"r");
+ if (!f)
+ {
+  fprintf(stderr,"Unable to open the views file %s\n",file);
+  return(-1);
+ }
+ int n=0,size=0,lineNum=0;
+ char line[2048];
+ *views=NULL;
+ while (fgets(line,sizeof(line),f))
+ {
+  lineNum++;
+  double x[9];
+  char name[1024];
+  char *p=line;
+  while (*p==' ' || *p=='\t') p++;
+  if (*p=='#' || *p=='\n' || *p=='\r' || *p==0) continue;
+  int k=sscanf(p,"%lf %lf %lf %lf %lf %lf %lf %lf %lf %1023s",
+		&x[0],&x[1],&x[2],&x[3],&x[4],&x[5],&x[6],&x[7],&x[8],name);
+  if (k!=10)
+  {
+   k=sscanf(p,"%lf %lf %lf %lf %lf %lf %1023s",&x[0],&x[1],&x[2],&x[3],&x[4],&x[5],name);
+   x[6]=0; x[7]=1; x[8]=0;
+  }
+  if (k!=7 && k!=10)
+  {
+   fprintf(stderr,"Skipping malformed line %d in %s: %s",lineNum,file,line);
+   continue;
+  }
+  double gx=x[3]-x[0],gy=x[4]-x[1],gz=x[5]-x[2];
+  if (gx==0 && gy==0 && gz==0)
+  {
+   fprintf(stderr,"Skipping line %d in %s, the camera is at the point it looks at: %s",lineNum,file,line);
+   continue;
+  }
+  //the camera's x axis is the cross product of the gaze and the up vector
+  if (gy*x[8]-gz*x[7]==0 && gz*x[6]-gx*x[8]==0 && gx*x[7]-gy*x[6]==0)
+  {
+   fprintf(stderr,"Skipping line %d in %s, the up vector is along the gaze: %s",lineNum,file,line);
+   continue;
+  }
+  if (n==size)
+  {
+   size=size?2*size:8;
+   struct viewSpec *grown=(struct viewSpec *)realloc(*views,size*sizeof(struct viewSpec));
+   if (!grown)
+   {
+    fprintf(stderr,"Unable to allocate the views, out of memory!\n");
+    fclose(f);
+    free(*views);
+    *views=NULL;
+    return(-1);
+   }
+   *views=grown;
+  }
+  struct viewSpec *v=&(*views)[n++];
+  v->e.px=x[0]; v->e.py=x[1]; v->e.pz=x[2]; v->e.pw=1;
+  v->g.px=gx; v->g.py=gy; v->g.pz=gz; v->g.pw=0;
+  normalize(&v->g);
+  v->up.px=x[6]; v->up.py=x[7]; v->up.pz=x[8]; v->up.pw=0;
+  strcpy(v->name,name);
+ }
+ fclose(f);
+ if (n==0)
+ {
+  fprintf(stderr,"No views in %s\n",file);
+  free(*views);
+  *views=NULL;
+  return(-1);
+ }
+ return(n);
+}
+
+// The n views of -turntable: the camera of the first view circles the
+// vertical axis through the point its gaze passes closest to, keeping
+// its height and looking at that point. View k goes to output_name with
+// _k added before the extension.
+static int turntableViews(const struct viewSpec *first, int n, const char *output_name,
+			struct viewSpec **views)
+{
+ *views=(struct viewSpec *)calloc(n,sizeof(struct viewSpec));
+ if (!*views)
+ {
+  fprintf(stderr,"Unable to allocate the views, out of memory!\n");
+  return(-1);
+ }
+ //point of the gaze line closest to the vertical axis through the origin
+ const struct point3D *e=&first->e,*g=&first->g;
+ double gg=g->px*g->px+g->pz*g->pz;
+ double s=gg>0?-(e->px*g->px+e->pz*g->pz)/gg:0;
+ struct point3D c={e->px+s*g->px,e->py+s*g->py,e->pz+s*g->pz,1};
+ const char *dot=strrchr(output_name,'.');
+ int stem=dot?(int)(dot-output_name):(int)strlen(output_name);
+ for (int k=0;k<n;k++)
+ {
+  struct viewSpec *v=&(*views)[k];
+  double a=2*PI*k/n,ca=cos(a),sa=sin(a);
+  double rx=e->px-c.px,rz=e->pz-c.pz;
+  *v=*first;
+  if (k>0)
+  {
+   v->e.px=c.px+ca*rx-sa*rz;
+   v->e.pz=c.pz+sa*rx+ca*rz;
+   v->g.px=c.px-v->e.px;
+   v->g.py=c.py-v->e.py;
+   v->g.pz=c.pz-v->e.pz;
+   v->g.pw=0;
+   normalize(&v->g);
+  }
+  snprintf(v->name,sizeof(v->name),"%.*s_%03d%s",stem,output_name,k,dot?dot:"");
+ }
+ return(n);
+}
+
+// Frees the per view data of the jobs
+static void deleteViews(struct renderJob *jobs, int numViews)
+{
+ if (!jobs) return;
+ for (int v=0;v<numViews;v++)
+ {
+  deleteRaster(jobs[v].raster);
+  deleteFilm(jobs[v].film);
+  deleteImage(jobs[v].im);
+  free(jobs[v].cam);
+ }
+ free(jobs);
+}
+
+// Pastes the crop window of job into the full sx x sy image in the file
+// name and writes it back. Returns -1 if the file can not be read or is
+// not sx x sy.
+static int compositeCrop(struct renderJob *job, int sx, int sy, const char *name)
+{
+ struct image *base=readPPMimage(name);
+ if (!base) return(-1);
+ if (base->sx!=sx || base->sy!=sy)
+ {
+  fprintf(stderr,"%s is %d x %d, not %d x %d\n",name,base->sx,base->sy,sx,sy);
+  deleteImage(base);
+  return(-1);
+ }
+ struct image *out=newImage(sx,sy);
+ if (!out)
+ {
+  deleteImage(base);
+  return(-1);
+ }
+ //readPPMimage() gives colours in [0,1], back to the bytes of the file
+ const double *src=(const double *)base->rgbdata;
+ unsigned char *dst=(unsigned char *)out->rgbdata;
+ for (int k=0;k<sx*sy*3;k++) dst[k]=(unsigned char)(src[k]*255+.5);
+ const unsigned char *crop=(const unsigned char *)job->im->rgbdata;
+ for (int j=0;j<job->im->sy;j++)
+  memcpy(dst+((job->y0+j)*sx+job->x0)*3,crop+j*job->im->sx*3,job->im->sx*3);
+ imageOutput(out,name);
+ deleteImage(out);
+ deleteImage(base);
+ return(0);
+}
+
 int main(int argc, char *argv[])
 {
  // Main function for the raytracer. Parses input parameters,
  // sets up the initial blank image, and calls the functions
  // that set up the scene and do the raytracing.
- struct image *im;	// Will hold the raytraced image
  struct view *cam;	// Camera and view for this scene
- int sx;		// Size of the raytraced image
+ int sx, sy;		// Size of the raytraced image
+ int crop[4]={0,0,-1,-1};	// Crop window x0 y0 x1 y1 in pixels (-crop), x1<0 for none
+ double cropn[4]={0,0,0,0};	// Crop window as fractions of the image (-cropn)
+ int cropNormalised=0;
+ int composite=0;		// Flag to paste the crop window into the existing output file
  char output_name[1024];	// Name of the output file for the raytraced .ppm image
  struct point3D e;		// Camera view parameters 'e', 'g', and 'up'
  struct point3D g;
  struct point3D up;
  double du, dv;			// Increase along u and v directions for pixel coordinates
  struct colourRGB background;   // Background colour
- unsigned char *rgbIm;
+ int numThreads;		// Number of rendering threads
+ const char *viewsFile=NULL;	// Cameras to render with -views
+ int turntable=0;		// Views around the scene with -turntable
  srand(1522);
- numLight=0;
 
  if (argc<5)
  {
   fprintf(stderr,"RayTracer: Can not parse input parameters\n");
   fprintf(stderr,"USAGE: RayTracer size rec_depth softshadow output_name\n");
-  fprintf(stderr,"   size = Image size (both along x and y)\n");
+  fprintf(stderr,"   size = Image size, N for N x N or WxH, e.g. 640x480\n");
   fprintf(stderr,"   rec_depth = Recursion depth\n");
   fprintf(stderr,"   softshadow = A single digit, 0 disables softshadow. Anything else enables softshadow\n");
   fprintf(stderr,"   output_name = Name of the output file, e.g. MyRender.ppm\n");
+  fprintf(stderr,"Options (after output_name):\n");
+  fprintf(stderr,"   -nobvh = Walk the object list instead of the BVH (for comparison)\n");
+  fprintf(stderr,"   -threads N = Number of rendering threads (default: one per core)\n");
+  fprintf(stderr,"   -packet N = Trace primary rays in packets of N=4, 8 or 16 (default 8), 0 disables packets\n");
+  fprintf(stderr,"   -tileorder O = Order tiles are rendered in: hilbert (default), morton or rows\n");
+  fprintf(stderr,"   -lights N = Replace the two lights of the scene by N small ones scattered over the sky\n");
+  fprintf(stderr,"   -lighttree N = Pick lights from the light tree above N lights (default %d)\n",LIGHT_TREE_MIN);
+  fprintf(stderr,"   -lightsampling cone|volume = Aim shadow rays over the cone a light subtends (default)\n");
+  fprintf(stderr,"       or at points inside its ball\n");
+  fprintf(stderr,"   -shadowrays N = Most shadow rays per light with softshadow on (default %d, at most %d)\n",
+		SHADOW_RAYS,MAX_SHADOW_RAYS);
+  fprintf(stderr,"   -shadowprobes N = Shadow rays per light before checking for a penumbra, fewer than\n");
+  fprintf(stderr,"       -shadowrays turns adaptive sampling on (default off)\n");
+  fprintf(stderr,"   -penumbra T = Trace all the shadow rays where the light let through by the probes\n");
+  fprintf(stderr,"       differs by more than T (default 0)\n");
+  fprintf(stderr,"   -comparelights = Report render time and error of both light samplers and exit\n");
+  fprintf(stderr,"   -sampler S = Pixel sampler: grid (default), independent, stratified, sobol or bluenoise\n");
+  fprintf(stderr,"   -spp N = Samples per pixel (default 9, an odd square for the grid sampler)\n");
+  fprintf(stderr,"   -seed N = Seed of the random numbers (default 1522)\n");
+  fprintf(stderr,"   -threshold T = Drop reflected and refracted rays weighing less than T (default 1/512)\n");
+  fprintf(stderr,"   -roulette R = End rays weighing less than R at random, unbiased before clamping\n");
+  fprintf(stderr,"       (default %g, 0 to turn off)\n",ROULETTE_THRESHOLD);
+  fprintf(stderr,"   -adaptive T = Take the pilot samples of each pixel first, and the rest only where they hit\n");
+  fprintf(stderr,"       different objects or the standard deviation of their colour is above T (default off)\n");
+  fprintf(stderr,"   -pilot N = Pilot samples per pixel with -adaptive, at least 2 (default %d)\n",PILOT_SAMPLES);
+  fprintf(stderr,"   -noshare = Trace the grid samples on the edges between pixels once for each pixel\n");
+  fprintf(stderr,"   -filter F = Reconstruction filter: none (default, weights within the pixel), box, tent,\n");
+  fprintf(stderr,"       gaussian or mitchell, sampled over its whole footprint (needs a sampler other than grid)\n");
+  fprintf(stderr,"   -filterradius R = Radius of the filter in pixels (default .5, 1, 1.5 and 2 respectively)\n");
+  fprintf(stderr,"   -exposure E = Scale of every pixel's weighted mean (default 1, %.2f for the darker\n",
+		GRID_EXPOSURE);
+  fprintf(stderr,"       look of the original renderer, which scaled by the sum of its 3x3 grid weights)\n");
+  fprintf(stderr,"   -progressive = Write a preview after every pass: one sample at every %dth pixel, then\n",
+		PROGRESSIVE_STEP);
+  fprintf(stderr,"       halving the spacing down to every pixel, then doubling the samples per pixel\n");
+  fprintf(stderr,"   -raster = Rasterize the bounds of the objects first, and test primary rays against the\n");
+  fprintf(stderr,"       object in front only, where that is unambiguous (needs the BVH)\n");
+  fprintf(stderr,"   -texfilter F = Texture filtering: trilinear (default, between the mip levels the pixel's\n");
+  fprintf(stderr,"       footprint falls between) or bilinear (the full size texture only)\n");
+  fprintf(stderr,"   -views FILE = Render every camera listed in FILE in one run, sharing the scene. One\n");
+  fprintf(stderr,"       camera per line: ex ey ez lx ly lz [ux uy uz] output_name, looking from e at l\n");
+  fprintf(stderr,"   -turntable N = Render N views circling the scene, written to output_name_000.ppm etc.\n");
+  fprintf(stderr,"   -crop x0 y0 x1 y1 = Trace only the pixels [x0,x1) x [y0,y1), output_name gets that\n");
+  fprintf(stderr,"       part of the image only\n");
+  fprintf(stderr,"   -cropn x0 y0 x1 y1 = Same, in fractions of the width and height of the image\n");
+  fprintf(stderr,"   -composite = Paste the crop window into the full image already in output_name\n");
+  fprintf(stderr,"   -shadebench = Report the throughput of every shading variant and exit\n");
   exit(0);
  }
  sx=atoi(argv[1]);
+ sy=strchr(argv[1],'x')?atoi(strchr(argv[1],'x')+1):sx;
+ if (sx<2 || sy<2)
+ {
+  fprintf(stderr,"Image size %s is too small\n",argv[1]);
+  exit(0);
+ }
  MAX_DEPTH=atoi(argv[2]);
  if (atoi(argv[3])==0) antialiasing=0; else antialiasing=1;
  strcpy(&output_name[0],argv[4]);
+ useBVH=1;
+ shadeBench=0;
+ numThreads=omp_get_max_threads();
+ packetSize=8;
+ lightTreeMin=LIGHT_TREE_MIN;
+ numSceneLights=0;
+ lightSampling=LIGHT_SAMPLE_CONE;
+ shadowRays=SHADOW_RAYS;
+ shadowProbes=SHADOW_PROBES;
+ penumbraThreshold=0;
+ compareLights=0;
+ samplerKind=SAMPLER_GRID;
+ spp=9;
+ seed=1522;
+ traceThreshold=TRACE_THRESHOLD;
+ rouletteThreshold=ROULETTE_THRESHOLD;
+ adaptiveThreshold=0;
+ pilotSamples=PILOT_SAMPLES;
+ shareSamples=1;
+ useRaster=0;
+ tileOrder=TILE_ORDER_HILBERT;
+ texFilter=TEX_FILTER_TRILINEAR;
+ progressive=0;
+ filterKind=FILTER_NONE;
+ filterRadius=0;
+ exposure=1;
+ for (int k=5;k<argc;k++)
+ {
+  if (strcmp(argv[k],"-nobvh")==0) useBVH=0;
+  else if (strcmp(argv[k],"-threads")==0 && k+1<argc) numThreads=atoi(argv[++k]);
+  else if (strcmp(argv[k],"-packet")==0 && k+1<argc) packetSize=atoi(argv[++k]);
+  else if (strcmp(argv[k],"-tileorder")==0 && k+1<argc)
+  {
+   tileOrder=tileOrderType(argv[++k]);
+   if (tileOrder<0)
+   {
+    fprintf(stderr,"Unknown tile order %s, using hilbert\n",argv[k]);
+    tileOrder=TILE_ORDER_HILBERT;
+   }
+  }
+  else if (strcmp(argv[k],"-lights")==0 && k+1<argc) numSceneLights=atoi(argv[++k]);
+  else if (strcmp(argv[k],"-lighttree")==0 && k+1<argc) lightTreeMin=atoi(argv[++k]);
+  else if (strcmp(argv[k],"-lightsampling")==0 && k+1<argc)
+  {
+   k++;
+   if (strcmp(argv[k],"volume")==0) lightSampling=LIGHT_SAMPLE_VOLUME;
+   else if (strcmp(argv[k],"cone")==0) lightSampling=LIGHT_SAMPLE_CONE;
+   else fprintf(stderr,"Unknown light sampler %s, using cone\n",argv[k]);
+  }
+  else if (strcmp(argv[k],"-shadowrays")==0 && k+1<argc) shadowRays=atoi(argv[++k]);
+  else if (strcmp(argv[k],"-shadowprobes")==0 && k+1<argc) shadowProbes=atoi(argv[++k]);
+  else if (strcmp(argv[k],"-penumbra")==0 && k+1<argc) penumbraThreshold=atof(argv[++k]);
+  else if (strcmp(argv[k],"-comparelights")==0) compareLights=1;
+  else if (strcmp(argv[k],"-sampler")==0 && k+1<argc)
+  {
+   samplerKind=samplerType(argv[++k]);
+   if (samplerKind<0)
+   {
+    fprintf(stderr,"Unknown sampler %s, using grid\n",argv[k]);
+    samplerKind=SAMPLER_GRID;
+   }
+  }
+  else if (strcmp(argv[k],"-spp")==0 && k+1<argc) spp=atoi(argv[++k]);
+  else if (strcmp(argv[k],"-seed")==0 && k+1<argc) seed=strtoull(argv[++k],NULL,10);
+  else if (strcmp(argv[k],"-threshold")==0 && k+1<argc) traceThreshold=atof(argv[++k]);
+  else if (strcmp(argv[k],"-roulette")==0 && k+1<argc) rouletteThreshold=atof(argv[++k]);
+  else if (strcmp(argv[k],"-adaptive")==0 && k+1<argc) adaptiveThreshold=atof(argv[++k]);
+  else if (strcmp(argv[k],"-pilot")==0 && k+1<argc) pilotSamples=atoi(argv[++k]);
+  else if (strcmp(argv[k],"-noshare")==0) shareSamples=0;
+  else if (strcmp(argv[k],"-progressive")==0) progressive=1;
+  else if (strcmp(argv[k],"-raster")==0) useRaster=1;
+  else if (strcmp(argv[k],"-views")==0 && k+1<argc) viewsFile=argv[++k];
+  else if (strcmp(argv[k],"-turntable")==0 && k+1<argc) turntable=atoi(argv[++k]);
+  else if (strcmp(argv[k],"-crop")==0 && k+4<argc)
+  {
+   for (int c=0;c<4;c++) crop[c]=atoi(argv[++k]);
+   cropNormalised=0;
+  }
+  else if (strcmp(argv[k],"-cropn")==0 && k+4<argc)
+  {
+   for (int c=0;c<4;c++) cropn[c]=atof(argv[++k]);
+   cropNormalised=1;
+  }
+  else if (strcmp(argv[k],"-composite")==0) composite=1;
+  else if (strcmp(argv[k],"-filter")==0 && k+1<argc)
+  {
+   filterKind=filterType(argv[++k]);
+   if (filterKind<0)
+   {
+    fprintf(stderr,"Unknown filter %s, using none\n",argv[k]);
+    filterKind=FILTER_NONE;
+   }
+  }
+  else if (strcmp(argv[k],"-filterradius")==0 && k+1<argc) filterRadius=atof(argv[++k]);
+  else if (strcmp(argv[k],"-exposure")==0 && k+1<argc) exposure=atof(argv[++k]);
+  else if (strcmp(argv[k],"-texfilter")==0 && k+1<argc)
+  {
+   texFilter=texFilterType(argv[++k]);
+   if (texFilter<0)
+   {
+    fprintf(stderr,"Unknown texture filter %s, using trilinear\n",argv[k]);
+    texFilter=TEX_FILTER_TRILINEAR;
+   }
+  }
+  else if (strcmp(argv[k],"-shadebench")==0) shadeBench=1;
+  else fprintf(stderr,"Unknown option %s ignored\n",argv[k]);
+ }
+
+ if (shadowRays<1) shadowRays=1;
+ if (shadowRays>MAX_SHADOW_RAYS) shadowRays=MAX_SHADOW_RAYS;
+ if (shadowProbes<1) shadowProbes=1;
+ if (MAX_DEPTH>MAX_TRACE_DEPTH)
+ {
+  fprintf(stderr,"Recursion depth capped at %d\n",MAX_TRACE_DEPTH);
+  MAX_DEPTH=MAX_TRACE_DEPTH;
+ }
+ if (compareLights && !antialiasing)
+ {
+  fprintf(stderr,"Comparing light samplers needs softshadow, turning it on\n");
+  antialiasing=1;
+ }
 
- fprintf(stderr,"Rendering image at %d x %d\n",sx,sx);
+ if (cropNormalised)
+ {
+  crop[0]=(int)floor(cropn[0]*sx);
+  crop[1]=(int)floor(cropn[1]*sy);
+  crop[2]=(int)ceil(cropn[2]*sx);
+  crop[3]=(int)ceil(cropn[3]*sy);
+ }
+ int cropped=crop[2]>=0;
+ if (!cropped)
+ {
+  crop[2]=sx;
+  crop[3]=sy;
+ }
+ if (crop[0]<0) crop[0]=0;
+ if (crop[1]<0) crop[1]=0;
+ if (crop[2]>sx) crop[2]=sx;
+ if (crop[3]>sy) crop[3]=sy;
+ if (crop[0]>=crop[2] || crop[1]>=crop[3])
+ {
+  fprintf(stderr,"The crop window is empty\n");
+  exit(0);
+ }
+ int cw=crop[2]-crop[0],ch=crop[3]-crop[1];
+
+ fprintf(stderr,"Rendering image at %d x %d\n",sx,sy);
+ if (cropped)
+  fprintf(stderr,"Crop window [%d,%d) x [%d,%d), %d x %d pixels%s\n",crop[0],crop[2],crop[1],crop[3],cw,ch,
+		composite?", pasted into the output file":"");
  fprintf(stderr,"Recursion depth = %d\n",MAX_DEPTH);
  if (!antialiasing) fprintf(stderr,"Softshadow is off\n");
  else fprintf(stderr,"Softshadow is on\n");
  fprintf(stderr,"Anti-aliasing is always on\n");
  fprintf(stderr,"Output file name: %s\n",output_name);
+ if (numThreads<1) numThreads=1;
+ fprintf(stderr,"Rendering threads = %d, tiles in %s order\n",numThreads,tileOrderName(tileOrder));
+ if (packetSize!=0 && packetSize!=4 && packetSize!=8 && packetSize!=16)
+ {
+  fprintf(stderr,"Packet size must be 4, 8 or 16, using 8\n");
+  packetSize=8;
+ }
+ if (packetSize) fprintf(stderr,"Primary rays traced in packets of %d\n",packetSize);
 
  object_list=NULL;
  light_list=NULL;
 
- // Allocate memory for the new image
- im=newImage(sx, sx);
- if (!im)
- {
-  fprintf(stderr,"Unable to allocate memory for raytraced image\n");
-  exit(0);
- }
- else rgbIm=(unsigned char *)im->rgbdata; //Fan: char *rgb[im->sx][im->sy][3]
-
  buildScene();		// Create a scene. This defines all the
 			// objects in the world of the raytracer
+ bindShader(object_list);	// Shading variant of every material
+ sceneLights=newLightTable(light_list);
+ if (!sceneLights) exit(0);
+
+ sceneBVH=NULL;
+ if (useBVH) sceneBVH=buildBVH(object_list);
+ else fprintf(stderr,"BVH is off, walking the object list\n");
 
  // Mind the homogeneous coordinate w of all vectors below. DO NOT
  // forget to set it to 1, or you'll get junk out of the
@@ -409,16 +1486,50 @@ int main(int argc, char *argv[])
  // and a focal length of -1 (why? where is the image plane?)
  // Note that the top-left corner of the window is at (-2, 2)
  // in camera coordinates.
- cam=setupView(&e, &g, &up, -2, -2, 2, 4);
-
- if (cam==NULL)
+ // The views to render: the camera above, or the ones of -views or
+ // -turntable. They all share the scene built above.
+ struct viewSpec first;
+ first.e=e;
+ first.g=g;
+ first.up=up;
+ strcpy(first.name,output_name);
+ struct viewSpec *views=&first;
+ int numViews=1;
+ if (viewsFile) numViews=readViews(viewsFile,&views);
+ else if (turntable>1) numViews=turntableViews(&first,turntable,output_name,&views);
+ if (numViews<1)
+ {
+  cleanup(object_list);
+  cleanup(light_list);
+  exit(0);
+ }
+ if (numViews>1) fprintf(stderr,"Rendering %d views\n",numViews);
+
+ // Every view has its own camera, image and film. The window is 4 units
+ // wide, and as high as the pixels of a non-square image need (pixels
+ // are square), centred on the gaze.
+ double wt=sy==sx?2:2.0*(sy-1)/(sx-1);
+ struct renderJob *jobs=(struct renderJob *)calloc(numViews,sizeof(struct renderJob));
+ for (int v=0;jobs && v<numViews;v++)
+ {
+  jobs[v].cam=setupView(&views[v].e, &views[v].g, &views[v].up, -2, -2, wt, 4);
+  jobs[v].im=newImage(cw, ch);
+  jobs[v].film=newFilm(crop[0],crop[1],cw,ch);
+  if (jobs[v].cam==NULL || jobs[v].im==NULL || jobs[v].film==NULL)
+  {
+   deleteViews(jobs,numViews);
+   jobs=NULL;
+  }
+ }
+ if (jobs==NULL)
  {
   fprintf(stderr,"Unable to set up the view and camera parameters. Our of memory!\n");
+  if (views!=&first) free(views);
   cleanup(object_list);
   cleanup(light_list);
-  deleteImage(im);
   exit(0);
  }
+ cam=jobs[0].cam;
 
  // Set up background colour here
  background.R=0;
@@ -427,6 +1538,7 @@ int main(int argc, char *argv[])
  du=cam->wsize/(sx-1);		// dv is negative since y increases downward in pixel
  dv=-cam->wsize/(sx-1);		// coordinates and upward in camera coordinates.
 				//Fan: cam->wsize is in distance unit, sx is the resolution
+ pixelSpread=du/fabs(cam->f);	// Same for every view
 				
  fprintf(stderr,"View parameters:\n");
  fprintf(stderr,"Left=%f, Top=%f, Width=%f, f=%f\n",cam->wl,cam->wt,cam->wsize,cam->f);
@@ -436,112 +1548,179 @@ int main(int argc, char *argv[])
  printmatrix(cam->W2C);
  fprintf(stderr,"\n");
 
- fprintf(stderr,"Rendering rows ");
- 
- int center = 1;
+ if (filterKind!=FILTER_NONE && samplerKind==SAMPLER_GRID)
+ {
+  fprintf(stderr,"The %s filter needs a sampler other than grid, using sobol\n",filterName(filterKind));
+  samplerKind=SAMPLER_SOBOL;
+ }
+ struct sampler *smp=newSampler(samplerKind,spp,seed);
+ if (!smp) exit(0);
+ struct filter *flt=NULL;
+ if (filterKind!=FILTER_NONE)
+ {
+  flt=newFilter(filterKind,filterRadius);
+  if (!flt) exit(0);
+  fprintf(stderr,"%s filter, radius %.2f pixels\n",filterName(flt->type),flt->radius);
+ }
+ fprintf(stderr,"%s sampler, %d samples per pixel\n",samplerName(smp->type),smp->spp);
+ if (progressive && numViews>1)
+ {
+  fprintf(stderr,"-progressive renders a single view, turning it off\n");
+  progressive=0;
+ }
+ if (adaptiveThreshold>0 && progressive)
+ {
+  fprintf(stderr,"Adaptive sampling is not available with -progressive, turning it off\n");
+  adaptiveThreshold=0;
+ }
+ if (adaptiveThreshold>0)
+ {
+  if (pilotSamples<2) pilotSamples=2;
+  if (pilotSamples>smp->spp) pilotSamples=smp->spp;
+  fprintf(stderr,"Adaptive sampling, %d pilot samples per pixel\n",pilotSamples);
+ }
+
+ int center = smp->type==SAMPLER_GRID?(smp->nx-1)/2:1;
  int ns=2*center+1; //[ns x ns] subcells per pixel
- double num = ns*ns;
- double dsu = du/(ns-1);
- double dsv = dv/(ns-1); //note dsy is negative
  double weightG[ns][ns];
  //compute weight from Gaussian function (low-pass filter)
  gen_Gaussian_weight(&weightG[0][0],center);
 
- //initialize points and vectors in the camera space
- struct point3D origin;
- origin.px=0;
- origin.py=0;
- origin.pz=0;
- origin.pw=1;
- #ifdef DEBUGRGB
-FILE *debugRGB=fopen("rgb.txt","wb+");
-#endif
+ struct renderJob job;
+ job.du=du;
+ job.dv=dv;
+ job.sampler=smp;
+ job.ns=ns;
+ job.weight=&weightG[0][0];
+ job.filter=flt;
+ job.x0=crop[0];
+ job.y0=crop[1];
+ job.x1=crop[2];
+ job.y1=crop[3];
+ job.firstSample=0;
+ job.endSample=smp->spp;
+ job.step=1;
+ job.skipStep=0;
+ job.raster=NULL;
+ if (useRaster && !sceneBVH)
+ {
+  fprintf(stderr,"The raster pre-pass needs the BVH, turning it off\n");
+  useRaster=0;
+ }
+ for (int v=0;v<numViews;v++)
+ {
+  //same settings for every view, with its own camera, image and film
+  struct renderJob *vj=&jobs[v];
+  job.cam=vj->cam;
+  job.im=vj->im;
+  job.film=vj->film;
+  *vj=job;
+  if (!useRaster) continue;
+  //samples of a pixel reach filter radius-.5 outside it
+  double margin=flt && flt->radius>.5?flt->radius-.5:0;
+  double rasterStart=omp_get_wtime();
+  vj->raster=newRaster(sceneBVH,vj->cam,sx,sy,du,dv,margin);
+  if (!vj->raster) exit(0);
+  fprintf(stderr,"Raster pre-pass: %.1f%% of the pixels have one object in front, %.1f%% none (%.3f s)\n",
+		100.0*vj->raster->numFront/(sx*sy),100.0*vj->raster->numEmpty/(sx*sy),omp_get_wtime()-rasterStart);
+ }
+
+ if (shadeBench)
+ {
+  benchShade(cam);
+  deleteSampler(smp);
+  deleteFilter(flt);
+  deleteViews(jobs,numViews);
+  if (views!=&first) free(views);
+  deleteBVH(sceneBVH);
+  deleteLightTable(sceneLights);
+  cleanup(object_list);
+  cleanup(light_list);
+  exit(0);
+ }
+
+ if (compareLights)
+ {
+  if (numViews>1) fprintf(stderr,"Comparing the light samplers on the first view only\n");
+  compareLightSampling(&jobs[0],numThreads,views[0].name);
+  deleteSampler(smp);
+  deleteFilter(flt);
+  deleteViews(jobs,numViews);
+  if (views!=&first) free(views);
+  deleteBVH(sceneBVH);
+  deleteLightTable(sceneLights);
+  cleanup(object_list);
+  cleanup(light_list);
+  exit(0);
+ }
+
  #ifdef DEBUGTEXT
 debugUV=fopen("uv.txt","wb+");
 #endif
 
-
- //openmp multi-threaded
-// #pragma omp parallel for
- for (int j=0;j<sx;j++)		// For each of the pixels in the image
+ if (progressive)
  {
-  //direction vector: pixel coordinate-origin
-  struct point3D ps;
-  ps.py=cam->wt+j*dv; //note: dv is negative
-  ps.pz=cam->f;
-  ps.pw=0;
-
-   for (int i=0;i<sx;i++)
+  if (renderProgressive(&jobs[0],numThreads,views[0].name)<0)
   {
-    //update to the current pixel position
-    ps.px=cam->wl+i*du;
-
-    struct colourRGB col_avg={0,0,0};
-    struct point3D copyP;
-    copyPoint(&ps,&copyP);
-    //anti-aliasing by supersampling
-    //divide per pixel into nsxns cells and randomly shoot rays
-    for(int su=0;su<ns;++su){
-	for(int sv=0;sv<ns;++sv){
-	    struct colourRGB col={0,0,0};
-
-	    //for each subcell
-	    //construct the primary ray
-	    struct ray3D *ray = newRay(&origin,&copyP);
-
-	    //transform the ray into the world space
-	    matRayMult(cam->C2W,ray);
-	    rayTrace(ray,0,&col,NULL);
-
-	    //average the col with Gaussian weight
-	    mult_col(weightG[su][sv],&col);
-	    add_col(&col,&col_avg);
-
-	    //update to the next subcell position
-	    copyP.px+=dsu;
-	    free(ray);
-	    ray = NULL;
-	}
-	copyP.px=ps.px;
-	copyP.py+=dsv;
-    }
-
-    //set color of this pixel
-    //printf("(%f, %f, %f)",col.R,col.G,col.B);
-    *(rgbIm+j*sx*3+i*3+0) = col_avg.R*255;
-    *(rgbIm+j*sx*3+i*3+1) = col_avg.G*255;
-    *(rgbIm+j*sx*3+i*3+2) = col_avg.B*255;
-
- #ifdef DEBUGRGB
-    fprintf(debugRGB,"(%d %d %d) ",(int)(col_avg.R*255),(int)(col_avg.G*255),(int)(col_avg.B*255));
-/*    if(j>200 && col_avg.R*255<10)
-	printf("wrong!\n");
-*/	
- #endif
+   cleanup(object_list);
+   cleanup(light_list);
+   deleteViews(jobs,numViews);
+   exit(0);
+  }
+ }
+ else if (renderImage(jobs,numViews,numThreads)<0)
+ {
+  cleanup(object_list);
+  cleanup(light_list);
+  deleteViews(jobs,numViews);
+  exit(0);
+ }
 
-  } // end of this row
  #ifdef DEBUGRGB
+ struct image *im=jobs[0].im;
+ unsigned char *rgbIm=(unsigned char *)im->rgbdata; //Fan: char *rgb[im->sx][im->sy][3]
+ FILE *debugRGB=fopen("rgb.txt","wb+");
+ for (int j=0;j<im->sy;j++)
+ {
+  for (int i=0;i<im->sx;i++)
+   fprintf(debugRGB,"(%d %d %d) ",*(rgbIm+j*im->sx*3+i*3+0),*(rgbIm+j*im->sx*3+i*3+1),
+		*(rgbIm+j*im->sx*3+i*3+2));
   fprintf(debugRGB,"\n\n");
- #endif
- } // end for j
-
- #ifdef DEBUGRGB
+ }
  fclose(debugRGB);
  #endif
  #ifdef DEBUGTEXT
  fclose(debugUV);
  #endif
 
- fprintf(stderr,"\nDone!\n");
-
- // Output rendered image
- imageOutput(im,output_name);
+ // Output rendered images
+ for (int v=0;v<numViews;v++)
+ {
+  if (cropped && composite)
+  {
+   if (compositeCrop(&jobs[v],sx,sy,views[v].name)<0)
+   {
+    //leave the file alone, the crop window goes next to it
+    char name[1100];
+    snprintf(name,sizeof(name),"%s.crop.ppm",views[v].name);
+    fprintf(stderr,"Unable to composite into %s, writing the crop window to %s\n",views[v].name,name);
+    imageOutput(jobs[v].im,name);
+    continue;
+   }
+  }
+  else imageOutput(jobs[v].im,views[v].name);
+  if (numViews>1) fprintf(stderr,"View %d written to %s\n",v,views[v].name);
+ }
 
  // Exit section. Clean up and return.
+ deleteSampler(smp);
+ deleteFilter(flt);
+ deleteViews(jobs,numViews);	// Cameras, rendered images and films
+ if (views!=&first) free(views);
+ deleteBVH(sceneBVH);
+ deleteLightTable(sceneLights);
  cleanup(object_list);		// Object and light lists
  cleanup(light_list);
- deleteImage(im);				// Rendered image
- free(cam);					// camera view
  exit(0);
 }
 
@@ -556,15 +1735,20 @@ debugUV=fopen("uv.txt","wb+");
 // Os is the 'source' object for the ray we are processing, can be NULL, and is used to ensure we don't 
 // return a self-intersection due to numerical errors for recursive raytrace calls.
 // note: ray is in the world coords
-void findFirstHit(struct ray3D *ray, double *lambda, struct object3D *Os,
+void findFirstHit(const struct ray3D *ray, double *lambda, struct object3D *Os,
 		  	struct object3D **obj, struct point3D *p, 
-			struct point3D *n, double *a, double *b, int depth, struct object3D *topBox){
+			struct point3D *n, double *a, double *b, int *goingOut,
+			int depth, struct object3D *topBox){
+    if(sceneBVH){
+	//container boxes are not in the hierarchy, so topBox is not needed
+	bvhFirstHit(sceneBVH,ray,lambda,obj,p,n,a,b,goingOut);
+	return;
+    }
+
     *lambda = -1;
     *obj = NULL;
     int initial=1;
     double temp=0; //temporary lambda
-    struct point3D _n,_p;
-    double _a,_b;
 
     struct object3D *cur_obj=object_list;
     struct object3D *child_list=NULL;
@@ -582,7 +1766,7 @@ void findFirstHit(struct ray3D *ray, double *lambda, struct object3D *Os,
 		continue;
 	    }
 
-	cur_obj->intersect(cur_obj,ray,&temp,&_p,&_n,&_a,&_b);
+	temp=hitDistance(cur_obj,ray);
 
 	//Q1:should it compare with 1 instead??
 	if(temp>0){
@@ -591,22 +1775,6 @@ void findFirstHit(struct ray3D *ray, double *lambda, struct object3D *Os,
 		initial = 0;
 		*lambda = temp;
 		*obj = cur_obj;
-
-		/* Transform n and p back to the world coords */
-		// transform normal vectors n
-		double Tinv_trans[4][4]={0};
-		transpose(&(cur_obj->Tinv[0][0]),&(Tinv_trans[0][0]));
-		matVecMult(Tinv_trans,&_n);
-		normalize(&_n);
-
-		// transform the intersect point p
-		matVecMult(cur_obj->T,&_p);
-
-		memcpy(n,&_n,sizeof(struct point3D));
-		memcpy(p,&_p,sizeof(struct point3D));
-
-		*a=_a;
-		*b=_b;
 	    }
 	}
 
@@ -618,6 +1786,16 @@ void findFirstHit(struct ray3D *ray, double *lambda, struct object3D *Os,
 	    cur_obj=cur_obj->next;;
 	}
     }
+
+    if(*obj){
+	//surface attributes, only for the closest hit
+	surfaceAt(*obj,ray,*lambda,p,n,a,b,goingOut);
+
+	/* Transform n and p back to the world coords */
+	matVecMult((*obj)->Tnorm,n);
+	normalize(n);
+	matVecMult((*obj)->T,p);
+    }
 }
 
 
@@ -626,7 +1804,11 @@ void findFirstHit(struct ray3D *ray, double *lambda, struct object3D *Os,
 // n - normal unit vector
 // b - intersection to eye unit vector
 // p - intersection point
-struct ray3D* gen_refractionRay(struct object3D* obj, struct point3D* n, struct point3D* b, struct point3D* p){
+// goingOut - 1 if the ray leaves the object at p (as returned by findFirstHit)
+// ray - set to the refracted ray, returns 0 (and ray is not set) on total
+//       internal reflection
+int gen_refractionRay(struct object3D* obj, int goingOut, struct point3D* n, struct point3D* b, struct point3D* p,
+		    struct ray3D *ray){
     struct point3D d;
     d.px=-(b->px);
     d.py=-(b->py);
@@ -635,7 +1817,7 @@ struct ray3D* gen_refractionRay(struct object3D* obj, struct point3D* n, struct
 
     double ni, nt;
     double cosCritical=-1;//critical angle for total internal reflection
-    if(!obj->goingOut){
+    if(!goingOut){
 	nt = obj->r_index;
 	ni = 1.0;
     }else{
@@ -651,7 +1833,7 @@ struct ray3D* gen_refractionRay(struct object3D* obj, struct point3D* n, struct
     double cosTheta = dot(n,b);
     //if theta > critical angle, no reflection
     if(cosTheta < cosCritical)
-	return 0;
+	return(0);
 
     struct point3D temp;
     double cosPhi = (1-cosTheta*cosTheta)*(ni*ni)/(nt*nt);
@@ -672,7 +1854,8 @@ struct ray3D* gen_refractionRay(struct object3D* obj, struct point3D* n, struct
     assert(obj->alpha>0);
     */
 
-    return(newRay(p,&temp));
+    initRay(ray,p,&temp);
+    return(1);
 }
 
 
@@ -680,7 +1863,8 @@ struct ray3D* gen_refractionRay(struct object3D* obj, struct point3D* n, struct
 // n - normal unit vector
 // b - intersection to eye unit vector
 // p - intersection point
-struct ray3D* gen_reflectionRay(struct point3D* n, struct point3D* b, struct point3D* p){
+// ray - set to the reflected ray
+void gen_reflectionRay(struct point3D* n, struct point3D* b, struct point3D* p, struct ray3D *ray){
     struct point3D r;
     copyPoint(n,&r);
     double up=2*dot(n,b);
@@ -689,9 +1873,138 @@ struct ray3D* gen_reflectionRay(struct point3D* n, struct point3D* b, struct poi
     normalize(&r);
     r.pw=0;
 
-    return(newRay(p,&r)); //r is normalized
+    initRay(ray,p,&r); //r is normalized
+}
+
+
+/*
+   A ray on the stack of rayTrace(). Rays stay on the stack until the
+   rays they spawn are done, each adds its colour (clamped to 1, as the
+   recursive tracer did) times wrel to the colour of its parent.
+*/
+struct traceItem{
+	struct ray3D ray;
+	struct object3D *Os;	// Object the ray leaves from
+	int depth;
+	int parent;		// Index of the ray that spawned it, -1 for the first one
+	int shaded;		// Flag set once the hit has been shaded and the secondary rays pushed
+	struct colourRGB w;	// Throughput, weight of the ray's colour in the sample
+	struct colourRGB wrel;	// Weight of the ray's colour in its parent's
+	struct colourRGB col;	// Colour gathered so far
+};
+
+// Pushes the rays spawned by the hit of the ray on top of the stack, and
+// returns the new top. A ray whose weight (the largest channel of its
+// throughput) is below traceThreshold can not change the pixel and is
+// dropped. Below rouletteThreshold it survives with probability
+// weight/rouletteThreshold, and its colour is divided by that probability
+// so the sample stays unbiased before clamping. The colour of every ray is
+// still clamped to 1 once its children are added, which clips the rare
+// boosted survivors, so the image is slightly biased (darker) where they
+// saturate. The first ray (the refraction) is pushed last so it is traced
+// first.
+static int pushSecondary(struct traceItem *stack, int top, const struct secondaryRays *next,
+			struct object3D *obj)
+{
+ int parent=top-1;
+ for(int k=next->n-1;k>=0;--k){
+    const struct colourRGB *w=&stack[parent].w;
+    struct colourRGB wrel=next->w[k];
+    struct colourRGB wk={w->R*wrel.R,w->G*wrel.G,w->B*wrel.B};
+    double weight=max(wk.R,max(wk.G,wk.B));
+    if(weight<traceThreshold) continue;
+    if(weight<rouletteThreshold){
+	double q=weight/rouletteThreshold;
+	if(nextRandom()>=q) continue;
+	mult_col(1/q,&wk);
+	mult_col(1/q,&wrel);
+    }
+    struct traceItem *it=&stack[top++];
+    it->ray=next->ray[k];
+    it->Os=obj;
+    it->depth=stack[parent].depth+1;
+    it->parent=parent;
+    it->shaded=0;
+    it->w=wk;
+    it->wrel=wrel;
+    it->col.R=it->col.G=it->col.B=0;
+ }
+ return(top);
+}
+
+// Traces the rays on the stack, and every ray they spawn, until the
+// first one is done, and sets col to its colour. Every hit pushes at most
+// two rays, one of which is done before the other starts, so the stack
+// never holds more than 2*MAX_DEPTH+1 rays. Returns the object hit by the
+// first ray if it had not been shaded yet, NULL otherwise.
+static struct object3D *traceStack(struct traceItem *stack, int top, struct colourRGB *col)
+{
+ struct object3D *firstHit=NULL;
+ while(top>0){
+	struct traceItem *it=&stack[top-1];
+	if(!it->shaded){
+	    double lambda=0, a=0,b=0; //a,b are texture coords
+	    struct object3D* hitObj=NULL;
+	    struct point3D p,n;
+	    int goingOut=0;	//1 if the ray hits the object from the inside
+	    struct secondaryRays next;
+	    next.n=0;
+
+	    //find the first intersection
+	    //return lambda, hit object(next object source), hit point and normal
+	    findFirstHit(&it->ray,&lambda,it->Os,&hitObj,&p,&n,&a,&b,&goingOut,it->depth,NULL);
+
+	    //if this is a bounding box, draw the leaves only
+	    if(hitObj && hitObj->children!=NULL){
+		struct object3D* topBox = hitObj;
+		hitObj=NULL;
+		findFirstHit(&it->ray,&lambda,it->Os,&hitObj,&p,&n,&a,&b,&goingOut,it->depth,topBox);
+	    }
+
+	    //Phong illumination, or environment mapping if nothing was hit
+	    if(hitObj) rtShade(hitObj,&p,&n,&it->ray,it->depth,a,b,goingOut,&it->col,&next);
+	    else if(backgroundObj->texImg!=NULL) bgMap(&it->ray,&it->col);
+	    it->shaded=1;
+	    if(it->parent<0) firstHit=hitObj;
+	    top=pushSecondary(stack,top,&next,hitObj);
+	    continue;
+	}
+
+	//the rays spawned by this one are done
+	if(it->col.R>1) it->col.R=1;
+	if(it->col.G>1) it->col.G=1;
+	if(it->col.B>1) it->col.B=1;
+	if(it->parent<0) *col=it->col;
+	else{
+	    struct colourRGB *pc=&stack[it->parent].col;
+	    pc->R+=it->wrel.R*it->col.R;
+	    pc->G+=it->wrel.G*it->col.G;
+	    pc->B+=it->wrel.B*it->col.B;
+	}
+	top--;
+ }
+ return(firstHit);
 }
 
+// rayTrace() below, returning the object the ray hit (NULL if none)
+static struct object3D *traceRay(struct ray3D *ray, int depth, struct colourRGB *col,
+			struct object3D *Os)
+{
+ assert(ray);
+ if (depth>MAX_DEPTH)	// Max recursion depth reached
+    return(NULL);
+
+ struct traceItem stack[2*MAX_TRACE_DEPTH+1];
+ struct traceItem *it=&stack[0];
+ it->ray=*ray;
+ it->Os=Os;
+ it->depth=depth;
+ it->parent=-1;
+ it->shaded=0;
+ it->w.R=it->w.G=it->w.B=1;
+ it->col.R=it->col.G=it->col.B=0;
+ return(traceStack(stack,1,col));
+}
 
 // Ray-Tracing function. It finds the closest intersection between
 // the ray and any scene objects, calls the shading function to
@@ -703,68 +2016,147 @@ struct ray3D* gen_reflectionRay(struct point3D* n, struct point3D* b, struct poi
 // errors. For the top level call, Os should be NULL. And thereafter
 // it will correspond to the object from which the recursive
 // ray originates.
+//
+// The reflected and refracted rays are not traced recursively but from
+// an explicit stack (see traceStack()) that carries the throughput of
+// each ray, so rays that can not contribute much are dropped.
 void rayTrace(struct ray3D *ray, int depth, struct colourRGB *col,
 			struct object3D *Os)
 {
-	assert(ray);
-	if (depth>MAX_DEPTH)	// Max recursion depth reached
-	    return;
-
-	double lambda=0, a=0,b=0; //a,b are texture coords
-    	struct object3D* hitObj=NULL;
-        struct point3D p,n;
-	int background=0;
-        //find the first intersection
-        //return lambda, hit object(next object source), hit point and normal
-        findFirstHit(ray,&lambda,Os,&hitObj,&p,&n,&a,&b,depth,NULL);
-
-        if(hitObj){
-            //if hit an object
-	    //check if this is a bounding box
-	    //then draw the leaves only
-	    if(hitObj->children!=NULL){
-		struct object3D* top = hitObj;
-		hitObj=NULL;
-		findFirstHit(ray,&lambda,Os,&hitObj,&p,&n,&a,&b,depth,top);
-	    }
-
+ traceRay(ray,depth,col,Os);
+}
 
-	    //Phong illumination
-	    if(hitObj)
-		rtShade(hitObj,&p,&n,ray,depth,a,b,col);
-	    else 
-		background=1;
+// Shades the primary ray, whose closest hit is hitObj at lambda (NULL if
+// nothing is hit), and traces the rays it spawns. This is rayTrace() at
+// depth 0 once findFirstHit() is done.
+static void shadePrimary(const struct ray3D *ray, struct object3D *hitObj, double lambda,
+			struct colourRGB *col)
+{
+    struct traceItem stack[2*MAX_TRACE_DEPTH+1];
+    struct traceItem *it=&stack[0];
+    double a=0,b=0;
+    int goingOut=0;
+    struct point3D p,n;
+    struct secondaryRays next;
+
+    col->R=col->G=col->B=0;
+    it->ray=*ray;
+    if(!hitObj){
+	if(backgroundObj->texImg!=NULL) bgMap(&it->ray,col);
+	return;
+    }
 
-/*	    #ifdef DEBUGTEXT
-	    if(hitObj->texImg){
-		fprintf(debugUV,"%.3f %.3f    ",a,b);
-	    }
-	    #endif
-*/
-	}else
-	    background=1;
+    //surface attributes of the closest hit
+    surfaceAt(hitObj,&it->ray,lambda,&p,&n,&a,&b,&goingOut);
+    matVecMult(hitObj->Tnorm,&n);
+    normalize(&n);
+    matVecMult(hitObj->T,&p);
+
+    //the hit is shaded here, traceStack() traces the rays it spawns
+    it->Os=NULL;
+    it->depth=0;
+    it->parent=-1;
+    it->shaded=1;
+    it->w.R=it->w.G=it->w.B=1;
+    it->col.R=it->col.G=it->col.B=0;
+    rtShade(hitObj,&p,&n,&it->ray,0,a,b,goingOut,&it->col,&next);
+    traceStack(stack,pushSecondary(stack,1,&next,hitObj),col);
+}
 
-	if(background && backgroundObj->texImg!=NULL){
-	    //environment mapping
-	    //get color from the background
-	    bgMap(ray,col);
-	}
+// Shades every lane of a packet of primary rays after packetFirstHit() has
+// found the closest object along each of them. This is the start of
+// rayTrace() at depth 0, secondary rays go through the scalar path.
+void rayTracePacket(struct rayPacket *pk, struct pixelSample *ps, struct colourRGB *col)
+{
+    for(int k=0;k<pk->n;++k){
+	struct ray3D ray;
+	shadeSample=ps[k];
+	ray.p0.px=pk->ox[k]; ray.p0.py=pk->oy[k]; ray.p0.pz=pk->oz[k]; ray.p0.pw=1;
+	ray.d.px=pk->dx[k];  ray.d.py=pk->dy[k];  ray.d.pz=pk->dz[k];  ray.d.pw=0;
+	ray.rayPos=&rayPosition;
+	shadePrimary(&ray,pk->obj[k],pk->t[k],&col[k]);
+    }
 }
 
 void bgMap(struct ray3D* ray, struct colourRGB* col){
 	double t=0;
 	struct point3D _n,_p;
 	double u,v;
-	backgroundObj->intersect(backgroundObj,ray,&t,&_p,&_n,&u,&v);
+	backgroundObj->intersect(backgroundObj,ray,&t,&_p,&_n,&u,&v,NULL);
+	//the background is seen head on, only the distance sets the footprint
+	double width=0;
+	if(texFilter==TEX_FILTER_TRILINEAR) width=pixelSpread*t*length(&ray->d)*backgroundObj->texScale;
 	if(u<0) u=0;
 	else if(u>1) u=1;
 	if(v<0) v=0;
 	else if(v>1) v=1;
 	///assert(u>=0 && u<1 && v>=0 && v<1);
 	//fill in col with the texture RGB colour
-	backgroundObj->textureMap(backgroundObj->texImg,u,v,&col->R,&col->G,&col->B);
+	backgroundObj->textureMap(backgroundObj->texImg,u,v,width,&col->R,&col->G,&col->B);
+}
+
+
+// Random shift of a light's lattice of cone samples, see shadowSample()
+struct latticeShift{
+    double s1, s2;
+};
+
+static inline void newLatticeShift(struct latticeShift *shift){
+    shift->s1=nextRandom();
+    shift->s2=nextRandom();
 }
 
+// Light transmitted to p along shadow ray i of n to a random point of
+// light l. The cone sampler spreads the n rays over the cone with a rank-1
+// lattice (golden ratio steps in phi), randomly shifted by shift, which
+// keeps every sample uniform over the cone but stratifies them.
+static inline double shadowSample(const struct lightTable *lt, int l, struct point3D *p,
+				int i, int n, const struct latticeShift *shift){
+    //create ray from hitObj to a random point on light source
+    struct point3D shadowRay;
+    if(lightSampling==LIGHT_SAMPLE_CONE){
+	double u1 = (i+.5)/n+shift->s1;
+	double u2 = i*0.6180339887498949+shift->s2;
+	lightConePoint(lt,l,p,u1-floor(u1),u2-floor(u2),&shadowRay);
+    }else{
+	double theta = 2*PI*nextRandom();
+	double phi = 2*PI*nextRandom();
+	double rxyz = nextRandom();
+	double rxy = rxyz*sin(theta);
+	lightPoint(lt,l,rxy*cos(phi),rxy*sin(phi),rxyz*cos(theta),&shadowRay);
+    }
+    subVectors(p,&shadowRay);
+    shadowRay.pw=0; //now it's a vector
+
+    //note shadow ray shall not be normalized
+    struct ray3D ray_to_light;
+    initRay(&ray_to_light,p,&shadowRay);
+    return(findShadowHit(&ray_to_light,object_list));
+}
+
+// Adds the diffuse (dim, with rd folded in) and specular (sim, with rs
+// folded in) light of light l to col, scaled by w
+static inline void addLight(const struct lightTable *lt, int l, double dim, double sim,
+		double R, double G, double B, double w, struct colourRGB *col){
+    struct colourRGB col_ds={lt->R[l]*(dim*R+sim),lt->G[l]*(dim*G+sim),lt->B[l]*(dim*B+sim)};
+    mult_col(w,&col_ds);
+    add_col(&col_ds,col);
+}
+
+// Width, in texture coordinates, of the footprint of a pixel on the surface
+// of obj at p: the spread of the pixel at the distance travelled by the ray,
+// stretched by the slant of the surface (by the geometric mean of the two
+// axes of the footprint, as the mip levels are square). Reflected and
+// refracted rays only count their own segment, so their footprints come
+// out on the sharp side.
+static inline double texFootprint(struct object3D *obj, struct point3D *p, struct point3D *n,
+				struct ray3D *ray){
+    struct point3D d={p->px-ray->p0.px,p->py-ray->p0.py,p->pz-ray->p0.pz,0};
+    double dist=length(&d);
+    double c=dist>0?fabs(dot(n,&d))/dist:1;	// n is a unit vector
+    if(c<SLANT_MIN) c=SLANT_MIN;
+    return(pixelSpread*dist*obj->texScale/sqrt(c));
+}
 
 // This function implements the shading model as described in lecture. It takes
 // - A pointer to the first object intersected by the ray (to get the colour properties)
@@ -774,28 +2166,31 @@ void bgMap(struct ray3D* ray, struct colourRGB* col){
 //   the Phong specular component)
 // - The current racursion depth
 // - The (a,b) texture coordinates (meaningless unless texture is enabled)
+// - goingOut, 1 if the ray hit the surface from inside the object
 //
 // Returns:
 // - The colour for this ray (using the col pointer)
-void rtShade(struct object3D *obj, struct point3D *p, struct point3D *n, struct ray3D *ray,
-				int depth, double _a, double _b, struct colourRGB *col)
+//
+// The shading code is compiled once for every combination of the SHADE_*
+// material flags (see shadeFlags()), each object is bound to its variant
+// by bindShader() so the tests on these flags are resolved at compile
+// time. rtShade() calls the variant of the object.
+template<int FLAGS>
+static void shadeKernel(struct object3D *obj, struct point3D *p, struct point3D *n, struct ray3D *ray,
+				int depth, double _a, double _b, int goingOut, struct colourRGB *col,
+				struct secondaryRays *next)
 {
-if(!obj) return;
-
 //ray shoot on the back face 
 int backface = 0;
-if(dot(n,&ray->d)>=0)
-	if(obj->frontAndBack)
-	    backface=1;
-	else return; 
-
-
- if(!obj->frontAndBack && dot(n,&ray->d)>=0) return; //ray shoot on the back face ( of plane object)
- if(col->R==1 && col->G==1 && col->B==1) return;
+next->n=0;
+if(dot(n,&ray->d)>=0){
+	if(!(FLAGS&SHADE_TWOSIDED)) return;	//back face of a one sided object
+	backface=1;
+}
 
  double R,G,B;			// Colour for the object in R G and B
 
- if (obj->texImg==NULL)		// Not textured, use object colour
+ if (!(FLAGS&SHADE_TEXTURED))	// Not textured, use object colour
  {
   R=obj->col.R;
   G=obj->col.G;
@@ -805,7 +2200,9 @@ if(dot(n,&ray->d)>=0)
  {
   // Get object colour from the texture given the texture coordinates (a,b), and the texturing function
   // for the object. Note that we will use textures also for Photon Mapping.
-  obj->textureMap(obj->texImg,_a,_b,&R,&G,&B);
+  double width=0;
+  if (texFilter==TEX_FILTER_TRILINEAR) width=texFootprint(obj,p,n,ray);
+  obj->textureMap(obj->texImg,_a,_b,width,&R,&G,&B);
  }
 
  //compute the unit p->OS(eye) vector
@@ -825,12 +2222,10 @@ if(dot(n,&ray->d)>=0)
  rs=obj->alb.rs;
  rg=obj->alb.rg;
 
- struct ray3D* rRay;
-
  /*refraction*/
- if(depth<MAX_DEPTH && alpha<1){
+ if((FLAGS&SHADE_REFRACT) && depth<MAX_DEPTH){
 
-	struct colourRGB col_refract={0,0,0};
+	struct ray3D *rRay=&next->ray[next->n];
 	struct point3D n_copy;
 	copyPoint(n,&n_copy);
 
@@ -839,9 +2234,7 @@ if(dot(n,&ray->d)>=0)
 	}
 
 	//alpha will be recalculated by this function
-	rRay = gen_refractionRay(obj,&n_copy,&b,p);
-
-	if(rRay != NULL){
+	if(gen_refractionRay(obj,goingOut,&n_copy,&b,p,rRay)){
 		//reset alpha, ra-rg
 		alpha = obj->alpha;
 		ra *=(1-alpha);
@@ -849,160 +2242,209 @@ if(dot(n,&ray->d)>=0)
 		rs *=(1-alpha);
 		rg *=(1-alpha);
 		alpha=1-alpha;
-	
-		rayTrace(rRay,depth+1,&col_refract,obj);
-	    	free(rRay);
-	      	rRay=NULL;
+
 		//note: alpha is set to the transmittance by the above function.
 		//i.e. the larger the alpha, the more transparent this object is
-		col_refract.R*=alpha*R;
-		col_refract.G*=alpha*G;
-		col_refract.B*=alpha*B;
-		add_col(&col_refract,col);
-
-		if(col->R>=1 && col->G>=1 && col->B>=1){
-		     col->R=1;
-		     col->G=1;
-		     col->B=1;
-		     return;
-		}
+		next->w[next->n].R=alpha*R;
+		next->w[next->n].G=alpha*G;
+		next->w[next->n].B=alpha*B;
+		next->n++;
 	 }
  }
 
  //if this object is not a mirror, compute the local illumination (Phong model).
- if(obj->isMirror==0){
-    
-     //for all the light sources
-     struct object3D *cur;
-     int num_light=0;
-     cur=light_list;
-
-     while(cur!=NULL){
-        double lr,lg,lb;
-        lr=cur->col.R;
-        lg=cur->col.G;
-        lb=cur->col.B;
-     
-        //compute the unit p->light vector
-        struct point3D s={0,0,0,1}; //the p->light vector
-        matVecMult(cur->T,&s);
-        subVectors(p,&s);
-        //normalize the p->light vector
-        normalize(&s);
-        s.pw=0;
- 
-        //compute the unit reflection vector
-        struct point3D r;
-        copyPoint(n,&r);
-        double up=2*dot(n,&s);
-        multVector(up,&r);
-        subVectors(&s,&r);
-        normalize(&r);
-        r.pw=0;
-    
-    
-        /* ambient */
-        add_col(ra*lr*R,ra*lg*G,ra*lb*B,col);
+ if(!(FLAGS&SHADE_MIRROR)){
     
-        /* shadow (diffuse and specular) */
+     const struct lightTable *lt=sceneLights;
+     //if soft-shadow is enabled,
+     //shoot multiple rays towards each light source
+     const int numRays=(FLAGS&SHADE_SOFTSHADOW)?shadowRays:1;
+     double diff[LIGHT_CHUNK],spec[LIGHT_CHUNK];
 
-	//if soft-shadoe is enabled,
-	//shoot multiple rays towards the light source
-	int numRays=1;
-	if(antialiasing==1) numRays = 10;
+     if(lt->num>lightTreeMin){
+	//many lights, each shadow ray goes to one light picked from the light tree
+	/* ambient */
+	add_col(ra*lt->ambient[0]*R,ra*lt->ambient[1]*G,ra*lt->ambient[2]*B,col);
 
 	for(int light_i=0;light_i<numRays;++light_i){
-            //create ray from hitObj to a random point on light source
-    	    struct point3D shadowRay={0,0,0,1}; //it's still a point for now
-	    double theta = 2*PI*drand48();
-	    double phi = 2*PI*drand48();
-      	    double rxyz = light_radius[num_light]*drand48();
-	    double rxy = rxyz*sin(theta);
-	    shadowRay.px = rxy*cos(phi);
-	    shadowRay.py = rxy*sin(phi);
-            shadowRay.pz = rxyz*cos(theta);
-            matVecMult(cur->T,&shadowRay); //transform to object world
-            subVectors(p,&shadowRay);
-            shadowRay.pw=0; //now it's a vector
-        
-	    //note shadow ray shall not be normalized
-            struct ray3D *ray_to_light = newRay(p,&shadowRay);
-	    double lightItensity;
-            lightItensity = findShadowHit(ray_to_light,object_list);
-
-            free(ray_to_light);
-            ray_to_light=NULL;
-           
-        
+	    double pdf;
+	    int l=sampleLight(lt,p,n,FLAGS&SHADE_TWOSIDED,nextRandom(),&pdf);
+	    struct latticeShift shift;
+	    if(lightSampling==LIGHT_SAMPLE_CONE) newLatticeShift(&shift);
+	    double lightItensity=shadowSample(lt,l,p,0,1,&shift);
 	    if(lightItensity>0){
-		struct colourRGB col_ds={0,0,0};
-                /* diffuse */
-                double dim = dot(n,&s);
-                if(dim<0){
-                	if(obj->frontAndBack) dim=-dim;
-            	else dim=0;
-                }
-                add_col(rd*lr*R*dim,rd*lg*G*dim,rd*lb*B*dim,&col_ds);
-            
-            
-                /* specular */
-                dim = dot(&b,&r);
-                if(dim<0){
-                	if(obj->frontAndBack) dim=-dim;
-            	else dim=0;
-                }
-                dim = pow(dim,obj->shinyness);
-                add_col(rs*lr*dim,rs*lg*dim,rs*lb*dim,&col_ds);
-
-		mult_col(lightItensity*((double)1/numRays),&col_ds);
-		add_col(&col_ds,col);
-        
-            }
-	}//end of shadow
-    
-        //next light source
-        cur=cur->next;
-	num_light+=1;
+		lightTerms(lt,l,1,p,n,&b,obj->shinyness,FLAGS&SHADE_TWOSIDED,diff,spec);
+		addLight(lt,l,rd*diff[0],rs*spec[0],R,G,B,lightItensity/pdf*((double)1/numRays),col);
+	    }
+	}
+     }
+     else
+     //for all the light sources, LIGHT_CHUNK at a time
+     for(int first=0;first<lt->num;first+=LIGHT_CHUNK){
+	int count=lt->num-first<LIGHT_CHUNK?lt->num-first:LIGHT_CHUNK;
+	lightTerms(lt,first,count,p,n,&b,obj->shinyness,FLAGS&SHADE_TWOSIDED,diff,spec);
+
+	for(int k=0;k<count;++k){
+	    int l=first+k;
+
+	    /* ambient */
+	    add_col(ra*lt->R[l]*R,ra*lt->G[l]*G,ra*lt->B[l]*B,col);
+
+	    /* shadow (diffuse and specular) */
+	    //no shadow rays if there is no diffuse or specular light to shadow
+	    if(rd*diff[k]+rs*spec[k]<=0) continue;
+	    double lightItensity=0;
+	    struct latticeShift shift;
+	    if(lightSampling==LIGHT_SAMPLE_CONE) newLatticeShift(&shift);
+	    int traced=numRays;
+	    if(numRays>shadowProbes){
+		//a lattice of a few probes over the light first, and a second
+		//lattice with the rest of the rays only if they disagree, i.e.
+		//p is in a penumbra
+		double lo=1,hi=0;
+		for(int light_i=0;light_i<shadowProbes;++light_i){
+		    double v=shadowSample(lt,l,p,light_i,shadowProbes,&shift);
+		    lightItensity+=v;
+		    if(v<lo) lo=v;
+		    if(v>hi) hi=v;
+		}
+		if(hi-lo>penumbraThreshold){
+		    if(lightSampling==LIGHT_SAMPLE_CONE) newLatticeShift(&shift);
+		    for(int light_i=0;light_i<numRays-shadowProbes;++light_i)
+			lightItensity+=shadowSample(lt,l,p,light_i,numRays-shadowProbes,&shift);
+		}
+		else traced=shadowProbes;
+	    }
+	    else for(int light_i=0;light_i<numRays;++light_i)
+		lightItensity+=shadowSample(lt,l,p,light_i,numRays,&shift);
+
+	    if(lightItensity>0)
+		addLight(lt,l,rd*diff[k],rs*spec[k],R,G,B,lightItensity*((double)1/traced),col);
+	}
      }    
  } 
- if(col->R>=1 && col->G>=1 && col->B>=1){
-      col->R=1;
-      col->G=1;
-      col->B=1;
-      return;
+ /* reflection */
+ //not needed if the colour is saturated already
+ if(depth<MAX_DEPTH && !backface && rg>0 && !(col->R>=1 && col->G>=1 && col->B>=1)){
+    //generate the reflection ray, rayTrace() traces it
+    gen_reflectionRay(n,&b,p,&next->ray[next->n]);
+    next->w[next->n].R=rg*R;
+    next->w[next->n].G=rg*G;
+    next->w[next->n].B=rg*B;
+    next->n++;
  }
+}     
 
+#define SHADE4(f) &shadeKernel<f>,&shadeKernel<f+1>,&shadeKernel<f+2>,&shadeKernel<f+3>
+static void (*const shadeTable[SHADE_VARIANTS])(struct object3D *, struct point3D *, struct point3D *,
+		struct ray3D *, int, double, double, int, struct colourRGB *, struct secondaryRays *)={
+    SHADE4(0),SHADE4(4),SHADE4(8),SHADE4(12),SHADE4(16),SHADE4(20),SHADE4(24),SHADE4(28)
+};
+#undef SHADE4
+
+// SHADE_* flags of an object's material, soft shadows are a global setting
+int shadeFlags(struct object3D *obj){
+    int flags=0;
+    if(obj->texImg!=NULL) flags|=SHADE_TEXTURED;
+    if(obj->isMirror) flags|=SHADE_MIRROR;
+    if(obj->alpha<1) flags|=SHADE_REFRACT;
+    if(obj->frontAndBack) flags|=SHADE_TWOSIDED;
+    if(antialiasing==1) flags|=SHADE_SOFTSHADOW;
+    return flags;
+}
 
- /* reflection */
- if(depth<MAX_DEPTH && !backface){
-    struct colourRGB col_ref={0,0,0};
-
-    //generate the reflection ray
-    rRay = gen_reflectionRay(n,&b,p);
-    //recursive call of rayTrace
-    rayTrace(rRay,depth+1,&col_ref,obj);
-    free(rRay);
-    rRay=NULL;
-    col_ref.R*=rg*R;
-    col_ref.G*=rg*G;
-    col_ref.B*=rg*B;
-    add_col(&col_ref,col);
- }    
-
- if(col->R>1) col->R=1;
- if(col->G>1) col->G=1;
- if(col->B>1) col->B=1;
-}     
+// Binds obj (and the children of container boxes) to the shading variant
+// of its material. Must be called again if the material is changed.
+void bindShader(struct object3D *obj){
+    for(;obj!=NULL;obj=obj->next){
+	obj->shade=shadeTable[shadeFlags(obj)];
+	if(obj->children) bindShader(obj->children);
+    }
+}
+
+// Shading micro-benchmark (-shadebench). Shades the first hit found down
+// the central column of the image with every variant in shadeTable, on a copy of the object
+// hit with its material flags set to match the variant, and reports the
+// throughput. The depth is MAX_DEPTH, so no secondary rays are traced:
+// this measures the local shading, shadow rays included.
+void benchShade(struct view *cam){
+    struct point3D o={0,0,0,1};
+    struct ray3D ray;
+    double lambda,a,b;
+    int goingOut=0;
+    struct object3D *obj=NULL;
+    struct point3D p,n;
+
+    for(int j=0;j<64 && !obj;++j){
+	struct point3D d={0,cam->wt-j*cam->wsize/63,cam->f,0};
+	initRay(&ray,&o,&d);
+	matRayMult(cam->C2W,&ray);
+	findFirstHit(&ray,&lambda,NULL,&obj,&p,&n,&a,&b,&goingOut,0,NULL);
+    }
+    if(!obj){
+	fprintf(stderr,"Shading benchmark: nothing visible down the centre of the image\n");
+	return;
+    }
+    if(dot(&n,&ray.d)>=0) multVector(-1,&n);	//front face, so no variant returns early
+    a=b=.5;
+
+    //flat grey texture for the textured variants
+    unsigned char texels[4*4*3];
+    memset(texels,128,sizeof(texels));
+    struct texture *tex=newTexture(texels,4,4);
+    if(!tex) return;
+    struct sampler bench={SAMPLER_INDEPENDENT,1,1,1,0,NULL};
+    struct secondaryRays next;
+
+    fprintf(stderr,"Shading benchmark, %d light(s), %s\n",sceneLights->num,sceneBVH?"BVH":"object list");
+    fprintf(stderr,"variant textured mirror refract twosided softshadow   kshades/s\n");
+    for(int v=0;v<SHADE_VARIANTS;++v){
+	struct object3D probe=*obj;
+	probe.texImg=(v&SHADE_TEXTURED)?tex:NULL;
+	probe.isMirror=(v&SHADE_MIRROR)?1:0;
+	probe.alpha=(v&SHADE_REFRACT)?.5:1;
+	probe.frontAndBack=(v&SHADE_TWOSIDED)?1:0;
+	startSample(&shadeSample,&bench,0,0,v);
+
+	//batches of shades until 0.2 s have passed
+	long count=0;
+	double t0=omp_get_wtime(),t;
+	do{
+	    for(int i=0;i<256;++i){
+		struct colourRGB col={0,0,0};
+		shadeTable[v](&probe,&p,&n,&ray,MAX_DEPTH,a,b,goingOut,&col,&next);
+	    }
+	    count+=256;
+	    t=omp_get_wtime()-t0;
+	}while(t<.2);
+
+	fprintf(stderr,"%7d %8d %6d %7d %8d %10d %11.1f\n",v,(v&SHADE_TEXTURED)!=0,(v&SHADE_MIRROR)!=0,
+		(v&SHADE_REFRACT)!=0,(v&SHADE_TWOSIDED)!=0,(v&SHADE_SOFTSHADOW)!=0,count/t/1000);
+    }
+    deleteTexture(tex);
+}
+
+void rtShade(struct object3D *obj, struct point3D *p, struct point3D *n, struct ray3D *ray,
+				int depth, double _a, double _b, int goingOut, struct colourRGB *col,
+				struct secondaryRays *next)
+{
+ next->n=0;
+ if(!obj) return;
+ if(obj->shade) obj->shade(obj,p,n,ray,depth,_a,_b,goingOut,col,next);
+ else shadeTable[shadeFlags(obj)](obj,p,n,ray,depth,_a,_b,goingOut,col,next);	// Not bound
+}
 
 
 
 //return accumulated light itensity, if hit any opague object, it's zero
 //list -- object list
-double findShadowHit(struct ray3D *ray, struct object3D* list){
+double findShadowHit(const struct ray3D *ray, struct object3D* list){
+    if(sceneBVH && list==object_list)
+	return bvhShadowHit(sceneBVH,ray);
+
     int initial=1;
     double itensity=1; //temporary itensity
     double temp; //lambda
-    struct point3D _n,_p;//not usful
 
     struct object3D *cur_obj=list;
 
@@ -1011,9 +2453,11 @@ double findShadowHit(struct ray3D *ray, struct object3D* list){
 	    //a bounding box
 	    itensity *= findShadowHit(ray,cur_obj->children);
 	    cur_obj=cur_obj->next;
+	    continue;
 	}
 
-	cur_obj->intersect(cur_obj,ray,&temp,&_p,&_n,NULL,NULL);
+	//distance only, the surface attributes are not needed
+	temp=hitDistance(cur_obj,ray);
 
 	//Q1:should it compare with 1 instead??
 	if(temp>0 && temp<1){
@@ -27,6 +27,8 @@ struct image{
 	int sy;
 };
 
+struct texture;		// Textures of the objects, see texture.h
+
 /* The structure below defines a point in 3D homogeneous coordinates */
 struct point3D{
 	double px;
@@ -40,7 +42,7 @@ struct point3D{
 struct ray3D{
 	struct point3D p0;	// Ray origin (at t=0)
 	struct point3D d;		// Ray direction
-	void (*rayPos)(struct ray3D *ray, double lambda, struct point3D *pos);
+	void (*rayPos)(const struct ray3D *ray, double lambda, struct point3D *pos);
 					// Function to return the
 					// position along the ray
 					// for a given lambda,i.e. t
@@ -95,6 +97,19 @@ inline void add_col(struct colourRGB* _col, struct colourRGB* col){
 	col->G+=_col->G;
 	col->B+=_col->B;
 }
+/*
+   Types of the built-in primitives. Intersections with these are dispatched
+   with a switch on object3D.type (see hitDistance() in utils.h) so the
+   compiler can inline them. Any other object is OBJ_CUSTOM and goes
+   through its function pointers.
+*/
+#define OBJ_CUSTOM 0
+#define OBJ_PLANE 1
+#define OBJ_SPHERE 2
+#define OBJ_CONE 3
+#define OBJ_PARABOLOID 4
+#define OBJ_BOX 5
+
 /*
    The structure below defines an Object within the World Coordinate Frame.
    For this ray tracer, we will use a simple linked list of objects (not
@@ -109,29 +124,50 @@ inline void add_col(struct colourRGB* _col, struct colourRGB* col){
    intersect function for each object.
 
    Thus, to create additional objects, simply provide a suitable
-   intersection function. The rest stays the same.
+   intersection function (and hitDist/surface, leaving type as OBJ_CUSTOM).
+   The rest stays the same.
 */
+struct secondaryRays;
 struct object3D{
+	int	type;		// OBJ_* for the built-in primitives, OBJ_CUSTOM otherwise
 	struct albedosPhong alb;	// Object's albedos for Phong model
 	struct colourRGB col;	// Object's colour in RGB
 	double  T[4][4]; 	// T holds the transformation applied to this object.
 	double  Tinv[4][4];      // Tinv holds the inverse transformation
+	double  Tnorm[4][4];	// Normal matrix, transpose(Tinv). Takes model normals to world
+	double  Q[10];		// Quadric objects: the surface in world coordinates as the
+				// symmetric matrix Tinv^T*Q*Tinv, upper triangle row by row
+				// (Tnorm and Q are set by invertObject())
 
         // Below we set up space for a pointer to the intersection function for this object.
         // Note that the intersection function must compute the lambda at the intersection, the
         // intersection point p, the normal at that point n, and the texture coordinates (a,b).
         // The texture coordinates are not used unless texImg!=NULL and a textureMap function
-        // has been provided
-	void (*intersect)(struct object3D *obj, struct ray3D *ray, double *lambda,
-			struct point3D *p, struct point3D *n, double *a, double *b);		
+        // has been provided.
+        // p and n are returned in Model world, use T and Tnorm to take them to the world.
+        // The ray is not modified, and goingOut (if not NULL) is set to 1 when the ray hits
+        // the surface from the inside of the object. Nothing is written to the object itself,
+        // so the same object can be intersected by several threads at once.
+	void (*intersect)(struct object3D *obj, const struct ray3D *ray, double *lambda,
+			struct point3D *p, struct point3D *n, double *a, double *b, int *goingOut);
 
-	// Texture mapping function. Takes normalized texture coordinates (a,b) and returns the
-  	// texture colour at that point using bi-linear interpolation 
-	void (*textureMap)(struct image *img, double a, double b, double *R, double *G, double *B);
+	// The same intersection in two steps. hitDist only returns lambda (-1 if the ray
+	// misses), it is what the traversal and the shadow rays use. surface then computes
+	// p, n, (a,b) and goingOut as above for a lambda returned by hitDist, so this work
+	// is done once, for the closest hit only.
+	double (*hitDist)(struct object3D *obj, const struct ray3D *ray);
+	void (*surface)(struct object3D *obj, const struct ray3D *ray, double lambda,
+			struct point3D *p, struct point3D *n, double *a, double *b, int *goingOut);
 
-        struct image *texImg;				// Pointer to structure
+	// Texture mapping function. Takes normalized texture coordinates (a,b) and the width
+	// of the pixel's footprint in texture coordinates (0 for none), and returns the
+	// texture colour at that point, see texture.h
+	void (*textureMap)(struct texture *tex, double a, double b, double width, double *R, double *G, double *B);
+
+        struct texture *texImg;				// Pointer to structure
 							// holding the texture
 							// for this object
+	double  texScale;	// Texture coordinates per world unit, set by invertObject()
 	double  alpha;		// Opacity - if less than 1 this is a semi
 				// transparent object and refraction rays
 				// should be implemented
@@ -141,13 +177,37 @@ struct object3D{
 				// should be lit.
 	int	isLightSource;	// Flag to indicate if this is an area light source
 	int isMirror;
-	int goingOut; //flag to indicate: 1 -- ray is shooting from inside of the object to the world
-			//this flag is set by intersect function
+	// Shading function specialised for the material flags of this object, set by
+	// bindShader(). rtShade() calls it.
+	void (*shade)(struct object3D *obj, struct point3D *p, struct point3D *n, struct ray3D *ray,
+			int depth, double a, double b, int goingOut, struct colourRGB *col,
+			struct secondaryRays *next);
 	struct object3D *next;	// Pointer to next entry in object linked list
 	struct object3D *children;  //Bounding volume hierarchy: using linked list
 };
 
 
+/*
+   Rays spawned by a hit (refraction and reflection). The shader only
+   computes the local illumination of the hit, rayTrace() traces these
+   rays afterwards and adds their colour times w to the colour of the hit.
+*/
+struct secondaryRays{
+	int n;			// Number of rays
+	struct ray3D ray[2];
+	struct colourRGB w[2];	// Weight of the colour of each ray
+};
+
+/*
+   Material features the shading code is specialised on, see shadeFlags()
+*/
+#define SHADE_TEXTURED 1	// texImg!=NULL
+#define SHADE_MIRROR 2		// isMirror, no local (Phong) illumination
+#define SHADE_REFRACT 4		// alpha<1
+#define SHADE_TWOSIDED 8	// frontAndBack
+#define SHADE_SOFTSHADOW 16	// Several shadow rays per light (global setting)
+#define SHADE_VARIANTS 32
+
 /*
    The structure below is used to hold camera parameters. You will need
    to write code to initialize the camera position and orientation.
@@ -165,21 +225,60 @@ struct view{
 	double C2W[4][4];	// Camera2World conversion matrix
 };
 
+/*
+   The structure below holds everything renderTile() needs to render a
+   part of the image: the camera, the output image, the pixel spacing and
+   the supersampling grid with its weights. It is shared read-only by all
+   rendering threads.
+*/
+struct tile;
+struct raster;
+struct renderJob{
+	struct view *cam;
+	struct image *im;	// Output image, of the crop window only
+	int x0, y0;		// Crop window [x0,x1) x [y0,y1), the pixels of the image traced
+	int x1, y1;
+	double du;		// Pixel spacing along u and v (dv is negative)
+	double dv;
+	struct sampler *sampler;	// Samples of every pixel
+	int ns;			// Size of the grid the filter weights are given for
+	double *weight;		// ns x ns filter weights of the grid sampler
+	int firstSample;	// Samples [firstSample,endSample) of every pixel are traced
+	int endSample;
+	int step;		// Only every step-th pixel along x and y is traced (1 for all)
+	int skipStep;		// Pixels traced by a coarser pass (every skipStep-th), 0 for none
+	long primaryRays;	// Primary rays traced by the last renderImage()
+	struct filter *filter;	// Reconstruction filter, NULL for the weights of the sampler
+	struct film *film;	// Weighted sums of every pixel, resolved into im
+	struct raster *raster;	// Rasterized primary visibility, NULL to traverse the BVH for every primary ray
+	long rasterRays;	// Primary rays of the last renderImage() the raster resolved
+};
+
 // Function definitions start here
 int main(int argc, char *argv[]);									// Main raytracing function. 
 void buildScene(void);											// Scene set up. Defines objects and object transformations
+void renderTile(struct renderJob *job, struct tile *t);						// Renders one tile of the image
 void rayTrace(struct ray3D *ray, int depth, struct colourRGB *col, struct object3D *Os);		// RayTracing routine
-void findFirstHit(struct ray3D *ray, double *lambda, struct object3D *Os, struct object3D **obj,
-		    struct point3D *p, struct point3D *n, double *a, double *b, int depth, struct object3D *topBox);
-double findShadowHit(struct ray3D *ray, struct object3D* list);
+struct rayPacket;
+struct pixelSample;
+void rayTracePacket(struct rayPacket *pk, struct pixelSample *ps, struct colourRGB *col);					// Shades a packet of primary rays
+void findFirstHit(const struct ray3D *ray, double *lambda, struct object3D *Os, struct object3D **obj,
+		    struct point3D *p, struct point3D *n, double *a, double *b, int *goingOut,
+		    int depth, struct object3D *topBox);
+double findShadowHit(const struct ray3D *ray, struct object3D* list);
 void rtShade(struct object3D *obj, struct point3D *p, struct point3D *n,struct ray3D *ray,
-		    int depth, double a, double b, struct colourRGB *col);
+		    int depth, double a, double b, int goingOut, struct colourRGB *col,
+		    struct secondaryRays *next);
+int shadeFlags(struct object3D *obj);									// SHADE_* flags of an object
+void bindShader(struct object3D *list);									// Binds objects to their shading variant
+void benchShade(struct view *cam);									// Shading micro-benchmark (-shadebench)
 //environment mapping
 void bgMap(struct ray3D* ray, struct colourRGB* col);
 
 void gen_Gaussian_weight(double *table,int size);
-struct ray3D* gen_refractionRay(struct object3D* obj, struct point3D* n, struct point3D* b, struct point3D* p);
-struct ray3D* gen_reflectionRay(struct point3D* n, struct point3D* b, struct point3D* p);
+int gen_refractionRay(struct object3D* obj, int goingOut, struct point3D* n, struct point3D* b, struct point3D* p,
+		    struct ray3D *ray);
+void gen_reflectionRay(struct point3D* n, struct point3D* b, struct point3D* p, struct ray3D *ray);
 
 //Compact objects
 //this function accumulates the top transformation ONE level down to its children
@@ -0,0 +1,254 @@
+/*
+   batch.cpp - SoA intersection kernels, see batch.h
+
+   The quadric kernel follows sphereIntersect(), coneIntersect() and
+   paraboloidIntersect() step by step (including the choice of root and
+   the world-space coefficients from quadricCoefs()), the
+   box kernel follows the slab test in boxIntersect(), so the batched and
+   scalar paths agree on which primitive is hit first.
+*/
+
+#include "batch.h"
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+int primKind(struct object3D *obj){
+    switch(obj->type){
+	case OBJ_SPHERE:
+	case OBJ_CONE:
+	case OBJ_PARABOLOID: return PRIM_QUADRIC;
+	case OBJ_BOX: return PRIM_BOX;
+	case OBJ_PLANE: return PRIM_PLANE;
+    }
+    return PRIM_OTHER;
+}
+
+struct primBatch *newPrimBatch(struct object3D **prims, int num){
+    struct primBatch *pb=(struct primBatch *)calloc(1,sizeof(struct primBatch));
+    if(!pb){
+	fprintf(stderr,"Unable to allocate primitive batch, out of memory!\n");
+	return(NULL);
+    }
+    //padded so the kernels can load a full register past the last primitive
+    int size=num+BATCH_WIDTH;
+    pb->num=num;
+    pb->kind=(int *)calloc(size,sizeof(int));
+    for(int k=0;k<12;++k) pb->m[k]=(double *)calloc(size,sizeof(double));
+    for(int k=0;k<10;++k) pb->q[k]=(double *)calloc(size,sizeof(double));
+    pb->ymin=(double *)calloc(size,sizeof(double));
+    pb->ymax=(double *)calloc(size,sizeof(double));
+
+    for(int i=0;i<num;++i){
+	struct object3D *o=prims[i];
+	pb->kind[i]=primKind(o);
+	for(int r=0;r<3;++r)
+	    for(int c=0;c<4;++c)
+		pb->m[4*r+c][i]=o->Tinv[r][c];
+
+	for(int k=0;k<10;++k) pb->q[k][i]=o->Q[k];
+	double lo=-1e300,hi=1e300;	//sphere, not clipped
+	if(o->type==OBJ_CONE || o->type==OBJ_PARABOLOID){
+	    lo=-1; hi=0;
+	}
+	pb->ymin[i]=lo;
+	pb->ymax[i]=hi;
+    }
+    return(pb);
+}
+
+void deletePrimBatch(struct primBatch *pb){
+    if(!pb) return;
+    free(pb->kind);
+    for(int k=0;k<12;++k) free(pb->m[k]);
+    for(int k=0;k<10;++k) free(pb->q[k]);
+    free(pb->ymin);
+    free(pb->ymax);
+    free(pb);
+}
+
+#ifdef __AVX2__
+
+/* The ray transformed into the model space of 4 primitives */
+struct ray4{
+    __m256d ox,oy,oz;
+    __m256d dx,dy,dz;
+};
+
+static inline void toModel4(struct primBatch *pb, int i, const struct ray3D *ray, struct ray4 *r){
+    __m256d ox=_mm256_set1_pd(ray->p0.px);
+    __m256d oy=_mm256_set1_pd(ray->p0.py);
+    __m256d oz=_mm256_set1_pd(ray->p0.pz);
+    __m256d dx=_mm256_set1_pd(ray->d.px);
+    __m256d dy=_mm256_set1_pd(ray->d.py);
+    __m256d dz=_mm256_set1_pd(ray->d.pz);
+    __m256d *o[3]={&r->ox,&r->oy,&r->oz};
+    __m256d *d[3]={&r->dx,&r->dy,&r->dz};
+    for(int row=0;row<3;++row){
+	__m256d m0=_mm256_loadu_pd(pb->m[4*row+0]+i);
+	__m256d m1=_mm256_loadu_pd(pb->m[4*row+1]+i);
+	__m256d m2=_mm256_loadu_pd(pb->m[4*row+2]+i);
+	__m256d m3=_mm256_loadu_pd(pb->m[4*row+3]+i);
+	*o[row]=_mm256_fmadd_pd(m0,ox,_mm256_fmadd_pd(m1,oy,_mm256_fmadd_pd(m2,oz,m3)));
+	*d[row]=_mm256_fmadd_pd(m0,dx,_mm256_fmadd_pd(m1,dy,_mm256_mul_pd(m2,dz)));
+    }
+}
+
+static inline __m256d quadric4(struct primBatch *pb, int i, const struct ray3D *ray, __m256d *t){
+    __m256d zero=_mm256_setzero_pd();
+    __m256d two=_mm256_set1_pd(2.0);
+    __m256d ox=_mm256_set1_pd(ray->p0.px);
+    __m256d oy=_mm256_set1_pd(ray->p0.py);
+    __m256d oz=_mm256_set1_pd(ray->p0.pz);
+    __m256d dx=_mm256_set1_pd(ray->d.px);
+    __m256d dy=_mm256_set1_pd(ray->d.py);
+    __m256d dz=_mm256_set1_pd(ray->d.pz);
+    __m256d q[10];
+    for(int k=0;k<10;++k) q[k]=_mm256_loadu_pd(pb->q[k]+i);
+
+    //A t^2 + B t + C = 0 in world coordinates, as in quadricCoefs()
+    __m256d qd0=_mm256_fmadd_pd(q[0],dx,_mm256_fmadd_pd(q[1],dy,_mm256_mul_pd(q[2],dz)));
+    __m256d qd1=_mm256_fmadd_pd(q[1],dx,_mm256_fmadd_pd(q[4],dy,_mm256_mul_pd(q[5],dz)));
+    __m256d qd2=_mm256_fmadd_pd(q[2],dx,_mm256_fmadd_pd(q[5],dy,_mm256_mul_pd(q[7],dz)));
+    __m256d qd3=_mm256_fmadd_pd(q[3],dx,_mm256_fmadd_pd(q[6],dy,_mm256_mul_pd(q[8],dz)));
+    __m256d A=_mm256_fmadd_pd(dx,qd0,_mm256_fmadd_pd(dy,qd1,_mm256_mul_pd(dz,qd2)));
+    __m256d B=_mm256_mul_pd(two,_mm256_fmadd_pd(ox,qd0,_mm256_fmadd_pd(oy,qd1,_mm256_fmadd_pd(oz,qd2,qd3))));
+    __m256d cx=_mm256_fmadd_pd(q[0],ox,_mm256_mul_pd(two,_mm256_fmadd_pd(q[1],oy,_mm256_fmadd_pd(q[2],oz,q[3]))));
+    __m256d cy=_mm256_fmadd_pd(q[4],oy,_mm256_mul_pd(two,_mm256_fmadd_pd(q[5],oz,q[6])));
+    __m256d cz=_mm256_fmadd_pd(q[7],oz,_mm256_mul_pd(two,q[8]));
+    __m256d C=_mm256_fmadd_pd(ox,cx,_mm256_fmadd_pd(oy,cy,_mm256_fmadd_pd(oz,cz,q[9])));
+    __m256d delta=_mm256_sub_pd(_mm256_mul_pd(B,B),_mm256_mul_pd(_mm256_set1_pd(4.0),_mm256_mul_pd(A,C)));
+
+    //first root if it is in front of the ray, the second one otherwise
+    __m256d sq=_mm256_sqrt_pd(_mm256_max_pd(delta,zero));
+    __m256d half=_mm256_set1_pd(0.5);
+    __m256d nB=_mm256_sub_pd(zero,B);
+    __m256d t1=_mm256_mul_pd(_mm256_div_pd(_mm256_sub_pd(nB,sq),A),half);
+    __m256d t2=_mm256_mul_pd(_mm256_div_pd(_mm256_add_pd(nB,sq),A),half);
+    *t=_mm256_blendv_pd(t2,t1,_mm256_cmp_pd(t1,zero,_CMP_GT_OQ));
+
+    //clip along model y, only row 1 of Tinv is needed for that
+    __m256d hx=_mm256_fmadd_pd(*t,dx,ox);
+    __m256d hy=_mm256_fmadd_pd(*t,dy,oy);
+    __m256d hz=_mm256_fmadd_pd(*t,dz,oz);
+    __m256d y=_mm256_fmadd_pd(_mm256_loadu_pd(pb->m[4]+i),hx,
+		_mm256_fmadd_pd(_mm256_loadu_pd(pb->m[5]+i),hy,
+		_mm256_fmadd_pd(_mm256_loadu_pd(pb->m[6]+i),hz,_mm256_loadu_pd(pb->m[7]+i))));
+    __m256d valid=_mm256_cmp_pd(A,zero,_CMP_NEQ_OQ);
+    valid=_mm256_and_pd(valid,_mm256_cmp_pd(delta,zero,_CMP_GE_OQ));
+    valid=_mm256_and_pd(valid,_mm256_cmp_pd(*t,zero,_CMP_GT_OQ));
+    valid=_mm256_and_pd(valid,_mm256_cmp_pd(y,_mm256_loadu_pd(pb->ymin+i),_CMP_GE_OQ));
+    valid=_mm256_and_pd(valid,_mm256_cmp_pd(y,_mm256_loadu_pd(pb->ymax+i),_CMP_LE_OQ));
+    return valid;
+}
+
+static inline __m256d box4(struct ray4 *r, __m256d *t){
+    __m256d zero=_mm256_setzero_pd();
+    __m256d one=_mm256_set1_pd(1.0);
+    __m256d mone=_mm256_set1_pd(-1.0);
+    __m256d o[3]={r->ox,r->oy,r->oz};
+    __m256d d[3]={r->dx,r->dy,r->dz};
+
+    __m256d tnear=_mm256_set1_pd(-1e300);
+    __m256d tfar=_mm256_set1_pd(1e300);
+    __m256d valid=_mm256_cmp_pd(zero,zero,_CMP_EQ_OQ);
+    for(int k=0;k<3;++k){
+	__m256d par=_mm256_cmp_pd(d[k],zero,_CMP_EQ_OQ);
+	__m256d t1=_mm256_div_pd(_mm256_sub_pd(mone,o[k]),d[k]);
+	__m256d t2=_mm256_div_pd(_mm256_sub_pd(one,o[k]),d[k]);
+	//parallel to the slab: unconstrained if inside it, a miss otherwise
+	__m256d inside=_mm256_and_pd(_mm256_cmp_pd(o[k],mone,_CMP_GE_OQ),_mm256_cmp_pd(o[k],one,_CMP_LE_OQ));
+	valid=_mm256_andnot_pd(_mm256_andnot_pd(inside,par),valid);
+	tnear=_mm256_blendv_pd(_mm256_max_pd(tnear,_mm256_min_pd(t1,t2)),tnear,par);
+	tfar=_mm256_blendv_pd(_mm256_min_pd(tfar,_mm256_max_pd(t1,t2)),tfar,par);
+    }
+    valid=_mm256_and_pd(valid,_mm256_cmp_pd(tnear,tfar,_CMP_LE_OQ));
+    valid=_mm256_and_pd(valid,_mm256_cmp_pd(tfar,zero,_CMP_GT_OQ));
+    *t=_mm256_blendv_pd(tfar,tnear,_mm256_cmp_pd(tnear,zero,_CMP_GT_OQ));
+    return valid;
+}
+
+static inline __m256d plane4(struct ray4 *r, __m256d *t){
+    __m256d zero=_mm256_setzero_pd();
+    __m256d one=_mm256_set1_pd(1.0);
+    __m256d mone=_mm256_set1_pd(-1.0);
+    *t=_mm256_sub_pd(zero,_mm256_div_pd(r->oz,r->dz));
+    __m256d x=_mm256_fmadd_pd(*t,r->dx,r->ox);
+    __m256d y=_mm256_fmadd_pd(*t,r->dy,r->oy);
+    __m256d valid=_mm256_cmp_pd(r->dz,zero,_CMP_NEQ_OQ);
+    valid=_mm256_and_pd(valid,_mm256_cmp_pd(*t,zero,_CMP_GT_OQ));
+    valid=_mm256_and_pd(valid,_mm256_cmp_pd(x,mone,_CMP_GE_OQ));
+    valid=_mm256_and_pd(valid,_mm256_cmp_pd(x,one,_CMP_LE_OQ));
+    valid=_mm256_and_pd(valid,_mm256_cmp_pd(y,mone,_CMP_GE_OQ));
+    valid=_mm256_and_pd(valid,_mm256_cmp_pd(y,one,_CMP_LE_OQ));
+    return valid;
+}
+
+int batchIntersect(struct primBatch *pb, int first, int n, const struct ray3D *ray, double *t){
+    struct ray4 r;
+    __m256d tv,valid;
+    if(pb->kind[first]==PRIM_QUADRIC)
+	valid=quadric4(pb,first,ray,&tv);
+    else{
+	toModel4(pb,first,ray,&r);
+	if(pb->kind[first]==PRIM_BOX) valid=box4(&r,&tv);
+	else valid=plane4(&r,&tv);
+    }
+    _mm256_storeu_pd(t,tv);
+    return _mm256_movemask_pd(valid)&((1<<n)-1);
+}
+
+#else
+
+// Same kernels, one primitive at a time
+int batchIntersect(struct primBatch *pb, int first, int n, const struct ray3D *ray, double *t){
+    int mask=0;
+    for(int k=0;k<n;++k){
+	int i=first+k;
+	double o[3],d[3];
+	for(int row=0;row<3;++row){
+	    o[row]=pb->m[4*row][i]*ray->p0.px+pb->m[4*row+1][i]*ray->p0.py+pb->m[4*row+2][i]*ray->p0.pz+pb->m[4*row+3][i];
+	    d[row]=pb->m[4*row][i]*ray->d.px+pb->m[4*row+1][i]*ray->d.py+pb->m[4*row+2][i]*ray->d.pz;
+	}
+	int valid=0;
+	if(pb->kind[i]==PRIM_QUADRIC){
+	    double A,B,C,Q[10];
+	    for(int c=0;c<10;++c) Q[c]=pb->q[c][i];
+	    quadricCoefs(Q,ray,&A,&B,&C);
+	    double delta=B*B-4*A*C;
+	    if(A!=0 && delta>=0){
+		double sq=sqrt(delta);
+		double t1=(-B-sq)/A/2;
+		t[k]=(t1>0)?t1:(-B+sq)/A/2;
+		double y=o[1]+t[k]*d[1];
+		valid=(t[k]>0 && y>=pb->ymin[i] && y<=pb->ymax[i]);
+	    }
+	}else if(pb->kind[i]==PRIM_BOX){
+	    double tnear=-1e300,tfar=1e300;
+	    valid=1;
+	    for(int a=0;a<3;++a){
+		if(d[a]==0){
+		    if(o[a]<-1 || o[a]>1) valid=0;
+		    continue;
+		}
+		double t1=(-1-o[a])/d[a],t2=(1-o[a])/d[a];
+		if(t1>t2){ double tt=t1; t1=t2; t2=tt; }
+		if(t1>tnear) tnear=t1;
+		if(t2<tfar) tfar=t2;
+	    }
+	    t[k]=(tnear>0)?tnear:tfar;
+	    valid=valid && tnear<=tfar && tfar>0;
+	}else{
+	    if(d[2]!=0){
+		t[k]=-(o[2]/d[2]);
+		double x=o[0]+t[k]*d[0],y=o[1]+t[k]*d[1];
+		valid=(t[k]>0 && x>=-1 && x<=1 && y>=-1 && y<=1);
+	    }
+	}
+	if(valid) mask|=(1<<k);
+    }
+    return mask;
+}
+
+#endif
@@ -0,0 +1,56 @@
+/*
+  batch.h - Batched intersection kernels for BVH leaves.
+
+  The primitives of the BVH are copied into structure-of-arrays form, in
+  the same order as bvh->prims, so the primitives of a leaf sit next to
+  each other in memory. A single ray is then tested against 4 primitives
+  of the same kind at a time with AVX2 (4 doubles per register).
+
+  Spheres, cones and paraboloids are all quadrics, clipped to
+  ymin <= y <= ymax in model space, so one kernel handles the three of
+  them using the world-space quadric of each primitive (object3D.Q) and
+  needs no transform of the ray. Boxes use a branchless slab test, and
+  planes a single division, both in model space. Primitive types the
+  kernels do not know about are marked PRIM_OTHER and go through
+  hitDistance().
+
+  The kernels only compute lambda. The surface attributes of the closest
+  hit are evaluated afterwards with obj->surface.
+*/
+
+#include "utils.h"
+
+#ifndef __batch_header
+#define __batch_header
+
+// Kinds of primitives, BVH leaves are sorted by kind
+#define PRIM_QUADRIC 0		// Sphere, cone or paraboloid
+#define PRIM_BOX 1
+#define PRIM_PLANE 2
+#define PRIM_OTHER 3
+
+#define BATCH_WIDTH 4		// Primitives tested per kernel call
+
+struct primBatch{
+	int num;		// Number of primitives
+	int *kind;		// PRIM_* for each primitive
+	double *m[12];		// Rows 0-2 of Tinv, m[4*row+col][i] for primitive i
+	double *q[10];		// World-space quadric, as in object3D.Q
+	double *ymin;		// Quadric clipping range along model y
+	double *ymax;
+};
+
+// Kind of a primitive, from its type
+int primKind(struct object3D *obj);
+
+// Copies the transforms and coefficients of prims[0..num-1] into SoA form
+struct primBatch *newPrimBatch(struct object3D **prims, int num);
+void deletePrimBatch(struct primBatch *pb);
+
+// Tests the ray against primitives [first,first+n) of the batch, where
+// n<=BATCH_WIDTH and all of them have the same kind (not PRIM_OTHER).
+// Returns a bit mask of the primitives hit at lambda>0, their lambdas
+// are returned in t.
+int batchIntersect(struct primBatch *pb, int first, int n, const struct ray3D *ray, double *t);
+
+#endif
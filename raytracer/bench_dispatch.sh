@@ -0,0 +1,39 @@
+#!/bin/sh
+# Compares switch dispatch of the primitive intersections (the default)
+# with calls through the object3D function pointers (-DFNPTR_DISPATCH)
+# on the default scene. Reports cycles, instructions (IPC) and branch
+# misses with perf stat when it can read the hardware counters, the
+# render time otherwise (perf missing, a virtual machine without a PMU,
+# or kernel.perf_event_paranoid set too high).
+#
+#USAGE: ./bench_dispatch.sh [size] [rec_depth] [softshadow]
+#   Runs single threaded, once with the BVH and packets as usual and once
+#   walking the object list one ray at a time, where every primitive test
+#   goes through the dispatch.
+
+SIZE=${1:-256}
+DEPTH=${2:-3}
+SOFT=${3:-1}
+SRCS="svdDynamic.cpp RayTracer.cpp utils.cpp bvh.cpp batch.cpp scheduler.cpp packet.cpp lights.cpp sampler.cpp film.cpp raster.cpp texture.cpp"
+OUT=${TMPDIR:-/tmp}
+
+g++ -O3 -mavx2 -mfma $SRCS -lm -fopenmp -o $OUT/RayTracer.switch || exit 1
+g++ -O3 -mavx2 -mfma -DFNPTR_DISPATCH $SRCS -lm -fopenmp -o $OUT/RayTracer.fnptr || exit 1
+
+EVENTS=cycles,instructions,branches,branch-misses
+#perf stat can succeed and still print "<not supported>" for every event
+if command -v perf >/dev/null 2>&1 &&
+   perf stat -e $EVENTS true 2>&1 | grep -q "[0-9] *instructions"; then
+ RUN="perf stat -e $EVENTS"
+else
+ echo "perf can not read the hardware counters here, reporting render times only"
+ RUN=""
+fi
+
+for opts in "" "-nobvh -packet 0"; do
+ for kind in switch fnptr; do
+  echo "== $kind dispatch $opts"
+  $RUN $OUT/RayTracer.$kind $SIZE $DEPTH $SOFT $OUT/bench_$kind.ppm -threads 1 $opts 2>&1 |
+   grep -E "Render time|cycles|instructions|branch"
+ done
+done
@@ -0,0 +1,22 @@
+#!/bin/sh
+# Render time of the default scene lit by N small lights (-lights N),
+# for N from 2 to 10000, with shadow rays picking lights from the light
+# tree. The lights' colours add up to the same total for every N, so the
+# images converge to the same brightness and can be compared for noise.
+#
+#USAGE: ./bench_lights.sh [size] [rec_depth] [softshadow]
+#   Images are left in $TMPDIR (or /tmp) as lights_N.ppm. Pass
+#   -lighttree with a large N to the renderer to get the exact image,
+#   shooting shadow rays at every light, to compare against.
+
+SIZE=${1:-128}
+DEPTH=${2:-1}
+SOFT=${3:-1}
+SRCS="svdDynamic.cpp RayTracer.cpp utils.cpp bvh.cpp batch.cpp scheduler.cpp packet.cpp lights.cpp sampler.cpp film.cpp raster.cpp texture.cpp"
+OUT=${TMPDIR:-/tmp}
+
+g++ -O3 -mavx2 -mfma $SRCS -lm -fopenmp -o $OUT/RayTracer.lights || exit 1
+for n in 2 10 100 1000 10000; do
+ echo "== $n lights"
+ $OUT/RayTracer.lights $SIZE $DEPTH $SOFT $OUT/lights_$n.ppm -lights $n -lighttree 0 2>&1 | grep "Render time"
+done
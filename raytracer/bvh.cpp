@@ -0,0 +1,487 @@
+/*
+   bvh.cpp - SAH bounding volume hierarchy for the ray tracer.
+
+   The hierarchy is built top-down. At every node the primitive centroids
+   are binned along the longest axis of the centroid bounds and the split
+   with the lowest surface area heuristic cost is taken, unless keeping
+   the node as a leaf is cheaper.
+
+   SAH splits can be very uneven on clustered scenes, so the depth is
+   bounded: once a node is only just shallow enough for its primitives
+   to be split in halves down to single ones within BVH_MAX_DEPTH, it is
+   split at the median centroid, and so is everything below it. A
+   depth first traversal then never holds more than BVH_STACK nodes.
+*/
+
+#include <assert.h>
+#include "bvh.h"
+
+// Relative costs of traversing a node and intersecting a batch of primitives
+#define BVH_COST_TRAVERSE 1.0
+#define BVH_COST_INTERSECT 2.0
+
+// Leaves are intersected BATCH_WIDTH primitives at a time, so the cost of
+// a leaf grows with the number of batches rather than of primitives
+static inline double batchCost(int n){
+    return (double)((n+BATCH_WIDTH-1)/BATCH_WIDTH);
+}
+
+/////////////////////////////////////////////
+// Bounds
+/////////////////////////////////////////////
+static inline void emptyBox(struct aabb *box){
+    for(int k=0;k<3;++k){
+	box->min[k]=1e300;
+	box->max[k]=-1e300;
+    }
+}
+
+static inline void growBox(struct aabb *box, struct aabb *b){
+    for(int k=0;k<3;++k){
+	if(b->min[k]<box->min[k]) box->min[k]=b->min[k];
+	if(b->max[k]>box->max[k]) box->max[k]=b->max[k];
+    }
+}
+
+static inline void growPoint(struct aabb *box, double *c){
+    for(int k=0;k<3;++k){
+	if(c[k]<box->min[k]) box->min[k]=c[k];
+	if(c[k]>box->max[k]) box->max[k]=c[k];
+    }
+}
+
+static inline double boxArea(struct aabb *box){
+    double dx=box->max[0]-box->min[0];
+    double dy=box->max[1]-box->min[1];
+    double dz=box->max[2]-box->min[2];
+    if(dx<0 || dy<0 || dz<0) return 0;
+    return 2*(dx*dy+dy*dz+dz*dx);
+}
+
+int objectBounds(struct object3D *obj, struct aabb *box){
+    // Canonical bounds of each primitive in model space
+    double lo[3],hi[3];
+    if(obj->type==OBJ_PLANE){
+	lo[0]=-1; lo[1]=-1; lo[2]=0;
+	hi[0]=1;  hi[1]=1;  hi[2]=0;
+    }else if(obj->type==OBJ_SPHERE || obj->type==OBJ_BOX){
+	lo[0]=-1; lo[1]=-1; lo[2]=-1;
+	hi[0]=1;  hi[1]=1;  hi[2]=1;
+    }else if(obj->type==OBJ_CONE || obj->type==OBJ_PARABOLOID){
+	//both are clipped to y in [-1,0], where x^2+z^2<=1
+	lo[0]=-1; lo[1]=-1; lo[2]=-1;
+	hi[0]=1;  hi[1]=0;  hi[2]=1;
+    }else
+	return 0;
+
+    //transform the 8 corners into the world
+    emptyBox(box);
+    for(int c=0;c<8;++c){
+	struct point3D q;
+	q.px=(c&1)?hi[0]:lo[0];
+	q.py=(c&2)?hi[1]:lo[1];
+	q.pz=(c&4)?hi[2]:lo[2];
+	q.pw=1;
+	matVecMult(obj->T,&q);
+	double w[3]={q.px,q.py,q.pz};
+	growPoint(box,w);
+    }
+
+    //pad the box so flat objects (planes) still have some thickness
+    for(int k=0;k<3;++k){
+	double pad=1e-6*(1.0+fabs(box->min[k])+fabs(box->max[k]));
+	box->min[k]-=pad;
+	box->max[k]+=pad;
+    }
+    return 1;
+}
+
+
+/////////////////////////////////////////////
+// Construction
+/////////////////////////////////////////////
+struct buildPrim{
+    struct object3D *obj;
+    struct aabb box;
+    double c[3];		// Centroid of the bounds
+};
+
+struct buildState{
+    struct buildPrim *prims;
+    struct bvhNode *nodes;
+    int numNodes;
+};
+
+static void collectPrims(struct object3D *list, struct buildPrim *prims, int *n,
+			struct object3D **unbounded, int *nu, int count){
+    for(struct object3D *o=list;o!=NULL;o=o->next){
+	if(o->children!=NULL){
+	    //container box, insert its children instead
+	    collectPrims(o->children,prims,n,unbounded,nu,count);
+	    continue;
+	}
+	if(count){
+	    (*n)++;
+	    continue;
+	}
+	struct buildPrim *bp=&prims[*n];
+	if(objectBounds(o,&bp->box)){
+	    bp->obj=o;
+	    for(int k=0;k<3;++k) bp->c[k]=0.5*(bp->box.min[k]+bp->box.max[k]);
+	    (*n)++;
+	}else
+	    unbounded[(*nu)++]=o;
+    }
+}
+
+// Orders build primitives by their centroid along x, y or z
+static inline int centroidOrder(const void *a, const void *b, int k){
+    double ca=((const struct buildPrim *)a)->c[k],cb=((const struct buildPrim *)b)->c[k];
+    return(ca<cb?-1:(ca>cb?1:0));
+}
+static int centroidOrderX(const void *a, const void *b){ return(centroidOrder(a,b,0)); }
+static int centroidOrderY(const void *a, const void *b){ return(centroidOrder(a,b,1)); }
+static int centroidOrderZ(const void *a, const void *b){ return(centroidOrder(a,b,2)); }
+static int (*const centroidOrders[3])(const void *, const void *)={centroidOrderX,centroidOrderY,centroidOrderZ};
+
+// Levels of median splits it takes to get n primitives down to one each
+static inline int medianLevels(int n){
+    int levels=0;
+    while((1<<levels)<n) ++levels;
+    return(levels);
+}
+
+static void buildNode(struct buildState *st, int nodeIdx, int start, int end, int depth){
+    struct bvhNode *node=&st->nodes[nodeIdx];
+    struct aabb cbox;
+    int n=end-start;
+
+    emptyBox(&node->box);
+    emptyBox(&cbox);
+    for(int i=start;i<end;++i){
+	growBox(&node->box,&st->prims[i].box);
+	growPoint(&cbox,st->prims[i].c);
+    }
+    node->first=start;
+    node->count=n;
+    node->axis=0;
+    if(n==1) return;
+
+    //split along the longest axis of the centroid bounds
+    int axis=0;
+    double ext=cbox.max[0]-cbox.min[0];
+    for(int k=1;k<3;++k)
+	if(cbox.max[k]-cbox.min[k]>ext){
+	    ext=cbox.max[k]-cbox.min[k];
+	    axis=k;
+	}
+
+    int mid=start+n/2;
+    if(depth+medianLevels(n)>=BVH_MAX_DEPTH){
+	//as deep as the stack allows for this many primitives, median splits
+	//from here on
+	if(n<=BVH_MAX_LEAF) return;
+	qsort(&st->prims[start],n,sizeof(struct buildPrim),centroidOrders[axis]);
+    }else if(ext<=0){
+	//all centroids coincide, nothing to gain from SAH
+	if(n<=BVH_MAX_LEAF) return;
+    }else{
+	//bin the centroids and sweep for the cheapest split
+	int binCount[BVH_BINS]={0};
+	struct aabb binBox[BVH_BINS];
+	for(int b=0;b<BVH_BINS;++b) emptyBox(&binBox[b]);
+	double scale=BVH_BINS/ext;
+	for(int i=start;i<end;++i){
+	    int b=(int)((st->prims[i].c[axis]-cbox.min[axis])*scale);
+	    if(b>=BVH_BINS) b=BVH_BINS-1;
+	    binCount[b]++;
+	    growBox(&binBox[b],&st->prims[i].box);
+	}
+
+	double rightArea[BVH_BINS];
+	int rightCount[BVH_BINS];
+	struct aabb acc;
+	emptyBox(&acc);
+	int cnt=0;
+	for(int b=BVH_BINS-1;b>0;--b){
+	    growBox(&acc,&binBox[b]);
+	    cnt+=binCount[b];
+	    rightArea[b]=boxArea(&acc);
+	    rightCount[b]=cnt;
+	}
+
+	double bestCost=1e300;
+	int bestBin=-1;
+	emptyBox(&acc);
+	cnt=0;
+	for(int b=0;b<BVH_BINS-1;++b){
+	    growBox(&acc,&binBox[b]);
+	    cnt+=binCount[b];
+	    if(cnt==0 || rightCount[b+1]==0) continue;
+	    double cost=batchCost(cnt)*boxArea(&acc)+batchCost(rightCount[b+1])*rightArea[b+1];
+	    if(cost<bestCost){
+		bestCost=cost;
+		bestBin=b;
+	    }
+	}
+
+	double parentArea=boxArea(&node->box);
+	if(parentArea>0) bestCost=BVH_COST_TRAVERSE+BVH_COST_INTERSECT*bestCost/parentArea;
+	double leafCost=BVH_COST_INTERSECT*batchCost(n);
+
+	if(bestBin>=0){
+	    if(n<=BVH_MAX_LEAF && leafCost<=bestCost) return;
+	    //partition the primitives around the chosen bin
+	    int i=start,j=end-1;
+	    while(i<=j){
+		int b=(int)((st->prims[i].c[axis]-cbox.min[axis])*scale);
+		if(b>=BVH_BINS) b=BVH_BINS-1;
+		if(b<=bestBin) ++i;
+		else{
+		    struct buildPrim tmp=st->prims[i];
+		    st->prims[i]=st->prims[j];
+		    st->prims[j]=tmp;
+		    --j;
+		}
+	    }
+	    mid=i;
+	}else if(n<=BVH_MAX_LEAF)
+	    return;
+    }
+    if(mid==start || mid==end) mid=start+n/2;
+
+    //turn this node into an interior node
+    int left=st->numNodes;
+    st->numNodes+=2;
+    node->first=left;
+    node->count=0;
+    node->axis=axis;
+    buildNode(st,left,start,mid,depth+1);
+    buildNode(st,left+1,mid,end,depth+1);
+}
+
+struct bvh *buildBVH(struct object3D *list){
+    int total=0,nu=0;
+    collectPrims(list,NULL,&total,NULL,&nu,1);
+    if(total==0) return NULL;
+
+    struct bvh *tree=(struct bvh *)calloc(1,sizeof(struct bvh));
+    struct buildState st;
+    st.prims=(struct buildPrim *)calloc(total,sizeof(struct buildPrim));
+    st.nodes=(struct bvhNode *)calloc(2*total,sizeof(struct bvhNode));
+    st.numNodes=1;
+    if(!tree || !st.prims || !st.nodes){
+	fprintf(stderr,"Unable to allocate BVH, out of memory!\n");
+	exit(0);
+    }
+    tree->unbounded=(struct object3D **)calloc(total,sizeof(struct object3D *));
+
+    int n=0;
+    collectPrims(list,st.prims,&n,tree->unbounded,&tree->numUnbounded,0);
+    if(n>0) buildNode(&st,0,0,n,0);
+    else st.numNodes=0;
+
+    tree->nodes=st.nodes;
+    tree->numNodes=st.numNodes;
+    tree->numPrims=n;
+    tree->prims=(struct object3D **)calloc(n>0?n:1,sizeof(struct object3D *));
+    for(int i=0;i<n;++i) tree->prims[i]=st.prims[i].obj;
+    free(st.prims);
+
+    //group the primitives of each leaf by kind, so the batched kernels
+    //see runs of primitives of the same kind
+    for(int k=0;k<tree->numNodes;++k){
+	struct bvhNode *node=&tree->nodes[k];
+	struct object3D **lp=tree->prims+node->first;
+	for(int i=1;i<node->count;++i){
+	    struct object3D *o=lp[i];
+	    int j=i-1;
+	    while(j>=0 && primKind(lp[j])>primKind(o)){
+		lp[j+1]=lp[j];
+		--j;
+	    }
+	    lp[j+1]=o;
+	}
+    }
+    tree->batch=newPrimBatch(tree->prims,n);
+    if(!tree->batch) exit(0);
+
+    fprintf(stderr,"BVH: %d primitives, %d nodes, %d unbounded\n",n,tree->numNodes,tree->numUnbounded);
+    return tree;
+}
+
+void deleteBVH(struct bvh *tree){
+    if(!tree) return;
+    free(tree->nodes);
+    free(tree->prims);
+    free(tree->unbounded);
+    deletePrimBatch(tree->batch);
+    free(tree);
+}
+
+
+/////////////////////////////////////////////
+// Traversal
+/////////////////////////////////////////////
+
+// Slab test, returns 1 if the ray overlaps the box for some t in (0,tmax)
+static inline int hitBox(struct aabb *box, double *o, double *invD, double tmax){
+    double t0=0,t1=tmax;
+    for(int k=0;k<3;++k){
+	double tn=(box->min[k]-o[k])*invD[k];
+	double tf=(box->max[k]-o[k])*invD[k];
+	if(tn>tf){ double t=tn; tn=tf; tf=t; }
+	//NaN (ray on the slab boundary with d=0) fails both tests and is ignored
+	if(tn>t0) t0=tn;
+	if(tf<t1) t1=tf;
+	if(t0>t1) return 0;
+    }
+    return 1;
+}
+
+// Tests the ray against the primitives of a leaf (or the unbounded ones
+// when first<0). Runs of primitives of the same kind go through the
+// batched kernels, BATCH_WIDTH at a time. Calls hitFn(obj,t,data) for every
+// hit at lambda>0, stops and returns 1 as soon as hitFn returns 1.
+static inline int leafHits(struct bvh *tree, int first, int count, const struct ray3D *ray,
+			int (*hitFn)(struct object3D *, double, void *), void *data){
+    double temp;
+
+    if(first<0){
+	for(int i=0;i<tree->numUnbounded;++i){
+	    struct object3D *cur=tree->unbounded[i];
+	    temp=hitDistance(cur,ray);
+	    if(temp>0 && hitFn(cur,temp,data)) return 1;
+	}
+	return 0;
+    }
+
+    int end=first+count;
+    for(int i=first;i<end;){
+	int kind=tree->batch->kind[i];
+	if(kind==PRIM_OTHER){
+	    struct object3D *cur=tree->prims[i];
+	    temp=hitDistance(cur,ray);
+	    if(temp>0 && hitFn(cur,temp,data)) return 1;
+	    i++;
+	    continue;
+	}
+	int n=0;
+	while(i+n<end && n<BATCH_WIDTH && tree->batch->kind[i+n]==kind) n++;
+	double t[BATCH_WIDTH];
+	int mask=batchIntersect(tree->batch,i,n,ray,t);
+	for(int k=0;mask;++k,mask>>=1)
+	    if((mask&1) && hitFn(tree->prims[i+k],t[k],data)) return 1;
+	i+=n;
+    }
+    return 0;
+}
+
+struct closestHit{
+    double t;
+    struct object3D *obj;
+};
+
+static int keepClosest(struct object3D *obj, double t, void *data){
+    struct closestHit *c=(struct closestHit *)data;
+    //exact ties happen on coincident faces (e.g. the windows of a building),
+    //break them by object so the result does not depend on the tree shape
+    if(t<c->t || (t==c->t && obj<c->obj)){
+	c->t=t;
+	c->obj=obj;
+    }
+    return 0;
+}
+
+void bvhFirstHit(struct bvh *tree, const struct ray3D *ray, double *lambda, struct object3D **obj,
+		struct point3D *p, struct point3D *n, double *a, double *b, int *goingOut){
+    double o[3]={ray->p0.px,ray->p0.py,ray->p0.pz};
+    double invD[3]={1.0/ray->d.px,1.0/ray->d.py,1.0/ray->d.pz};
+    int neg[3]={invD[0]<0,invD[1]<0,invD[2]<0};
+    struct closestHit best;
+
+    *lambda=-1;
+    *obj=NULL;
+    best.t=1e300;
+    best.obj=NULL;
+    leafHits(tree,-1,0,ray,&keepClosest,&best);
+
+    int stack[BVH_STACK];
+    int sp=0;
+    if(tree->numNodes>0) stack[sp++]=0;
+    while(sp>0){
+	struct bvhNode *node=&tree->nodes[stack[--sp]];
+	if(!hitBox(&node->box,o,invD,best.t)) continue;
+	if(node->count>0)
+	    leafHits(tree,node->first,node->count,ray,&keepClosest,&best);
+	else{
+	    //visit the near child first
+	    assert(sp+2<=BVH_STACK);
+	    if(neg[node->axis]){
+		stack[sp++]=node->first;
+		stack[sp++]=node->first+1;
+	    }else{
+		stack[sp++]=node->first+1;
+		stack[sp++]=node->first;
+	    }
+	}
+    }
+
+    struct object3D *hit=best.obj;
+    if(!hit) return;
+
+    //surface attributes, only for the closest hit
+    *lambda=best.t;
+    *obj=hit;
+    surfaceAt(hit,ray,best.t,p,n,a,b,goingOut);
+
+    /* Transform n and p back to the world coords */
+    matVecMult(hit->Tnorm,n);
+    normalize(n);
+    matVecMult(hit->T,p);
+}
+
+double bvhPrimHit(struct bvh *tree, int i, const struct ray3D *ray){
+    if(tree->batch->kind[i]==PRIM_OTHER){
+	double t=hitDistance(tree->prims[i],ray);
+	return(t>0?t:-1);
+    }
+    double t[BATCH_WIDTH];
+    return(batchIntersect(tree->batch,i,1,ray,t)?t[0]:-1);
+}
+
+// Any object with alpha!=0 blocks the light (same test as findShadowHit())
+static int blocksLight(struct object3D *obj, double t, void *data){
+    if(t>=1) return 0;
+    if(obj->alpha){
+	*(double *)data=0;
+	return 1;
+    }
+    *(double *)data*=(1-obj->alpha);
+    return 0;
+}
+
+double bvhShadowHit(struct bvh *tree, const struct ray3D *ray){
+    double o[3]={ray->p0.px,ray->p0.py,ray->p0.pz};
+    double invD[3]={1.0/ray->d.px,1.0/ray->d.py,1.0/ray->d.pz};
+    double itensity=1;
+
+    if(leafHits(tree,-1,0,ray,&blocksLight,&itensity)) return 0;
+
+    int stack[BVH_STACK];
+    int sp=0;
+    if(tree->numNodes>0) stack[sp++]=0;
+    while(sp>0){
+	struct bvhNode *node=&tree->nodes[stack[--sp]];
+	if(!hitBox(&node->box,o,invD,1)) continue;
+	if(node->count>0){
+	    //any opaque blocker ends the search
+	    if(leafHits(tree,node->first,node->count,ray,&blocksLight,&itensity)) return 0;
+	}else{
+	    assert(sp+2<=BVH_STACK);
+	    stack[sp++]=node->first+1;
+	    stack[sp++]=node->first;
+	}
+    }
+    return itensity;
+}
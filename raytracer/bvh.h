@@ -0,0 +1,79 @@
+/*
+  bvh.h - Bounding volume hierarchy for the ray tracer.
+
+  The scene is kept as a linked list of objects (see RayTracer.h), which
+  is convenient for building scenes but means every ray has to be tested
+  against every object. The structures below hold a binary BVH built
+  once over the world-space bounds of all primitives using the surface
+  area heuristic (SAH). findFirstHit() and findShadowHit() traverse it
+  instead of walking the object list.
+
+  Bounding boxes that only act as containers for a group of objects
+  (objects with children, see buildBuilding()) are not inserted in the
+  hierarchy, their children are inserted instead.
+*/
+
+#include "utils.h"
+#include "batch.h"
+
+#ifndef __bvh_header
+#define __bvh_header
+
+#define BVH_MAX_LEAF 8		// Leaves are forced to split above this many primitives
+#define BVH_BINS 12		// Number of bins used to evaluate the SAH
+#define BVH_STACK 64		// Traversal stack depth
+#define BVH_MAX_DEPTH (BVH_STACK-1)	// Deepest leaf whose traversal fits in the stack
+
+/* Axis aligned bounding box in world coordinates */
+struct aabb{
+	double min[3];
+	double max[3];
+};
+
+/*
+   A node of the hierarchy. Nodes are stored in a flat array, the two
+   children of an interior node are stored next to each other so only
+   the index of the first one is kept. For a leaf, first indexes the
+   primitive array and count is the number of primitives in the leaf.
+*/
+struct bvhNode{
+	struct aabb box;
+	int first;		// Left child (interior) or first primitive (leaf)
+	int count;		// Number of primitives, 0 for interior nodes
+	int axis;		// Split axis, used to order the traversal
+};
+
+struct bvh{
+	struct bvhNode *nodes;
+	int numNodes;
+	struct object3D **prims;	// Primitives, ordered so that leaves are contiguous
+	int numPrims;
+	struct object3D **unbounded;	// Objects with no known bounds, always tested
+	int numUnbounded;
+	struct primBatch *batch;	// SoA copy of prims for the batched kernels
+};
+
+// Computes the world-space bounds of a primitive from its canonical
+// (model space) bounds and its transformation T. Returns 0 if the
+// primitive type is unknown and it can not be bounded.
+int objectBounds(struct object3D *obj, struct aabb *box);
+
+// Builds the hierarchy over every primitive in the object list (including
+// the children of container boxes). Returns NULL if the list is empty.
+struct bvh *buildBVH(struct object3D *list);
+void deleteBVH(struct bvh *tree);
+
+// Closest hit along the ray. Same outputs as findFirstHit(), obj is NULL
+// if nothing was hit.
+void bvhFirstHit(struct bvh *tree, const struct ray3D *ray, double *lambda, struct object3D **obj,
+		struct point3D *p, struct point3D *n, double *a, double *b, int *goingOut);
+
+// Lambda of the hit of tree->prims[i] by the ray, tested with the same
+// kernel as the traversal, or -1 if it is missed.
+double bvhPrimHit(struct bvh *tree, int i, const struct ray3D *ray);
+
+// Light transmitted along a shadow ray for t in (0,1), same semantics as
+// findShadowHit().
+double bvhShadowHit(struct bvh *tree, const struct ray3D *ray);
+
+#endif
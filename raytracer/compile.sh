@@ -1,2 +1,2 @@
 #!/bin/sh
-g++ -O4 -g svdDynamic.cpp RayTracer.cpp utils.cpp -lm -o RayTracer
+g++ -O4 -g -mavx2 -mfma svdDynamic.cpp RayTracer.cpp utils.cpp bvh.cpp batch.cpp scheduler.cpp packet.cpp lights.cpp sampler.cpp film.cpp raster.cpp texture.cpp -lm -fopenmp -o RayTracer
@@ -0,0 +1,144 @@
+/*
+   film.cpp - Reconstruction filters and the accumulation film, see film.h
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "film.h"
+
+static const char *names[FILTER_TYPES]={"none","box","tent","gaussian","mitchell"};
+static const double defaultRadius[FILTER_TYPES]={0,.5,1,1.5,2};
+
+int filterType(const char *name){
+    for(int t=0;t<FILTER_TYPES;++t)
+	if(strcmp(name,names[t])==0) return(t);
+    return(-1);
+}
+
+const char *filterName(int type){
+    return(type>=0 && type<FILTER_TYPES?names[type]:"unknown");
+}
+
+// 1D profile of the filter at offset x, |x|<=radius
+static double profile(int type, double radius, double x){
+    x=fabs(x);
+    switch(type){
+	case FILTER_TENT:
+	    return(1-x/radius);
+	case FILTER_GAUSSIAN:{
+	    //sigma .5, shifted down so it reaches 0 at the radius
+	    const double a=1/(2*.5*.5);
+	    return(exp(-a*x*x)-exp(-a*radius*radius));
+	}
+	case FILTER_MITCHELL:{
+	    //Mitchell-Netravali with B=C=1/3, scaled to the radius
+	    const double B=1.0/3,C=1.0/3;
+	    x*=2/radius;
+	    if(x<1) return(((12-9*B-6*C)*x*x*x+(-18+12*B+6*C)*x*x+(6-2*B))/6);
+	    return(((-B-6*C)*x*x*x+(6*B+30*C)*x*x+(-12*B-48*C)*x+(8*B+24*C))/6);
+	}
+    }
+    return(1);	// FILTER_BOX
+}
+
+struct filter *newFilter(int type, double radius){
+    if(type<=FILTER_NONE || type>=FILTER_TYPES) return(NULL);
+    struct filter *f=(struct filter *)calloc(1,sizeof(struct filter));
+    if(!f){
+	fprintf(stderr,"Unable to allocate filter, out of memory!\n");
+	return(NULL);
+    }
+    f->type=type;
+    f->radius=radius>0?radius:defaultRadius[type];
+
+    //tabulate the profile, and the CDF of its absolute value
+    double bin=2*f->radius/FILTER_TABLE,total=0;
+    f->cdf[0]=0;
+    for(int i=0;i<FILTER_TABLE;++i){
+	f->f[i]=profile(type,f->radius,-f->radius+(i+.5)*bin);
+	total+=fabs(f->f[i])*bin;
+	f->cdf[i+1]=total;
+    }
+    for(int i=0;i<FILTER_TABLE;++i){
+	f->cdf[i+1]/=total;
+	//pdf is |f|/total in each bin, so f/pdf is +-total
+	f->weight[i]=f->f[i]>0?total:(f->f[i]<0?-total:0);
+    }
+    f->cdf[FILTER_TABLE]=1;
+    return(f);
+}
+
+void deleteFilter(struct filter *f){
+    free(f);
+}
+
+double filterSample(const struct filter *f, double u){
+    //bin with cdf[i]<=u<cdf[i+1]
+    int lo=0,hi=FILTER_TABLE;
+    while(hi-lo>1){
+	int mid=(lo+hi)/2;
+	if(f->cdf[mid]<=u) lo=mid;
+	else hi=mid;
+    }
+    double width=f->cdf[lo+1]-f->cdf[lo];
+    double t=width>0?(u-f->cdf[lo])/width:.5;
+    return(-f->radius+(lo+t)*(2*f->radius/FILTER_TABLE));
+}
+
+struct film *newFilm(int x0, int y0, int sx, int sy){
+    struct film *fm=(struct film *)calloc(1,sizeof(struct film));
+    if(!fm){
+	fprintf(stderr,"Unable to allocate film, out of memory!\n");
+	return(NULL);
+    }
+    fm->x0=x0;
+    fm->y0=y0;
+    fm->sx=sx;
+    fm->sy=sy;
+    fm->tilesX=(sx+FILM_TILE-1)/FILM_TILE;
+    fm->size=fm->tilesX*((sy+FILM_TILE-1)/FILM_TILE)*FILM_TILE*FILM_TILE;
+    fm->rgb=(double *)calloc(3*fm->size,sizeof(double));
+    fm->weight=(double *)calloc(fm->size,sizeof(double));
+    if(!fm->rgb || !fm->weight){
+	fprintf(stderr,"Unable to allocate film, out of memory!\n");
+	deleteFilm(fm);
+	return(NULL);
+    }
+    return(fm);
+}
+
+void deleteFilm(struct film *fm){
+    if(!fm) return;
+    free(fm->rgb);
+    free(fm->weight);
+    free(fm);
+}
+
+void clearFilm(struct film *fm){
+    memset(fm->rgb,0,3*fm->size*sizeof(double));
+    memset(fm->weight,0,fm->size*sizeof(double));
+}
+
+void resolveFilm(const struct film *fm, struct image *im, double exposure, int step){
+    unsigned char *rgbIm=(unsigned char *)im->rgbdata;
+    for(int j=0;j<fm->sy;++j)
+	for(int i=0;i<fm->sx;++i){
+	    int src=filmIndex(fm,fm->x0+i-i%step,fm->y0+j-j%step);
+	    const double *p=&fm->rgb[3*src];
+	    double w=fm->weight[src];
+	    struct colourRGB col={p[0],p[1],p[2]};
+	    //the weighted mean, whatever the filter's total weight
+	    if(w!=0) mult_col(exposure/w,&col);
+	    if(col.R<0) col.R=0;
+	    if(col.G<0) col.G=0;
+	    if(col.B<0) col.B=0;
+	    if(col.R>1) col.R=1;
+	    if(col.G>1) col.G=1;
+	    if(col.B>1) col.B=1;
+	    *(rgbIm+j*fm->sx*3+i*3+0)=col.R*255;
+	    *(rgbIm+j*fm->sx*3+i*3+1)=col.G*255;
+	    *(rgbIm+j*fm->sx*3+i*3+2)=col.B*255;
+	}
+}
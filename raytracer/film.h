@@ -0,0 +1,131 @@
+/*
+  film.h - Pixel reconstruction filters and the accumulation film.
+
+  The original anti-aliasing weights the samples of each pixel with a
+  3x3 table of Gaussian values (gen_Gaussian_weight()), so the filter
+  ends at the pixel's edges and the weights do not sum to 1. With a
+  reconstruction filter (-filter) the samples are spread over the
+  filter's whole footprint instead, which is wider than the pixel, by
+  filter importance sampling: each coordinate of the position in the
+  pixel is drawn from the filter's 1D profile (all filters here are
+  separable) through a tabulated inverse CDF.
+
+  The weight of a sample is then f/pdf, the same for every sample up to
+  its sign, so every sample still lands in its own pixel only. Tiles do
+  not need to write into their neighbours, and the image does not depend
+  on the number of threads. The value of the pixel is the ratio of the
+  sum of the weighted samples to the sum of the weights, which also
+  handles the negative lobes of the Mitchell filter.
+
+  Every pixel's sums go to the film, a buffer of doubles with a weight
+  sum per pixel, and the film is resolved into the 8 bit image once the
+  tiles are done. Samples can keep being added to the film by later
+  passes. The resolved value is the weighted mean itself (an exposure of
+  1), whatever the total weight of the filter. The original renderer
+  scaled it by the sum of its unnormalised 3x3 Gaussian weights, about
+  .78 (GRID_EXPOSURE), which darkened every image; -exposure brings that
+  look back.
+
+  The film is stored in FILM_TILE x FILM_TILE blocks, one after the
+  other, rather than row by row. A render tile (TILE_SIZE is the same
+  size) then writes to one contiguous block of memory instead of a
+  strip of every row of the image, which matters for wide images where
+  each row is many pages long. resolveFilm() swizzles the blocks back
+  into the row-major order of the output image.
+
+  A film may cover a crop window of the image only, it then starts at
+  pixel (x0,y0) and the blocks are aligned with that corner.
+*/
+
+#include "utils.h"
+
+#ifndef __film_header
+#define __film_header
+
+#define FILTER_NONE 0		// Per pixel weights of the sampler (the original anti-aliasing)
+#define FILTER_BOX 1
+#define FILTER_TENT 2
+#define FILTER_GAUSSIAN 3
+#define FILTER_MITCHELL 4
+#define FILTER_TYPES 5
+
+#define FILTER_TABLE 256	// Bins of the tabulated 1D profile
+#define GRID_EXPOSURE .77948368	// Sum of the original 3x3 Gaussian weights, see -exposure
+
+#define FILM_TILE_SHIFT 4
+#define FILM_TILE (1<<FILM_TILE_SHIFT)	// Width and height of the blocks of the film
+
+struct filter{
+	int type;		// FILTER_*
+	double radius;		// Half width, in pixels
+	double f[FILTER_TABLE];	// Profile at the centre of each bin over [-radius,radius]
+	double cdf[FILTER_TABLE+1];	// Of |f|, cdf[0]=0 and cdf[FILTER_TABLE]=1
+	double weight[FILTER_TABLE];	// f/pdf in each bin
+};
+
+/* Weighted sums of the samples of every pixel */
+struct film{
+	int x0, y0;		// Pixel of the image at the top left of the film
+	int sx, sy;
+	int tilesX;		// Blocks along x
+	int size;		// Pixels allocated, whole blocks
+	double *rgb;		// Sum of weight*colour, 3 per pixel
+	double *weight;		// Sum of the weights
+};
+
+// Filter of the given type, with its default radius if radius<=0.
+// Returns NULL for FILTER_NONE or if out of memory.
+struct filter *newFilter(int type, double radius);
+void deleteFilter(struct filter *f);
+
+// FILTER_* with the given name ("box", "gaussian", ...), -1 if none
+int filterType(const char *name);
+const char *filterName(int type);
+
+// Offset from the centre of the pixel, in [-radius,radius], for the
+// uniform random number u in [0,1)
+double filterSample(const struct filter *f, double u);
+
+// Weight (f/pdf) of a sample at offset x from the centre of the pixel
+static inline double filterWeight(const struct filter *f, double x)
+{
+ int i=(int)((x+f->radius)/(2*f->radius)*FILTER_TABLE);
+ if (i<0) i=0;
+ if (i>=FILTER_TABLE) i=FILTER_TABLE-1;
+ return(f->weight[i]);
+}
+
+// Film over the sx x sy pixels of the image from (x0,y0)
+struct film *newFilm(int x0, int y0, int sx, int sy);
+void deleteFilm(struct film *fm);
+void clearFilm(struct film *fm);
+
+// Position of pixel (i,j) of the image in the film: its block, then
+// row-major within it
+static inline int filmIndex(const struct film *fm, int i, int j)
+{
+ i-=fm->x0;
+ j-=fm->y0;
+ int block=(j>>FILM_TILE_SHIFT)*fm->tilesX+(i>>FILM_TILE_SHIFT);
+ return((block<<(2*FILM_TILE_SHIFT))+((j&(FILM_TILE-1))<<FILM_TILE_SHIFT)+(i&(FILM_TILE-1)));
+}
+
+// Adds the weighted sum col and the weight sum w to pixel (i,j)
+static inline void filmAdd(struct film *fm, int i, int j, const struct colourRGB *col, double w)
+{
+ int k=filmIndex(fm,i,j);
+ double *p=&fm->rgb[3*k];
+ p[0]+=col->R;
+ p[1]+=col->G;
+ p[2]+=col->B;
+ fm->weight[k]+=w;
+}
+
+// Writes exposure times the weighted mean of every pixel of the film to
+// im (same size as the film), clamped to [0,1]. With step>1 only every
+// step-th pixel along x and y from the corner of the film has samples
+// (a coarse preview), and every pixel shows the one at the top left of
+// its step x step block.
+void resolveFilm(const struct film *fm, struct image *im, double exposure, int step);
+
+#endif
@@ -0,0 +1,310 @@
+/*
+   lights.cpp - Light table and vectorized Phong factors, see lights.h
+
+   lightTerms() follows the diffuse and specular terms of rtShade() step
+   by step (normalizing by the reciprocal of the length, as normalize()
+   does), so the AVX2 and scalar paths give the same factors.
+*/
+
+#include <algorithm>	// Before utils.h, svdDynamic.h defines a max() macro
+#include "lights.h"
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#define LIGHT_PAD 4		// Arrays are padded so a full register can be loaded past the last light
+
+static void lightBounds(const struct lightTable *lt, int l, double *lo, double *hi){
+    double c[3]={lt->x[l],lt->y[l],lt->z[l]};
+    for(int k=0;k<3;++k){
+	lo[k]=c[k]-lt->radius[l];
+	hi[k]=c[k]+lt->radius[l];
+    }
+}
+
+// Builds the subtree over lights idx[0..n-1] at node, splitting at the
+// median centre along the longest axis of the node. Returns the next
+// free node.
+static int buildLightTree(struct lightTable *lt, int *idx, int n, int node){
+    struct lightNode *nd=&lt->nodes[node];
+    lightBounds(lt,idx[0],nd->min,nd->max);
+    nd->power=0;
+    for(int i=0;i<n;++i){
+	double lo[3],hi[3];
+	lightBounds(lt,idx[i],lo,hi);
+	for(int k=0;k<3;++k){
+	    if(lo[k]<nd->min[k]) nd->min[k]=lo[k];
+	    if(hi[k]>nd->max[k]) nd->max[k]=hi[k];
+	}
+	nd->power+=(lt->R[idx[i]]+lt->G[idx[i]]+lt->B[idx[i]])/3;
+    }
+    if(n==1){
+	nd->right=-1;
+	nd->light=idx[0];
+	return(node+1);
+    }
+
+    int axis=0;
+    for(int k=1;k<3;++k)
+	if(nd->max[k]-nd->min[k]>nd->max[axis]-nd->min[axis]) axis=k;
+    const double *c=axis==0?lt->x:(axis==1?lt->y:lt->z);
+    //order the lights by centre along the axis, ties by index so the tree is deterministic
+    std::sort(idx,idx+n,[c](int a,int b){ return c[a]<c[b] || (c[a]==c[b] && a<b); });
+
+    int half=n/2;
+    int next=buildLightTree(lt,idx,half,node+1);
+    nd->right=next;
+    nd->light=-1;
+    return(buildLightTree(lt,idx+half,n-half,next));
+}
+
+struct lightTable *newLightTable(struct object3D *list){
+    struct lightTable *lt=(struct lightTable *)calloc(1,sizeof(struct lightTable));
+    if(!lt){
+	fprintf(stderr,"Unable to allocate light table, out of memory!\n");
+	return(NULL);
+    }
+    int num=0;
+    for(struct object3D *o=list;o!=NULL;o=o->next) num++;
+
+    int size=num+LIGHT_PAD;
+    lt->num=num;
+    lt->x=(double *)calloc(size,sizeof(double));
+    lt->y=(double *)calloc(size,sizeof(double));
+    lt->z=(double *)calloc(size,sizeof(double));
+    lt->radius=(double *)calloc(size,sizeof(double));
+    lt->R=(double *)calloc(size,sizeof(double));
+    lt->G=(double *)calloc(size,sizeof(double));
+    lt->B=(double *)calloc(size,sizeof(double));
+    for(int k=0;k<9;++k) lt->basis[k]=(double *)calloc(size,sizeof(double));
+
+    int i=0;
+    for(struct object3D *o=list;o!=NULL;o=o->next,++i){
+	lt->x[i]=o->T[0][3];
+	lt->y[i]=o->T[1][3];
+	lt->z[i]=o->T[2][3];
+	//length of the image of the model x axis
+	double r=sqrt(o->T[0][0]*o->T[0][0]+o->T[1][0]*o->T[1][0]+o->T[2][0]*o->T[2][0]);
+	lt->radius[i]=r;
+	lt->R[i]=o->col.R;
+	lt->G[i]=o->col.G;
+	lt->B[i]=o->col.B;
+	for(int row=0;row<3;++row)
+	    for(int col=0;col<3;++col)
+		lt->basis[3*row+col][i]=o->T[row][col];
+	lt->ambient[0]+=lt->R[i];
+	lt->ambient[1]+=lt->G[i];
+	lt->ambient[2]+=lt->B[i];
+    }
+
+    if(num>0){
+	lt->nodes=(struct lightNode *)calloc(2*num-1,sizeof(struct lightNode));
+	int *idx=(int *)calloc(num,sizeof(int));
+	if(!lt->nodes || !idx){
+	    fprintf(stderr,"Unable to allocate light tree, out of memory!\n");
+	    free(idx);
+	    deleteLightTable(lt);
+	    return(NULL);
+	}
+	for(int l=0;l<num;++l) idx[l]=l;
+	buildLightTree(lt,idx,num,0);
+	free(idx);
+    }
+    return(lt);
+}
+
+void deleteLightTable(struct lightTable *lt){
+    if(!lt) return;
+    free(lt->x);
+    free(lt->y);
+    free(lt->z);
+    free(lt->radius);
+    free(lt->R);
+    free(lt->G);
+    free(lt->B);
+    for(int k=0;k<9;++k) free(lt->basis[k]);
+    free(lt->nodes);
+    free(lt);
+}
+
+void lightConePoint(const struct lightTable *lt, int l, const struct point3D *p, double u1, double u2,
+		struct point3D *q){
+    double r=lt->radius[l];
+    struct point3D w={lt->x[l]-p->px,lt->y[l]-p->py,lt->z[l]-p->pz,0};
+    double d2=dot(&w,&w);
+    if(d2<=r*r){
+	q->px=lt->x[l];
+	q->py=lt->y[l];
+	q->pz=lt->z[l];
+	q->pw=1;
+	return;
+    }
+    double d=sqrt(d2);
+    multVector(1/d,&w);
+
+    //1-cos(theta_max) without the cancellation for small, far lights
+    double sin2Max=r*r/d2;
+    double cosT=1-u1*sin2Max/(1+sqrt(1-sin2Max));
+    double sinT=sqrt(fmax(0,1-cosT*cosT));
+    double phi=2*PI*u2;
+
+    //orthonormal basis u,v,w around the direction to the centre
+    double sign=w.pz>=0?1:-1;
+    double a=-1/(sign+w.pz);
+    double b=w.px*w.py*a;
+    struct point3D u={1+sign*w.px*w.px*a,sign*b,-sign*w.px,0};
+    struct point3D v={b,sign+w.py*w.py*a,-w.py,0};
+
+    double su=sinT*cos(phi),sv=sinT*sin(phi);
+    double dx=u.px*su+v.px*sv+w.px*cosT;
+    double dy=u.py*su+v.py*sv+w.py*cosT;
+    double dz=u.pz*su+v.pz*sv+w.pz*cosT;
+    //distance to the near side of the sphere along the direction
+    double t=d*cosT-sqrt(fmax(0,r*r-d2*sinT*sinT));
+    q->px=p->px+t*dx;
+    q->py=p->py+t*dy;
+    q->pz=p->pz+t*dz;
+    q->pw=1;
+}
+
+// Estimated contribution of the lights below nd to point p with normal
+// nrm: their power times a bound on n.s over every direction s into the box.
+static double nodeWeight(const struct lightNode *nd, const struct point3D *p, const struct point3D *nrm,
+		int twoSided){
+    double d[3],h2=0,d2=0;
+    d[0]=.5*(nd->min[0]+nd->max[0])-p->px;
+    d[1]=.5*(nd->min[1]+nd->max[1])-p->py;
+    d[2]=.5*(nd->min[2]+nd->max[2])-p->pz;
+    for(int k=0;k<3;++k){
+	double h=.5*(nd->max[k]-nd->min[k]);
+	h2+=h*h;
+	d2+=d[k]*d[k];
+    }
+    if(d2<=h2) return(nd->power);	//p is inside the bounding sphere of the box
+
+    //cone from p around the box, half angle b, and angle t to the normal
+    double dist=sqrt(d2);
+    double cosT=(d[0]*nrm->px+d[1]*nrm->py+d[2]*nrm->pz)/dist;
+    if(twoSided) cosT=fabs(cosT);
+    double sinB=sqrt(h2)/dist;
+    double cosB=sqrt(1-sinB*sinB);
+    double bound=1;
+    if(cosT<cosB){
+	//cos(t-b), the closest direction in the cone
+	double sinT=sqrt(fmax(0,1-cosT*cosT));
+	bound=cosT*cosB+sinT*sinB;
+    }
+    return(nd->power*fmax(bound,LIGHT_MIN_WEIGHT));
+}
+
+int sampleLight(const struct lightTable *lt, const struct point3D *p, const struct point3D *nrm,
+		int twoSided, double u, double *pdf){
+    int node=0;
+    double prob=1;
+    while(lt->nodes[node].right>=0){
+	const struct lightNode *nd=&lt->nodes[node];
+	double wl=nodeWeight(nd+1,p,nrm,twoSided);
+	double wr=nodeWeight(&lt->nodes[nd->right],p,nrm,twoSided);
+	double pl=(wl+wr>0)?wl/(wl+wr):.5;	//black lights have no power
+	//reuse u for the rest of the way down, rescaled to [0,1)
+	if(u<pl){
+	    u/=pl;
+	    prob*=pl;
+	    node=node+1;
+	}else{
+	    u=(u-pl)/(1-pl);
+	    prob*=1-pl;
+	    node=nd->right;
+	}
+    }
+    *pdf=prob;
+    return(lt->nodes[node].light);
+}
+
+#ifndef __AVX2__
+// Negative dot products are flipped (two sided) or clamped to 0
+static inline double facing(double d, int twoSided){
+    if(d<0) return twoSided?-d:0;
+    return d;
+}
+#endif
+
+void lightTerms(const struct lightTable *lt, int first, int n, const struct point3D *p,
+		const struct point3D *nrm, const struct point3D *b, double shiny, int twoSided,
+		double *diff, double *spec){
+    int k=0;
+#ifdef __AVX2__
+    const __m256d one=_mm256_set1_pd(1.0);
+    const __m256d zero=_mm256_setzero_pd();
+    const __m256d sign=_mm256_set1_pd(-0.0);
+    const __m256d px=_mm256_set1_pd(p->px),py=_mm256_set1_pd(p->py),pz=_mm256_set1_pd(p->pz);
+    const __m256d nx=_mm256_set1_pd(nrm->px),ny=_mm256_set1_pd(nrm->py),nz=_mm256_set1_pd(nrm->pz);
+    const __m256d bx=_mm256_set1_pd(b->px),by=_mm256_set1_pd(b->py),bz=_mm256_set1_pd(b->pz);
+    double dots[LIGHT_CHUNK];
+
+    for(;k<n;k+=4){
+	int l=first+k;
+	//unit vector s towards the centre of the light
+	__m256d sx=_mm256_sub_pd(_mm256_loadu_pd(lt->x+l),px);
+	__m256d sy=_mm256_sub_pd(_mm256_loadu_pd(lt->y+l),py);
+	__m256d sz=_mm256_sub_pd(_mm256_loadu_pd(lt->z+l),pz);
+	__m256d len=_mm256_mul_pd(sx,sx);
+	len=_mm256_add_pd(len,_mm256_mul_pd(sy,sy));
+	len=_mm256_add_pd(len,_mm256_mul_pd(sz,sz));
+	//keep every lane finite, even if p is at the centre of a light
+	len=_mm256_blendv_pd(len,one,_mm256_cmp_pd(len,zero,_CMP_EQ_OQ));
+	__m256d inv=_mm256_div_pd(one,_mm256_sqrt_pd(len));
+	sx=_mm256_mul_pd(sx,inv);
+	sy=_mm256_mul_pd(sy,inv);
+	sz=_mm256_mul_pd(sz,inv);
+
+	__m256d ns=_mm256_mul_pd(nx,sx);
+	ns=_mm256_add_pd(ns,_mm256_mul_pd(ny,sy));
+	ns=_mm256_add_pd(ns,_mm256_mul_pd(nz,sz));
+
+	//reflection of s about n, r=2(n.s)n-s
+	__m256d up=_mm256_add_pd(ns,ns);
+	__m256d rx=_mm256_sub_pd(_mm256_mul_pd(nx,up),sx);
+	__m256d ry=_mm256_sub_pd(_mm256_mul_pd(ny,up),sy);
+	__m256d rz=_mm256_sub_pd(_mm256_mul_pd(nz,up),sz);
+	len=_mm256_mul_pd(rx,rx);
+	len=_mm256_add_pd(len,_mm256_mul_pd(ry,ry));
+	len=_mm256_add_pd(len,_mm256_mul_pd(rz,rz));
+	len=_mm256_blendv_pd(len,one,_mm256_cmp_pd(len,zero,_CMP_EQ_OQ));
+	inv=_mm256_div_pd(one,_mm256_sqrt_pd(len));
+
+	__m256d br=_mm256_mul_pd(bx,_mm256_mul_pd(rx,inv));
+	br=_mm256_add_pd(br,_mm256_mul_pd(by,_mm256_mul_pd(ry,inv)));
+	br=_mm256_add_pd(br,_mm256_mul_pd(bz,_mm256_mul_pd(rz,inv)));
+
+	if(twoSided){
+	    ns=_mm256_andnot_pd(sign,ns);
+	    br=_mm256_andnot_pd(sign,br);
+	}else{
+	    ns=_mm256_max_pd(ns,zero);
+	    br=_mm256_max_pd(br,zero);
+	}
+	_mm256_storeu_pd(diff+k,ns);
+	_mm256_storeu_pd(dots+k,br);
+    }
+    //no vector pow, the exponents are done one light at a time
+    for(k=0;k<n;++k) spec[k]=pow(dots[k],shiny);
+#else
+    for(;k<n;++k){
+	int l=first+k;
+	struct point3D s={lt->x[l]-p->px,lt->y[l]-p->py,lt->z[l]-p->pz,1};
+	normalize(&s);
+	s.pw=0;
+
+	struct point3D r=*nrm;
+	multVector(2*dot(nrm,&s),&r);
+	subVectors(&s,&r);
+	normalize(&r);
+	r.pw=0;
+
+	diff[k]=facing(dot(nrm,&s),twoSided);
+	spec[k]=pow(facing(dot(b,&r),twoSided),shiny);
+    }
+#endif
+}
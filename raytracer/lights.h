@@ -0,0 +1,114 @@
+/*
+  lights.h - Light table for direct lighting.
+
+  Lights are built as sphere objects in light_list (see buildScene()),
+  which is convenient for setting up a scene but slow to shade with:
+  every shade walked the list and transformed each light's centre by its
+  T. Once the scene is built the lights are copied into a table in
+  structure-of-arrays form, with everything the shader needs already in
+  world space, and the list is not looked at again while rendering.
+
+  The diffuse and specular factors only depend on the direction to the
+  centre of each light, so they are evaluated for 4 lights at a time
+  with AVX2 (4 doubles per register). The shadow rays, which do depend
+  on the sample, are traced one by one by the shader.
+
+  Shadow rays are aimed at the lights in one of two ways. The original
+  sampler (LIGHT_SAMPLE_VOLUME) picks a point inside the light's ball;
+  many of those points are hidden behind the front of the sphere or deep
+  inside it. The cone sampler (LIGHT_SAMPLE_CONE, the default) picks a
+  direction uniformly over the cone the sphere subtends from the shading
+  point, with pdf 1/(2pi(1-cos(theta_max))), and aims at the visible
+  point of the sphere along it. The shader uses the fraction of the
+  light that is visible, which is the mean visibility of the samples
+  because the pdf is uniform over the visible cone, so the samples need
+  no extra weight.
+
+  There is no limit on the number of lights, but shooting shadow rays
+  at every light costs O(lights x samples) per shade. Above a threshold
+  (see -lighttree) the shader instead picks one light per shadow ray from
+  a binary tree over the lights (a light BVH): at every node a child is
+  chosen with probability proportional to its estimated contribution,
+  and the sample is divided by the probability of the light picked. The
+  cost per shade is then O(samples x log lights).
+
+  Lights in this renderer do not fall off with distance, so the estimate
+  is the power of the node times a bound on the cosine between the
+  normal and any direction into the node's box. It is clamped to
+  LIGHT_MIN_WEIGHT so lights behind the surface, which may still add a
+  specular highlight, keep a nonzero probability.
+*/
+
+#include "utils.h"
+
+#ifndef __lights_header
+#define __lights_header
+
+#define LIGHT_CHUNK 16		// Lights evaluated per call to lightTerms()
+#define LIGHT_TREE_MIN 16	// Default number of lights above which the tree is used
+#define LIGHT_MIN_WEIGHT .05	// Lowest cosine bound used to weight a node
+
+// Ways of picking the point a shadow ray aims at
+#define LIGHT_SAMPLE_VOLUME 0	// Point in the ball of the light (needs 3 random numbers)
+#define LIGHT_SAMPLE_CONE 1	// Direction in the cone subtended by the light (needs 2)
+
+/*
+   A node of the light tree, stored in a flat array in depth first
+   order: the left child of an interior node is the next node, right is
+   the index of the other one. Leaves hold a single light.
+*/
+struct lightNode{
+	double min[3];		// Bounds of the light spheres below the node
+	double max[3];
+	double power;		// Sum of the mean colour of the lights below
+	int right;		// Right child, -1 for a leaf
+	int light;		// Light index, for a leaf
+};
+
+struct lightTable{
+	int num;		// Number of lights
+	double *x, *y, *z;	// Centre in world coordinates
+	double *radius;		// Radius in world coordinates
+	double *R, *G, *B;	// Colour
+	double *basis[9];	// Maps the unit ball onto the light's ball, basis[3*row+col][i]
+				// for light i (row major 3x3)
+	double ambient[3];	// Sum of the colours of all the lights
+	struct lightNode *nodes;	// Light tree, 2*num-1 nodes
+};
+
+// Builds the table from the light list. The radius is taken from the
+// scale in each light's T, lights are expected to be scaled uniformly.
+struct lightTable *newLightTable(struct object3D *list);
+void deleteLightTable(struct lightTable *lt);
+
+// Point of light l for the unit ball sample (ux,uy,uz)
+static inline void lightPoint(const struct lightTable *lt, int l, double ux, double uy, double uz, struct point3D *q)
+{
+ q->px=lt->x[l]+lt->basis[0][l]*ux+lt->basis[1][l]*uy+lt->basis[2][l]*uz;
+ q->py=lt->y[l]+lt->basis[3][l]*ux+lt->basis[4][l]*uy+lt->basis[5][l]*uz;
+ q->pz=lt->z[l]+lt->basis[6][l]*ux+lt->basis[7][l]*uy+lt->basis[8][l]*uz;
+ q->pw=1;
+}
+
+// Point of light l seen from p along a direction picked uniformly over
+// the cone the light subtends, for the uniform random numbers u1 and u2.
+// Returns the centre if p is inside the light.
+void lightConePoint(const struct lightTable *lt, int l, const struct point3D *p, double u1, double u2,
+		struct point3D *q);
+
+// Picks a light for a shadow ray from point p with normal nrm, walking
+// the light tree with the uniform random number u in [0,1). Returns the
+// light and sets pdf to the probability it was picked with.
+int sampleLight(const struct lightTable *lt, const struct point3D *p, const struct point3D *nrm,
+		int twoSided, double u, double *pdf);
+
+// Phong factors of lights [first,first+n) at point p with normal n, seen
+// from direction b (pointing away from p), n<=LIGHT_CHUNK. diff[k] is
+// n.s and spec[k] is (b.r)^shiny for light first+k, with s the unit
+// vector towards the light's centre and r its reflection about n.
+// Negative dot products are flipped if twoSided and clamped to 0 otherwise.
+void lightTerms(const struct lightTable *lt, int first, int n, const struct point3D *p,
+		const struct point3D *nrm, const struct point3D *b, double shiny, int twoSided,
+		double *diff, double *spec);
+
+#endif
@@ -0,0 +1,271 @@
+/*
+   packet.cpp - Packet traversal of the BVH for primary rays, see packet.h
+
+   The AVX2 kernels below follow the scalar planeIntersect(),
+   sphereIntersect() and boxIntersect() in utils.cpp step by step, so a
+   lane finds the same closest object as the scalar code would. Other
+   primitives, and every primitive when AVX2 is not available, are
+   intersected one lane at a time through hitDistance().
+*/
+
+#include <assert.h>
+#include "packet.h"
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+// Intersects one lane of the packet with obj through the scalar path
+static inline void laneIntersect(struct object3D *obj, struct rayPacket *pk, int k){
+    struct ray3D ray;
+    double lambda;
+
+    ray.p0.px=pk->ox[k]; ray.p0.py=pk->oy[k]; ray.p0.pz=pk->oz[k]; ray.p0.pw=1;
+    ray.d.px=pk->dx[k];  ray.d.py=pk->dy[k];  ray.d.pz=pk->dz[k];  ray.d.pw=0;
+    ray.rayPos=&rayPosition;
+    lambda=hitDistance(obj,&ray);
+    if(lambda>0 && lambda<pk->t[k]){
+	pk->t[k]=lambda;
+	pk->obj[k]=obj;
+    }
+}
+
+#ifdef __AVX2__
+
+/* Four lanes of the packet transformed into the model space of an object */
+struct ray4{
+    __m256d ox,oy,oz;
+    __m256d dx,dy,dz;
+};
+
+static inline void toModel4(double M[4][4], struct rayPacket *pk, int g, struct ray4 *r){
+    __m256d ox=_mm256_load_pd(pk->ox+4*g);
+    __m256d oy=_mm256_load_pd(pk->oy+4*g);
+    __m256d oz=_mm256_load_pd(pk->oz+4*g);
+    __m256d dx=_mm256_load_pd(pk->dx+4*g);
+    __m256d dy=_mm256_load_pd(pk->dy+4*g);
+    __m256d dz=_mm256_load_pd(pk->dz+4*g);
+    __m256d *o[3]={&r->ox,&r->oy,&r->oz};
+    __m256d *d[3]={&r->dx,&r->dy,&r->dz};
+    for(int i=0;i<3;++i){
+	__m256d m0=_mm256_set1_pd(M[i][0]);
+	__m256d m1=_mm256_set1_pd(M[i][1]);
+	__m256d m2=_mm256_set1_pd(M[i][2]);
+	*o[i]=_mm256_fmadd_pd(m0,ox,_mm256_fmadd_pd(m1,oy,_mm256_fmadd_pd(m2,oz,_mm256_set1_pd(M[i][3]))));
+	*d[i]=_mm256_fmadd_pd(m0,dx,_mm256_fmadd_pd(m1,dy,_mm256_mul_pd(m2,dz)));
+    }
+}
+
+// A t^2 + B t + C = 0 for 4 lanes and the world-space quadric Q, as in quadricCoefs()
+static inline void quadric4(double Q[10], struct rayPacket *pk, int g, __m256d *A, __m256d *B, __m256d *C){
+    __m256d ox=_mm256_load_pd(pk->ox+4*g);
+    __m256d oy=_mm256_load_pd(pk->oy+4*g);
+    __m256d oz=_mm256_load_pd(pk->oz+4*g);
+    __m256d dx=_mm256_load_pd(pk->dx+4*g);
+    __m256d dy=_mm256_load_pd(pk->dy+4*g);
+    __m256d dz=_mm256_load_pd(pk->dz+4*g);
+    __m256d q[10];
+    for(int i=0;i<10;++i) q[i]=_mm256_set1_pd(Q[i]);
+    __m256d two=_mm256_set1_pd(2.0);
+
+    __m256d qd0=_mm256_fmadd_pd(q[0],dx,_mm256_fmadd_pd(q[1],dy,_mm256_mul_pd(q[2],dz)));
+    __m256d qd1=_mm256_fmadd_pd(q[1],dx,_mm256_fmadd_pd(q[4],dy,_mm256_mul_pd(q[5],dz)));
+    __m256d qd2=_mm256_fmadd_pd(q[2],dx,_mm256_fmadd_pd(q[5],dy,_mm256_mul_pd(q[7],dz)));
+    __m256d qd3=_mm256_fmadd_pd(q[3],dx,_mm256_fmadd_pd(q[6],dy,_mm256_mul_pd(q[8],dz)));
+    *A=_mm256_fmadd_pd(dx,qd0,_mm256_fmadd_pd(dy,qd1,_mm256_mul_pd(dz,qd2)));
+    *B=_mm256_mul_pd(two,_mm256_fmadd_pd(ox,qd0,_mm256_fmadd_pd(oy,qd1,_mm256_fmadd_pd(oz,qd2,qd3))));
+    __m256d cx=_mm256_fmadd_pd(q[0],ox,_mm256_mul_pd(two,_mm256_fmadd_pd(q[1],oy,_mm256_fmadd_pd(q[2],oz,q[3]))));
+    __m256d cy=_mm256_fmadd_pd(q[4],oy,_mm256_mul_pd(two,_mm256_fmadd_pd(q[5],oz,q[6])));
+    __m256d cz=_mm256_fmadd_pd(q[7],oz,_mm256_mul_pd(two,q[8]));
+    *C=_mm256_fmadd_pd(ox,cx,_mm256_fmadd_pd(oy,cy,_mm256_fmadd_pd(oz,cz,q[9])));
+}
+
+// Keeps t for the lanes in valid that are closer than the current hit
+static inline void update4(struct object3D *obj, struct rayPacket *pk, int g, __m256d t, __m256d valid){
+    __m256d cur=_mm256_load_pd(pk->t+4*g);
+    valid=_mm256_and_pd(valid,_mm256_cmp_pd(t,cur,_CMP_LT_OQ));
+    int m=_mm256_movemask_pd(valid);
+    if(!m) return;
+    _mm256_store_pd(pk->t+4*g,_mm256_blendv_pd(cur,t,valid));
+    for(int k=0;k<4;++k)
+	if(m&(1<<k)) pk->obj[4*g+k]=obj;
+}
+
+static void plane4(struct object3D *obj, struct rayPacket *pk, int g, __m256d mask){
+    struct ray4 r;
+    toModel4(obj->Tinv,pk,g,&r);
+    __m256d zero=_mm256_setzero_pd();
+    __m256d one=_mm256_set1_pd(1.0);
+    __m256d mone=_mm256_set1_pd(-1.0);
+
+    //t=-(pz/dz), the plane is z=0 with x,y in [-1,1]
+    __m256d t=_mm256_sub_pd(zero,_mm256_div_pd(r.oz,r.dz));
+    __m256d x=_mm256_fmadd_pd(t,r.dx,r.ox);
+    __m256d y=_mm256_fmadd_pd(t,r.dy,r.oy);
+    __m256d valid=_mm256_and_pd(mask,_mm256_cmp_pd(r.dz,zero,_CMP_NEQ_OQ));
+    valid=_mm256_and_pd(valid,_mm256_cmp_pd(t,zero,_CMP_GT_OQ));
+    valid=_mm256_and_pd(valid,_mm256_cmp_pd(x,mone,_CMP_GE_OQ));
+    valid=_mm256_and_pd(valid,_mm256_cmp_pd(x,one,_CMP_LE_OQ));
+    valid=_mm256_and_pd(valid,_mm256_cmp_pd(y,mone,_CMP_GE_OQ));
+    valid=_mm256_and_pd(valid,_mm256_cmp_pd(y,one,_CMP_LE_OQ));
+    update4(obj,pk,g,t,valid);
+}
+
+static void sphere4(struct object3D *obj, struct rayPacket *pk, int g, __m256d mask){
+    __m256d zero=_mm256_setzero_pd();
+    __m256d A,B,C;
+
+    //world-space quadric of the sphere (see invertObject()), no transform
+    quadric4(obj->Q,pk,g,&A,&B,&C);
+    __m256d delta=_mm256_sub_pd(_mm256_mul_pd(B,B),_mm256_mul_pd(_mm256_set1_pd(4.0),_mm256_mul_pd(A,C)));
+
+    //smaller root if it is in front of the ray, the larger one otherwise
+    __m256d sq=_mm256_sqrt_pd(_mm256_max_pd(delta,zero));
+    __m256d half=_mm256_set1_pd(0.5);
+    __m256d t1=_mm256_mul_pd(_mm256_div_pd(_mm256_sub_pd(_mm256_sub_pd(zero,B),sq),A),half);
+    __m256d t2=_mm256_mul_pd(_mm256_div_pd(_mm256_add_pd(_mm256_sub_pd(zero,B),sq),A),half);
+    __m256d t=_mm256_blendv_pd(t2,t1,_mm256_cmp_pd(t1,zero,_CMP_GT_OQ));
+
+    __m256d valid=_mm256_and_pd(mask,_mm256_cmp_pd(A,zero,_CMP_GT_OQ));
+    valid=_mm256_and_pd(valid,_mm256_cmp_pd(delta,zero,_CMP_GE_OQ));
+    valid=_mm256_and_pd(valid,_mm256_cmp_pd(t,zero,_CMP_GT_OQ));
+    update4(obj,pk,g,t,valid);
+}
+
+static void box4(struct object3D *obj, struct rayPacket *pk, int g, __m256d mask){
+    struct ray4 r;
+    toModel4(obj->Tinv,pk,g,&r);
+    __m256d zero=_mm256_setzero_pd();
+    __m256d one=_mm256_set1_pd(1.0);
+    __m256d mone=_mm256_set1_pd(-1.0);
+    __m256d o[3]={r.ox,r.oy,r.oz};
+    __m256d d[3]={r.dx,r.dy,r.dz};
+
+    //slab test on the unit box, as in boxIntersect()
+    __m256d tnear=_mm256_set1_pd(-1e300);
+    __m256d tfar=_mm256_set1_pd(1e300);
+    __m256d valid=mask;
+    for(int k=0;k<3;++k){
+	__m256d par=_mm256_cmp_pd(d[k],zero,_CMP_EQ_OQ);
+	__m256d t1=_mm256_div_pd(_mm256_sub_pd(mone,o[k]),d[k]);
+	__m256d t2=_mm256_div_pd(_mm256_sub_pd(one,o[k]),d[k]);
+	__m256d tn=_mm256_min_pd(t1,t2);
+	__m256d tf=_mm256_max_pd(t1,t2);
+	//lanes parallel to the slab are unconstrained if inside it, missed otherwise
+	__m256d inside=_mm256_and_pd(_mm256_cmp_pd(o[k],mone,_CMP_GE_OQ),_mm256_cmp_pd(o[k],one,_CMP_LE_OQ));
+	valid=_mm256_andnot_pd(_mm256_andnot_pd(inside,par),valid);
+	tnear=_mm256_blendv_pd(_mm256_max_pd(tnear,tn),tnear,par);
+	tfar=_mm256_blendv_pd(_mm256_min_pd(tfar,tf),tfar,par);
+    }
+    valid=_mm256_and_pd(valid,_mm256_cmp_pd(tnear,tfar,_CMP_LE_OQ));
+    valid=_mm256_and_pd(valid,_mm256_cmp_pd(tfar,zero,_CMP_GT_OQ));
+    __m256d t=_mm256_blendv_pd(tfar,tnear,_mm256_cmp_pd(tnear,zero,_CMP_GT_OQ));
+    update4(obj,pk,g,t,valid);
+}
+
+#endif
+
+void packetFirstHit(struct bvh *tree, struct rayPacket *pk){
+    int groups=pk->n/4;
+    alignas(32) double ix[MAX_PACKET],iy[MAX_PACKET],iz[MAX_PACKET];
+
+    for(int k=0;k<pk->n;++k){
+	pk->t[k]=1e300;
+	pk->obj[k]=NULL;
+	ix[k]=1.0/pk->dx[k];
+	iy[k]=1.0/pk->dy[k];
+	iz[k]=1.0/pk->dz[k];
+    }
+
+    for(int i=0;i<tree->numUnbounded;++i)
+	for(int k=0;k<pk->n;++k)
+	    laneIntersect(tree->unbounded[i],pk,k);
+
+    //near child first, using the direction of the first lane
+    int neg[3]={pk->dx[0]<0,pk->dy[0]<0,pk->dz[0]<0};
+    int stack[BVH_STACK];
+    int sp=0;
+    if(tree->numNodes>0) stack[sp++]=0;
+    while(sp>0){
+	struct bvhNode *node=&tree->nodes[stack[--sp]];
+	struct aabb *box=&node->box;
+
+	//lanes overlapping the node, one mask per group of four lanes
+#ifdef __AVX2__
+	__m256d mask[MAX_PACKET/4];
+#else
+	int mask[MAX_PACKET];
+#endif
+	int any=0;
+	for(int g=0;g<groups;++g){
+#ifdef __AVX2__
+	    __m256d t0=_mm256_setzero_pd();
+	    __m256d t1=_mm256_load_pd(pk->t+4*g);
+	    double *o[3]={pk->ox,pk->oy,pk->oz};
+	    double *inv[3]={ix,iy,iz};
+	    for(int k=0;k<3;++k){
+		__m256d ok=_mm256_load_pd(o[k]+4*g);
+		__m256d ik=_mm256_load_pd(inv[k]+4*g);
+		__m256d tn=_mm256_mul_pd(_mm256_sub_pd(_mm256_set1_pd(box->min[k]),ok),ik);
+		__m256d tf=_mm256_mul_pd(_mm256_sub_pd(_mm256_set1_pd(box->max[k]),ok),ik);
+		t0=_mm256_max_pd(t0,_mm256_min_pd(tn,tf));
+		t1=_mm256_min_pd(t1,_mm256_max_pd(tn,tf));
+	    }
+	    mask[g]=_mm256_cmp_pd(t0,t1,_CMP_LE_OQ);
+	    any|=_mm256_movemask_pd(mask[g]);
+#else
+	    for(int k=4*g;k<4*g+4;++k){
+		double o[3]={pk->ox[k],pk->oy[k],pk->oz[k]};
+		double inv[3]={ix[k],iy[k],iz[k]};
+		double t0=0,t1=pk->t[k];
+		for(int a=0;a<3;++a){
+		    double tn=(box->min[a]-o[a])*inv[a];
+		    double tf=(box->max[a]-o[a])*inv[a];
+		    if(tn>tf){ double tt=tn; tn=tf; tf=tt; }
+		    if(tn>t0) t0=tn;
+		    if(tf<t1) t1=tf;
+		}
+		mask[k]=(t0<=t1);
+		any|=mask[k];
+	    }
+#endif
+	}
+	if(!any) continue;
+
+	if(node->count==0){
+	    assert(sp+2<=BVH_STACK);
+	    if(neg[node->axis]){
+		stack[sp++]=node->first;
+		stack[sp++]=node->first+1;
+	    }else{
+		stack[sp++]=node->first+1;
+		stack[sp++]=node->first;
+	    }
+	    continue;
+	}
+
+	for(int i=node->first;i<node->first+node->count;++i){
+	    struct object3D *obj=tree->prims[i];
+#ifdef __AVX2__
+	    void (*kernel)(struct object3D *, struct rayPacket *, int, __m256d)=NULL;
+	    if(obj->type==OBJ_SPHERE) kernel=&sphere4;
+	    else if(obj->type==OBJ_PLANE) kernel=&plane4;
+	    else if(obj->type==OBJ_BOX) kernel=&box4;
+	    for(int g=0;g<groups;++g){
+		int m=_mm256_movemask_pd(mask[g]);
+		if(!m) continue;
+		if(kernel) kernel(obj,pk,g,mask[g]);
+		else
+		    for(int k=0;k<4;++k)
+			if(m&(1<<k)) laneIntersect(obj,pk,4*g+k);
+	    }
+#else
+	    for(int k=0;k<pk->n;++k)
+		if(mask[k]) laneIntersect(obj,pk,k);
+#endif
+	}
+    }
+
+    for(int k=0;k<pk->n;++k)
+	if(!pk->obj[k]) pk->t[k]=-1;
+}
@@ -0,0 +1,43 @@
+/*
+  packet.h - Ray packets for primary visibility.
+
+  Primary rays from the supersampling grid are very coherent: neighbouring
+  samples start at the camera and hit the same objects. A packet holds
+  4, 8 or 16 of them in structure-of-arrays form so the BVH is traversed
+  once for the whole packet, and planes, spheres and boxes are
+  intersected 4 lanes at a time with AVX2. Lanes that do not overlap a
+  node are masked out and skip the work for that node.
+
+  The packet only finds the closest object for each lane. Shading, and
+  every secondary ray it spawns, goes through the usual scalar path.
+
+  Without AVX2 (compiled without -mavx2) every primitive is intersected
+  one lane at a time through hitDistance().
+*/
+
+#include "bvh.h"
+
+#ifndef __packet_header
+#define __packet_header
+
+#define MAX_PACKET 16		// Largest supported packet, must be a multiple of 4
+
+/* A packet of rays in world coordinates, one lane per ray */
+struct rayPacket{
+	int n;				// Number of lanes in use, a multiple of 4
+	alignas(32) double ox[MAX_PACKET];	// Ray origins
+	alignas(32) double oy[MAX_PACKET];
+	alignas(32) double oz[MAX_PACKET];
+	alignas(32) double dx[MAX_PACKET];	// Ray directions
+	alignas(32) double dy[MAX_PACKET];
+	alignas(32) double dz[MAX_PACKET];
+	alignas(32) double t[MAX_PACKET];	// Lambda of the closest hit, -1 if none
+	struct object3D *obj[MAX_PACKET];	// Closest object, NULL if none
+};
+
+// Finds the closest object along every lane of the packet. On return
+// pk->obj[k] is the object hit by lane k (NULL if none) and pk->t[k]
+// its lambda.
+void packetFirstHit(struct bvh *tree, struct rayPacket *pk);
+
+#endif
@@ -0,0 +1,152 @@
+/*
+   raster.cpp - Rasterized primary visibility, see raster.h
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "raster.h"
+
+#define NEAR_DEPTH 1e-6		// Proxies with a corner closer than this cover the whole image
+#define PIXEL_GUARD 1e-3	// Slack on the projected rectangles, in pixels
+#define DEPTH_GUARD 1e-9	// Relative slack on the depth ranges
+
+// Nearest and second nearest proxies over a pixel, while rasterizing
+struct proxyDepth{
+    int prim;			// Proxy with the nearest start, -1 if none
+    double zmin, zmax;		// Its depth range
+    double z2;			// Nearest start of any other proxy
+};
+
+// Depth range and pixel rectangle covered by a box, returns 0 if it is
+// behind the camera
+static int projectBox(const struct aabb *box, struct view *cam, double du, double dv,
+			double *zmin, double *zmax, double *x0, double *x1, double *y0, double *y1){
+    int behind=0,front=0;
+    *zmin=1e300; *zmax=-1e300;
+    *x0=*y0=1e300; *x1=*y1=-1e300;
+    for(int c=0;c<8;++c){
+	struct point3D p={c&1?box->max[0]:box->min[0],c&2?box->max[1]:box->min[1],c&4?box->max[2]:box->min[2],1};
+	matVecMult(cam->W2C,&p);
+	//ray direction is (x,y,f) in camera space, so depth=z/f is lambda along it
+	double z=p.pz/cam->f;
+	if(z<*zmin) *zmin=z;
+	if(z>*zmax) *zmax=z;
+	if(z<=NEAR_DEPTH){
+	    behind++;
+	    continue;
+	}
+	front++;
+	double x=(p.px/z-cam->wl)/du;
+	double y=(p.py/z-cam->wt)/dv;
+	if(x<*x0) *x0=x;
+	if(x>*x1) *x1=x;
+	if(y<*y0) *y0=y;
+	if(y>*y1) *y1=y;
+    }
+    if(!front) return(0);
+    if(behind){
+	//the box reaches the eye, any ray may go through it
+	*zmin=0;
+	*x0=*y0=-1e300;
+	*x1=*y1=1e300;
+    }
+    return(1);
+}
+
+// First and last pixel whose samples, at most margin outside it, can fall
+// in [a,b]
+static inline void pixelSpan(double a, double b, double margin, int size, int *first, int *last){
+    a=a-1-margin-PIXEL_GUARD;
+    b=b+margin+PIXEL_GUARD;
+    *first=a<0?0:(a>=size?size:(int)ceil(a));
+    *last=b<0?-1:(b>=size?size-1:(int)floor(b));
+}
+
+struct raster *newRaster(struct bvh *tree, struct view *cam, int sx, int sy, double du, double dv,
+			double margin){
+    struct raster *r=(struct raster *)calloc(1,sizeof(struct raster));
+    struct proxyDepth *buf=(struct proxyDepth *)calloc(sx*sy,sizeof(struct proxyDepth));
+    if(r) r->cell=(int *)calloc(sx*sy,sizeof(int));
+    if(!r || !buf || !r->cell){
+	fprintf(stderr,"Unable to allocate the raster, out of memory!\n");
+	free(buf);
+	deleteRaster(r);
+	return(NULL);
+    }
+    r->sx=sx;
+    r->sy=sy;
+    r->tree=tree;
+    for(int c=0;c<sx*sy;++c){
+	buf[c].prim=-1;
+	buf[c].zmin=buf[c].z2=1e300;
+    }
+
+    for(int i=0;i<tree->numPrims;++i){
+	struct aabb box;
+	double zmin,zmax,x0,x1,y0,y1;
+	int i0,i1,j0,j1;
+	objectBounds(tree->prims[i],&box);
+	if(!projectBox(&box,cam,du,dv,&zmin,&zmax,&x0,&x1,&y0,&y1)) continue;
+	pixelSpan(x0,x1,margin,sx,&i0,&i1);
+	pixelSpan(y0,y1,margin,sy,&j0,&j1);
+	for(int y=j0;y<=j1;++y)
+	    for(int x=i0;x<=i1;++x){
+		struct proxyDepth *c=&buf[y*sx+x];
+		if(zmin<c->zmin){
+		    c->z2=c->zmin;
+		    c->prim=i;
+		    c->zmin=zmin;
+		    c->zmax=zmax;
+		}
+		else if(zmin<c->z2) c->z2=zmin;
+	    }
+    }
+
+    for(int c=0;c<sx*sy;++c){
+	if(buf[c].prim<0){
+	    r->cell[c]=RASTER_EMPTY;
+	    r->numEmpty++;
+	}
+	else if(buf[c].zmax*(1+DEPTH_GUARD)<buf[c].z2*(1-DEPTH_GUARD)){
+	    r->cell[c]=buf[c].prim;
+	    r->numFront++;
+	}
+	else r->cell[c]=RASTER_AMBIGUOUS;
+    }
+    free(buf);
+    return(r);
+}
+
+void deleteRaster(struct raster *r){
+    if(!r) return;
+    free(r->cell);
+    free(r);
+}
+
+int rasterFirstHit(const struct raster *r, int i, int j, const struct ray3D *ray, double *lambda,
+			struct object3D **obj){
+    int cell=r->cell[j*r->sx+i];
+    if(cell==RASTER_AMBIGUOUS) return(0);
+
+    //the candidate first, it is the closest unless an unbounded object is closer
+    double best=1e300;
+    struct object3D *hit=NULL;
+    if(cell>=0){
+	best=bvhPrimHit(r->tree,cell,ray);
+	if(best<=0) return(0);
+	hit=r->tree->prims[cell];
+    }
+    for(int k=0;k<r->tree->numUnbounded;++k){
+	struct object3D *cur=r->tree->unbounded[k];
+	double t=hitDistance(cur,ray);
+	//same tie break as the traversal
+	if(t>0 && (t<best || (t==best && cur<hit))){
+	    best=t;
+	    hit=cur;
+	}
+    }
+    *lambda=hit?best:-1;
+    *obj=hit;
+    return(1);
+}
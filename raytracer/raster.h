@@ -0,0 +1,61 @@
+/*
+  raster.h - Rasterized primary visibility.
+
+  Every primary ray starts at the camera, so the object it hits first can
+  mostly be found without traversing the BVH: before the render, the
+  world-space bounds of every primitive in the BVH are projected with the
+  camera of setupView() and scan converted into a buffer with one cell
+  per pixel. A cell keeps the proxy (bounding box) with the nearest depth
+  over the pixel, the range of depths it spans, and the nearest depth of
+  any other proxy over the pixel. The rectangles are grown by the reach
+  of the samples outside their pixel (the reconstruction filter), so the
+  cell covers every primary ray of the pixel.
+
+  Depth is measured along the view direction, and it grows with lambda
+  along every primary ray. If the nearest proxy of a cell ends before any
+  other proxy starts, no other bounded primitive can be hit before it, so
+  a primary ray of the pixel only needs to be tested against that one
+  primitive and the unbounded objects. If it hits the primitive, that is
+  the closest hit; if it misses, the ray falls back to the traversal.
+  Cells no proxy covers only need the unbounded objects. Cells where the
+  nearest proxies overlap in depth are ambiguous and always use the
+  traversal.
+
+  The candidate is tested with the same kernel the BVH leaves use, so a
+  ray the raster resolves gets the hit (object and lambda) the traversal
+  would have found.
+*/
+
+#include "utils.h"
+#include "bvh.h"
+
+#ifndef __raster_header
+#define __raster_header
+
+#define RASTER_EMPTY -1		// No proxy covers the cell
+#define RASTER_AMBIGUOUS -2	// The nearest proxies overlap in depth
+
+struct raster{
+	int sx, sy;		// Size of the image
+	int *cell;		// sx*sy cells: index of the candidate in tree->prims, or RASTER_*
+	struct bvh *tree;
+	int numFront;		// Cells with a candidate
+	int numEmpty;		// Cells no proxy covers
+};
+
+// Rasterizes the bounds of the primitives of tree for an sx x sy image
+// seen by cam, with pixel spacing du, dv (as in renderJob). Samples of
+// a pixel may be up to margin pixels outside it. Returns NULL if out of
+// memory.
+struct raster *newRaster(struct bvh *tree, struct view *cam, int sx, int sy, double du, double dv,
+			double margin);
+void deleteRaster(struct raster *r);
+
+// Closest hit of a primary ray through pixel (i,j), if the raster can
+// tell without a traversal: returns 1 and sets lambda and obj (NULL, and
+// lambda -1, if nothing is hit). Returns 0 if the BVH has to be
+// traversed.
+int rasterFirstHit(const struct raster *r, int i, int j, const struct ray3D *ray, double *lambda,
+			struct object3D **obj);
+
+#endif
@@ -0,0 +1,255 @@
+/*
+   sampler.cpp - Pixel samplers, see sampler.h
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "sampler.h"
+
+static const char *names[SAMPLER_TYPES]={"grid","independent","stratified","sobol","bluenoise"};
+
+int samplerType(const char *name){
+    for(int t=0;t<SAMPLER_TYPES;++t)
+	if(strcmp(name,names[t])==0) return(t);
+    return(-1);
+}
+
+const char *samplerName(int type){
+    return(type>=0 && type<SAMPLER_TYPES?names[type]:"unknown");
+}
+
+static inline uint32_t reverseBits(uint32_t x){
+    x=(x<<16)|(x>>16);
+    x=((x&0x00ff00ff)<<8)|((x&0xff00ff00)>>8);
+    x=((x&0x0f0f0f0f)<<4)|((x&0xf0f0f0f0)>>4);
+    x=((x&0x33333333)<<2)|((x&0xcccccccc)>>2);
+    x=((x&0x55555555)<<1)|((x&0xaaaaaaaa)>>1);
+    return(x);
+}
+
+// Owen scrambling of the bits of x, most significant first: every bit is
+// flipped depending on the seed and the bits above it only
+static inline uint32_t nestedUniformScramble(uint32_t x, uint32_t seed){
+    x=reverseBits(x);
+    x+=seed;
+    x^=x*0x6c50b47cu;
+    x^=x*0xb82f1e52u;
+    x^=x*0xc7afe638u;
+    x^=x*0x8d22f6e6u;
+    return(reverseBits(x));
+}
+
+// Second dimension of the Sobol' sequence (the first is reverseBits)
+static inline uint32_t sobol2(uint32_t index){
+    uint32_t x=0;
+    for(uint32_t v=1u<<31;index;index>>=1,v^=v>>1)
+	if(index&1) x^=v;
+    return(x);
+}
+
+// Element i of a random permutation of 0..l-1 selected by p
+static uint32_t permute(uint32_t i, uint32_t l, uint32_t p){
+    uint32_t w=l-1;
+    w|=w>>1; w|=w>>2; w|=w>>4; w|=w>>8; w|=w>>16;
+    do{
+	i^=p; i*=0xe170893d;
+	i^=p>>16; i^=(i&w)>>4;
+	i^=p>>8; i*=0x0929eb3f;
+	i^=p>>23; i^=(i&w)>>1;
+	i*=1|p>>27; i*=0x6935fa69;
+	i^=(i&w)>>11; i*=0x74dcb303;
+	i^=(i&w)>>2; i*=0x9e501cc3;
+	i^=(i&w)>>2; i*=0xc860a3df;
+	i&=w; i^=i>>5;
+    }while(i>=l);
+    return((i+p)%l);
+}
+
+static inline double toUnit32(uint32_t x){
+    return(x*(1.0/4294967296.0));
+}
+
+static inline double toUnit64(uint64_t x){
+    return((x>>11)*(1.0/9007199254740992.0));
+}
+
+// Adds sign times the kernel centred at pixel p to energy (on the torus)
+static void splat(double *energy, const double *kernel, int p, double sign){
+    const int S=BLUE_NOISE_SIZE,M=S-1;
+    int px=p%S,py=p/S;
+    for(int y=0;y<S;++y)
+	for(int x=0;x<S;++x)
+	    energy[y*S+x]+=sign*kernel[((y-py)&M)*S+((x-px)&M)];
+}
+
+// Pixel with bits[p]==set and the highest (tightest cluster) or lowest
+// (largest void) energy
+static int extremum(const double *energy, const char *bits, char set, int highest){
+    int best=-1;
+    for(int p=0;p<BLUE_NOISE_SIZE*BLUE_NOISE_SIZE;++p){
+	if(bits[p]!=set) continue;
+	if(best<0 || (highest?energy[p]>energy[best]:energy[p]<energy[best])) best=p;
+    }
+    return(best);
+}
+
+// Void-and-cluster: ranks the pixels of the tile so that the first k of
+// them are spread as evenly as possible for every k, and returns the
+// ranks as values in [0,1)
+static int buildBlueNoise(float *noise, uint64_t seed){
+    const int S=BLUE_NOISE_SIZE,N=S*S;
+    double *kernel=(double *)calloc(N,sizeof(double));
+    double *energy=(double *)calloc(N,sizeof(double));
+    double *initEnergy=(double *)calloc(N,sizeof(double));
+    char *bits=(char *)calloc(N,sizeof(char));
+    char *init=(char *)calloc(N,sizeof(char));
+    int *rank=(int *)calloc(N,sizeof(int));
+    if(!kernel || !energy || !initEnergy || !bits || !init || !rank){
+	free(kernel); free(energy); free(initEnergy); free(bits); free(init); free(rank);
+	return(0);
+    }
+
+    //gaussian with sigma 1.5, wrapped around the tile
+    for(int y=0;y<S;++y)
+	for(int x=0;x<S;++x){
+	    int wx=x<S-x?x:S-x,wy=y<S-y?y:S-y;
+	    kernel[y*S+x]=exp(-(wx*wx+wy*wy)/(2*1.5*1.5));
+	}
+
+    //random initial pattern with a tenth of the pixels set, then move the
+    //tightest clusters to the largest voids until the pattern is stable
+    int ones=0;
+    for(int i=0;i<N/10;++i){
+	int p=(int)(mix64(seed^(uint64_t)i)%N);
+	if(bits[p]) continue;
+	bits[p]=1;
+	splat(energy,kernel,p,1);
+	ones++;
+    }
+    for(int iter=0;iter<N;++iter){
+	int c=extremum(energy,bits,1,1);
+	bits[c]=0;
+	splat(energy,kernel,c,-1);
+	int v=extremum(energy,bits,0,0);
+	bits[v]=1;
+	splat(energy,kernel,v,1);
+	if(v==c) break;
+    }
+    memcpy(init,bits,N);
+    memcpy(initEnergy,energy,N*sizeof(double));
+
+    //ranks below the initial pattern: remove its tightest clusters
+    for(int r=ones-1;r>=0;--r){
+	int c=extremum(energy,bits,1,1);
+	bits[c]=0;
+	splat(energy,kernel,c,-1);
+	rank[c]=r;
+    }
+    //up to half the pixels: fill the largest voids
+    memcpy(bits,init,N);
+    memcpy(energy,initEnergy,N*sizeof(double));
+    for(int r=ones;r<N/2;++r){
+	int v=extremum(energy,bits,0,0);
+	bits[v]=1;
+	splat(energy,kernel,v,1);
+	rank[v]=r;
+    }
+    //the rest: the unset pixels are the minority now, fill their tightest clusters
+    memset(energy,0,N*sizeof(double));
+    for(int p=0;p<N;++p)
+	if(!bits[p]) splat(energy,kernel,p,1);
+    for(int r=N/2;r<N;++r){
+	int c=extremum(energy,bits,0,1);
+	bits[c]=1;
+	splat(energy,kernel,c,-1);
+	rank[c]=r;
+    }
+
+    for(int p=0;p<N;++p) noise[p]=(rank[p]+.5f)/N;
+    free(kernel); free(energy); free(initEnergy); free(bits); free(init); free(rank);
+    return(1);
+}
+
+struct sampler *newSampler(int type, int spp, uint64_t seed){
+    struct sampler *s=(struct sampler *)calloc(1,sizeof(struct sampler));
+    if(!s){
+	fprintf(stderr,"Unable to allocate sampler, out of memory!\n");
+	return(NULL);
+    }
+    if(spp<1) spp=1;
+    s->type=type;
+    s->seed=mix64(seed);
+    if(type==SAMPLER_GRID){
+	//odd grid size, at least 3 so the samples reach both corners
+	int ns=(int)floor(sqrt((double)spp)+.5);
+	if(ns<3) ns=3;
+	if(!(ns&1)) ns++;
+	s->nx=s->ny=ns;
+	spp=ns*ns;
+    }else{
+	s->nx=(int)ceil(sqrt((double)spp));
+	s->ny=(spp+s->nx-1)/s->nx;
+    }
+    s->spp=spp;
+
+    if(type==SAMPLER_BLUENOISE){
+	s->blueNoise=(float *)calloc(BLUE_NOISE_SIZE*BLUE_NOISE_SIZE,sizeof(float));
+	if(!s->blueNoise || !buildBlueNoise(s->blueNoise,s->seed)){
+	    fprintf(stderr,"Unable to allocate blue noise tile, out of memory!\n");
+	    deleteSampler(s);
+	    return(NULL);
+	}
+    }
+    return(s);
+}
+
+void deleteSampler(struct sampler *s){
+    if(!s) return;
+    free(s->blueNoise);
+    free(s);
+}
+
+double sample1D(struct pixelSample *ps){
+    const struct sampler *s=ps->s;
+    unsigned int dim=ps->dim++;
+    unsigned int comp=dim&1;	// Coordinate within the pair of dimensions
+    uint64_t pair=(dim>>1)+1;
+
+    switch(s->type){
+	case SAMPLER_GRID:
+	    if(dim<2){
+		int k=comp?ps->index/s->nx:ps->index%s->nx;
+		return((double)k/(s->nx-1));
+	    }
+	    //independent values, from the key of the lattice point only
+	    return(toUnit64(mix64(ps->key^mix64(dim))));
+	case SAMPLER_STRATIFIED:{
+	    uint32_t cell=permute(ps->index%(s->nx*s->ny),s->nx*s->ny,(uint32_t)mix64(ps->key^pair));
+	    int k=comp?cell/s->nx:cell%s->nx;
+	    double jitter=toUnit64(mix64(ps->key^mix64(((uint64_t)ps->index<<32)|dim)));
+	    return((k+jitter)/(comp?s->ny:s->nx));
+	}
+	case SAMPLER_SOBOL:{
+	    //both coordinates of a pair use the same shuffled index
+	    uint32_t index=nestedUniformScramble(ps->index,(uint32_t)mix64(ps->key^pair));
+	    uint32_t x=comp?sobol2(index):reverseBits(index);
+	    x=nestedUniformScramble(x,(uint32_t)mix64(ps->key^mix64((uint64_t)dim<<32)));
+	    return(toUnit32(x));
+	}
+	case SAMPLER_BLUENOISE:{
+	    //same points in every pixel, shifted by the blue noise tile
+	    //(offset differently for every dimension)
+	    const int M=BLUE_NOISE_SIZE-1;
+	    uint32_t index=nestedUniformScramble(ps->index,(uint32_t)mix64(s->seed^pair));
+	    uint32_t x=comp?sobol2(index):reverseBits(index);
+	    uint64_t h=mix64(s->seed^mix64((uint64_t)dim<<32));
+	    int tx=(ps->x+(int)(h&M))&M,ty=(ps->y+(int)((h>>16)&M))&M;
+	    double u=toUnit32(x)+s->blueNoise[ty*BLUE_NOISE_SIZE+tx];
+	    return(u<1?u:u-1);
+	}
+    }
+    //independent values
+    return(toUnit64(mix64(ps->key^mix64(((uint64_t)ps->index<<32)|dim))));
+}
@@ -0,0 +1,115 @@
+/*
+  sampler.h - Pixel samplers and stateless random numbers.
+
+  Every random number used to render a pixel (the position of each
+  sample in the pixel, the points shadow rays aim at, the lights picked
+  from the light tree) comes from a sampler. A value is a pure function
+  of the seed, the pixel, the sample index within the pixel and the
+  dimension, i.e. how many values that sample has used so far. There is
+  no generator state shared between pixels, so the image does not depend
+  on the number of threads or on the order tiles are rendered in.
+
+  Dimensions 0 and 1 are the position of the sample in the pixel, the
+  shader takes the rest in order. The samplers are:
+
+   SAMPLER_GRID         The original supersampling: a regular ns x ns
+                        grid spanning the pixel corner to corner, with
+                        independent values for the other dimensions.
+                        The grids of neighbouring pixels meet on their
+                        common edge, so the samples are the points of
+                        one lattice over the whole image, and a sample
+                        on an edge is the same sample (same ray, same
+                        random numbers) for both pixels.
+   SAMPLER_INDEPENDENT  Independent uniform values, hashed from a
+                        counter (no stratification at all).
+   SAMPLER_STRATIFIED   Jittered strata, nx x ny per pair of dimensions,
+                        with the strata shuffled differently for every
+                        pair so the pairs are not correlated.
+   SAMPLER_SOBOL        The 2D Sobol' (0,2)-sequence for every pair of
+                        dimensions ("padded"), Owen scrambled per pixel
+                        and with the sample order shuffled per pair.
+                        Best with a power of two samples per pixel.
+   SAMPLER_BLUENOISE    The same Sobol' points within the pixel, but
+                        all shifted (Cranley-Patterson rotation) by a
+                        value read from a blue noise tile. Neighbouring
+                        pixels get very different shifts, so the error
+                        left in the image is high frequency noise
+                        rather than clumps.
+
+  Hashing uses the splitmix64 finalizer, scrambling the Laine-Karras
+  nested uniform permutation (as in Burley, "Practical Hash-based Owen
+  Scrambling", 2020) and stratum shuffling Kensler's permutation
+  ("Correlated Multi-Jittered Sampling", 2013). The blue noise tile is
+  built at start up with Ulichney's void-and-cluster method.
+*/
+
+#include <stdint.h>
+
+#ifndef __sampler_header
+#define __sampler_header
+
+#define SAMPLER_GRID 0
+#define SAMPLER_INDEPENDENT 1
+#define SAMPLER_STRATIFIED 2
+#define SAMPLER_SOBOL 3
+#define SAMPLER_BLUENOISE 4
+#define SAMPLER_TYPES 5
+
+#define BLUE_NOISE_SIZE 64	// Width and height of the blue noise tile (a power of two)
+
+struct sampler{
+	int type;		// SAMPLER_*
+	int spp;		// Samples per pixel
+	int nx, ny;		// Grid size (grid) or strata per pair (stratified)
+	uint64_t seed;
+	float *blueNoise;	// BLUE_NOISE_SIZE^2 values in [0,1), for SAMPLER_BLUENOISE
+};
+
+/* One sample of one pixel, the dimension advances as values are drawn */
+struct pixelSample{
+	const struct sampler *s;
+	uint64_t key;		// Hash of the seed and the pixel (the lattice point for SAMPLER_GRID)
+	int x, y;		// Pixel
+	unsigned int index;	// Sample within the pixel
+	unsigned int dim;	// Next dimension
+};
+
+// Sampler of the given type with spp samples per pixel. The grid sampler
+// needs an odd square number of samples (9, 25, ...), spp is rounded to
+// the closest one. Returns NULL if out of memory.
+struct sampler *newSampler(int type, int spp, uint64_t seed);
+void deleteSampler(struct sampler *s);
+
+// SAMPLER_* with the given name ("grid", "sobol", ...), -1 if none
+int samplerType(const char *name);
+const char *samplerName(int type);
+
+static inline uint64_t mix64(uint64_t z)
+{
+ // splitmix64 finalizer, a bijective hash of 64 bits
+ z=(z^(z>>30))*0xbf58476d1ce4e5b9ULL;
+ z=(z^(z>>27))*0x94d049bb133111ebULL;
+ return z^(z>>31);
+}
+
+// Starts sample index of pixel (x,y), at dimension 0
+static inline void startSample(struct pixelSample *ps, const struct sampler *s, int x, int y, int index)
+{
+ ps->s=s;
+ if(s->type==SAMPLER_GRID){
+    //hash of the point of the image wide lattice, see SAMPLER_GRID
+    uint32_t gx=(uint32_t)x*(s->nx-1)+index%s->nx;
+    uint32_t gy=(uint32_t)y*(s->ny-1)+index/s->nx;
+    ps->key=mix64(s->seed^mix64(((uint64_t)gy<<32)|gx));
+ }
+ else ps->key=mix64(s->seed^mix64(((uint64_t)(uint32_t)y<<32)|(uint32_t)x));
+ ps->x=x;
+ ps->y=y;
+ ps->index=index;
+ ps->dim=0;
+}
+
+// Next value in [0,1) of the sample
+double sample1D(struct pixelSample *ps);
+
+#endif
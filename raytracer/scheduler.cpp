@@ -0,0 +1,158 @@
+/*
+   scheduler.cpp - Work-stealing tile scheduler, see scheduler.h
+*/
+
+#include "scheduler.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *names[TILE_ORDERS]={"rows","morton","hilbert"};
+
+int tileOrderType(const char *name){
+    for(int t=0;t<TILE_ORDERS;++t)
+	if(strcmp(name,names[t])==0) return(t);
+    return(-1);
+}
+
+const char *tileOrderName(int order){
+    return(order>=0 && order<TILE_ORDERS?names[order]:"unknown");
+}
+
+// Interleaves the bits of x and y, y in the odd bits
+static unsigned int mortonKey(unsigned int x, unsigned int y){
+    unsigned int key=0;
+    for(int b=0;b<16;++b)
+	key|=((x>>b)&1u)<<(2*b) | ((y>>b)&1u)<<(2*b+1);
+    return(key);
+}
+
+// Distance of (x,y) along the Hilbert curve over an n x n grid, n a power of two
+static unsigned int hilbertKey(unsigned int x, unsigned int y, unsigned int n){
+    unsigned int key=0;
+    for(unsigned int s=n/2;s>0;s/=2){
+	unsigned int rx=(x&s)>0,ry=(y&s)>0;
+	key+=s*s*((3*rx)^ry);
+	//rotate the quadrant so the curve enters and leaves it the right way
+	if(ry==0){
+	    if(rx==1){
+		x=s-1-x;
+		y=s-1-y;
+	    }
+	    unsigned int t=x; x=y; y=t;
+	}
+    }
+    return(key);
+}
+
+struct tileKey{
+    unsigned int key;
+    int x, y;
+};
+
+static int compareKeys(const void *a, const void *b){
+    unsigned int ka=((const struct tileKey *)a)->key,kb=((const struct tileKey *)b)->key;
+    return((ka>kb)-(ka<kb));
+}
+
+struct tileScheduler *newTileScheduler(int x0, int y0, int x1, int y1, int numViews, int tileSize,
+			int order, int numThreads){
+    if(numThreads<1) numThreads=1;
+    if(numViews<1) numViews=1;
+    if(tileSize<1) tileSize=TILE_SIZE;
+
+    struct tileScheduler *s=(struct tileScheduler *)calloc(1,sizeof(struct tileScheduler));
+    if(!s){
+	fprintf(stderr,"Unable to allocate tile scheduler, out of memory!\n");
+	return(NULL);
+    }
+    int tx=(x1-x0+tileSize-1)/tileSize;
+    int ty=(y1-y0+tileSize-1)/tileSize;
+    s->numTiles=tx*ty*numViews;
+    s->numThreads=numThreads;
+    s->tiles=(struct tile *)calloc(s->numTiles,sizeof(struct tile));
+    s->queues=(struct tileDeque *)calloc(numThreads,sizeof(struct tileDeque));
+    struct tileKey *keys=(struct tileKey *)calloc(tx*ty,sizeof(struct tileKey));
+    if(!s->tiles || !s->queues || !keys){
+	fprintf(stderr,"Unable to allocate tile scheduler, out of memory!\n");
+	free(keys);
+	deleteTileScheduler(s);
+	return(NULL);
+    }
+
+    //position of every tile along the curve
+    unsigned int n=1;
+    while(n<(unsigned int)tx || n<(unsigned int)ty) n*=2;
+    for(int j=0;j<ty;++j)
+	for(int i=0;i<tx;++i){
+	    struct tileKey *k=&keys[j*tx+i];
+	    k->x=i;
+	    k->y=j;
+	    if(order==TILE_ORDER_MORTON) k->key=mortonKey(i,j);
+	    else if(order==TILE_ORDER_HILBERT) k->key=hilbertKey(i,j,n);
+	    else k->key=j*tx+i;
+	}
+    qsort(keys,tx*ty,sizeof(struct tileKey),&compareKeys);
+
+    for(int v=0;v<numViews;++v)
+	for(int k=0;k<tx*ty;++k){
+	    int id=v*tx*ty+k;
+	    struct tile *t=&s->tiles[id];
+	    t->x0=x0+keys[k].x*tileSize;
+	    t->y0=y0+keys[k].y*tileSize;
+	    t->x1=(t->x0+tileSize<x1)?t->x0+tileSize:x1;
+	    t->y1=(t->y0+tileSize<y1)?t->y0+tileSize:y1;
+	    t->view=v;
+	    t->id=id;
+	}
+    free(keys);
+
+    //deal contiguous runs of tiles to each thread, so each thread starts
+    //on its own region of the image (of one or two views)
+    for(int k=0;k<numThreads;++k){
+	struct tileDeque *q=&s->queues[k];
+	int first=(int)((long)s->numTiles*k/numThreads);
+	int last=(int)((long)s->numTiles*(k+1)/numThreads);
+	q->items=(int *)calloc(last-first>0?last-first:1,sizeof(int));
+	for(int t=first;t<last;++t) q->items[t-first]=t;
+	q->head=0;
+	q->tail=last-first;
+	omp_init_lock(&q->lock);
+    }
+    return(s);
+}
+
+void deleteTileScheduler(struct tileScheduler *s){
+    if(!s) return;
+    if(s->queues){
+	for(int k=0;k<s->numThreads;++k){
+	    if(!s->queues[k].items) continue;
+	    omp_destroy_lock(&s->queues[k].lock);
+	    free(s->queues[k].items);
+	}
+	free(s->queues);
+    }
+    free(s->tiles);
+    free(s);
+}
+
+struct tile *nextTile(struct tileScheduler *s, int thread){
+    int t=-1;
+    struct tileDeque *q=&s->queues[thread];
+
+    //own work first, from the front
+    omp_set_lock(&q->lock);
+    if(q->head<q->tail) t=q->items[q->head++];
+    omp_unset_lock(&q->lock);
+    if(t>=0) return(&s->tiles[t]);
+
+    //steal from the back of the other deques
+    for(int k=1;k<s->numThreads && t<0;++k){
+	struct tileDeque *v=&s->queues[(thread+k)%s->numThreads];
+	omp_set_lock(&v->lock);
+	if(v->head<v->tail) t=v->items[--v->tail];
+	omp_unset_lock(&v->lock);
+    }
+    if(t>=0) return(&s->tiles[t]);
+    return(NULL);
+}
@@ -0,0 +1,75 @@
+/*
+  scheduler.h - Tile scheduler for the multithreaded renderer.
+
+  The image is split into square tiles. Each thread owns a deque of tiles
+  and takes work from the front of its own deque. A thread whose deque
+  runs dry steals from the back of another thread's deque, so threads
+  that get cheap tiles (background, flat regions) help out the ones that
+  got expensive ones (glass, mirrors) instead of sitting idle.
+
+  Deques are protected by an OpenMP lock. Tiles are coarse (a few
+  thousand rays each) so contention on the locks is negligible.
+
+  Tiles are dealt out along a space-filling curve (Hilbert by default),
+  so the run of tiles each thread starts with, and the tiles it steals
+  from the back of another run, are compact blocks of the image rather
+  than strips of rows. Neighbouring tiles see the same objects, BVH
+  nodes and texels, and those stay in the caches between tiles.
+
+  When several views of the scene are rendered in one run, the tiles of
+  all of them go into the same deques, so threads that finish one view
+  carry on with the others instead of waiting for the slowest tile.
+*/
+
+#include <omp.h>
+
+#ifndef __scheduler_header
+#define __scheduler_header
+
+#define TILE_SIZE 16		// Tile width and height in pixels
+
+// Order the tiles are dealt out in
+#define TILE_ORDER_ROWS 0	// Row by row
+#define TILE_ORDER_MORTON 1	// Z-order curve
+#define TILE_ORDER_HILBERT 2	// Hilbert curve
+#define TILE_ORDERS 3
+
+/* A rectangular block of pixels [x0,x1) x [y0,y1) of one view */
+struct tile{
+	int x0, y0;
+	int x1, y1;
+	int view;		// Image the tile belongs to
+	int id;			// Position in the order the tiles are dealt out
+};
+
+/* Double ended queue of tile indices owned by one thread */
+struct tileDeque{
+	int *items;
+	int head;		// Owner pops here
+	int tail;		// Thieves steal here (one past the last item)
+	omp_lock_t lock;
+};
+
+struct tileScheduler{
+	struct tile *tiles;
+	int numTiles;
+	struct tileDeque *queues;
+	int numThreads;
+};
+
+// Splits the region [x0,x1) x [y0,y1) of numViews images into tiles
+// (starting at its top left corner) and deals them out to numThreads
+// deques in the given TILE_ORDER_*, one view after the other.
+struct tileScheduler *newTileScheduler(int x0, int y0, int x1, int y1, int numViews, int tileSize,
+			int order, int numThreads);
+
+// TILE_ORDER_* with the given name ("rows", "morton", "hilbert"), -1 if none
+int tileOrderType(const char *name);
+const char *tileOrderName(int order);
+void deleteTileScheduler(struct tileScheduler *s);
+
+// Returns the next tile for the given thread, stealing from other threads
+// once its own deque is empty. Returns NULL when all tiles are done.
+struct tile *nextTile(struct tileScheduler *s, int thread);
+
+#endif
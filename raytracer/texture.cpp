@@ -0,0 +1,251 @@
+/*
+   texture.cpp - Compact textures with a mip pyramid, see texture.h
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include "texture.h"
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+static const char *names[TEX_FILTERS]={"bilinear","trilinear"};
+
+int texFilterType(const char *name){
+    for(int t=0;t<TEX_FILTERS;++t)
+	if(strcmp(name,names[t])==0) return(t);
+    return(-1);
+}
+
+const char *texFilterName(int type){
+    return(type>=0 && type<TEX_FILTERS?names[type]:"unknown");
+}
+
+// Texel at (i,j) of a level, clamped to its edges
+static inline unsigned int texelAt(const struct texLevel *l, int i, int j){
+    if(i>=l->sx) i=l->sx-1;
+    if(j>=l->sy) j=l->sy-1;
+    return(l->texels[texelIndex(l,i,j)]);
+}
+
+// Rounded mean of four texels, channel by channel
+static inline unsigned int texelMean(unsigned int a, unsigned int b, unsigned int c, unsigned int d){
+    unsigned int m=0;
+    for(int s=0;s<24;s+=8)
+	m|=((((a>>s)&255)+((b>>s)&255)+((c>>s)&255)+((d>>s)&255)+2)>>2)<<s;
+    return(m);
+}
+
+struct texture *newTexture(const unsigned char *rgb, int sx, int sy){
+    struct texture *tex=(struct texture *)calloc(1,sizeof(struct texture));
+    if(!tex){
+	fprintf(stderr,"Unable to allocate texture, out of memory!\n");
+	return(NULL);
+    }
+    tex->sx=sx;
+    tex->sy=sy;
+    for(int k=0;k<TEX_MAX_LEVELS;++k){
+	struct texLevel *l=&tex->level[k];
+	//odd sizes round up, the last texel then averages the edge with itself
+	l->sx=k?(l[-1].sx+1)>>1:sx;
+	l->sy=k?(l[-1].sy+1)>>1:sy;
+	l->blocksX=(l->sx+TEX_BLOCK-1)>>TEX_BLOCK_SHIFT;
+	l->offset=(1-ldexp(1,-k))/2;
+	int size=(l->blocksX*((l->sy+TEX_BLOCK-1)>>TEX_BLOCK_SHIFT))<<(2*TEX_BLOCK_SHIFT);
+	l->texels=(unsigned int *)calloc(size,sizeof(unsigned int));
+	if(!l->texels){
+	    fprintf(stderr,"Unable to allocate texture, out of memory!\n");
+	    deleteTexture(tex);
+	    return(NULL);
+	}
+	tex->bytes+=size*sizeof(unsigned int);
+	tex->levels=k+1;
+
+	for(int j=0;j<l->sy;++j)
+	    for(int i=0;i<l->sx;++i){
+		unsigned int t;
+		if(k==0){
+		    const unsigned char *p=&rgb[3*(j*sx+i)];
+		    t=p[0]|(p[1]<<8)|(p[2]<<16);
+		}
+		else t=texelMean(texelAt(&l[-1],2*i,2*j),texelAt(&l[-1],2*i+1,2*j),
+				texelAt(&l[-1],2*i,2*j+1),texelAt(&l[-1],2*i+1,2*j+1));
+		l->texels[texelIndex(l,i,j)]=t;
+	    }
+	if(l->sx==1 && l->sy==1) break;
+    }
+    return(tex);
+}
+
+void deleteTexture(struct texture *tex){
+    if(!tex) return;
+    for(int k=0;k<tex->levels;++k) free(tex->level[k].texels);
+    free(tex);
+}
+
+// Next number in the header of a .ppm file, skipping white space and
+// comments, -1 if there is none. Reads the one white space after it.
+static int headerValue(FILE *f){
+    int c=fgetc(f);
+    while(c!=EOF && (isspace(c) || c=='#')){
+	if(c=='#')
+	    while(c!=EOF && c!='\n') c=fgetc(f);
+	c=fgetc(f);
+    }
+    if(c==EOF || !isdigit(c)) return(-1);
+    int v=0;
+    while(c!=EOF && isdigit(c)){
+	v=10*v+c-'0';
+	c=fgetc(f);
+    }
+    return(v);
+}
+
+struct texture *readTexture(const char *filename){
+    FILE *f=fopen(filename,"rb");
+    if(!f){
+	fprintf(stderr,"Unable to open file %s for reading, please check name and path\n",filename);
+	return(NULL);
+    }
+    char magic[3]={0,0,0};
+    int sx=-1,sy=-1,maxval=-1;
+    if(fread(magic,1,2,f)==2 && strcmp(magic,"P6")==0){
+	sx=headerValue(f);
+	sy=headerValue(f);
+	maxval=headerValue(f);
+    }
+    if(sx<=0 || sy<=0 || maxval<=0 || maxval>255){
+	fprintf(stderr,"Wrong file format, %s is not an 8 bit binary .ppm file\n",filename);
+	fclose(f);
+	return(NULL);
+    }
+
+    //the bytes of the file go straight into the texture, never as doubles
+    unsigned char *rgb=(unsigned char *)malloc((size_t)sx*sy*3);
+    if(!rgb){
+	fprintf(stderr,"Out of memory allocating space for image\n");
+	fclose(f);
+	return(NULL);
+    }
+    if(fread(rgb,(size_t)sx*sy*3,1,f)!=1){
+	fprintf(stderr,"Texture %s is truncated\n",filename);
+	free(rgb);
+	fclose(f);
+	return(NULL);
+    }
+    fclose(f);
+    struct texture *tex=newTexture(rgb,sx,sy);
+    free(rgb);
+    if(tex) fprintf(stderr,"Texture %s: %d x %d, %d mip levels, %.1f MB\n",filename,sx,sy,tex->levels,
+			tex->bytes/1048576.0);
+    return(tex);
+}
+
+// Offsets of the corners of the bilinear fetch of level l at (u,v) in its
+// texels (columns c0, c1 and rows r0, r1), and the weights of the second
+// column and row
+static inline void texelCorners(const struct texLevel *l, double u, double v, int *c0, int *c1,
+				int *r0, int *r1, double *fu, double *fv){
+    double x=u*l->sx-l->offset;
+    double y=v*l->sy-l->offset;
+    double fx=floor(x),fy=floor(y);
+    *fu=x-fx;
+    *fv=y-fy;
+    int i=(int)fx,j=(int)fy;
+    int i0=i<0?0:(i<l->sx?i:l->sx-1);
+    int i1=i+1<0?0:(i+1<l->sx?i+1:l->sx-1);
+    int j0=j<0?0:(j<l->sy?j:l->sy-1);
+    int j1=j+1<0?0:(j+1<l->sy?j+1:l->sy-1);
+    *c0=texelColumn(i0);
+    *c1=texelColumn(i1);
+    *r0=texelRow(l,j0);
+    *r1=texelRow(l,j1);
+}
+
+#ifdef __AVX2__
+
+// acc plus w times the bilinear fetch of level l at (u,v): R G B and the
+// unused byte, in 0..255. The four texels are converted in two registers,
+// one per row, and blended in single precision, which is plenty for 8 bit
+// texels.
+static inline __m128 bilinearAdd(const struct texLevel *l, double u, double v, double w, __m128 acc){
+    int c0,c1,r0,r1;
+    double fu,fv;
+    texelCorners(l,u,v,&c0,&c1,&r0,&r1,&fu,&fv);
+    const unsigned int *t=l->texels;
+    __m128i q=_mm_setr_epi32(t[r0+c0],t[r0+c1],t[r1+c0],t[r1+c1]);
+    __m256 top=_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(q));
+    __m256 bottom=_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_unpackhi_epi64(q,q)));
+    //down the columns, then across
+    __m256 col=_mm256_fmadd_ps(_mm256_set1_ps((float)fv),_mm256_sub_ps(bottom,top),top);
+    float a=(float)(1-fu),b=(float)fu;
+    col=_mm256_mul_ps(col,_mm256_setr_ps(a,a,a,a,b,b,b,b));
+    __m128 sum=_mm_add_ps(_mm256_castps256_ps128(col),_mm256_extractf128_ps(col,1));
+    return(_mm_fmadd_ps(_mm_set1_ps((float)w),sum,acc));
+}
+
+#else
+
+// Adds w times the bilinear fetch of level l at (u,v), in 0..255, to acc
+static inline void bilinearAdd(const struct texLevel *l, double u, double v, double w, double *acc){
+    int c0,c1,r0,r1;
+    double fu,fv;
+    texelCorners(l,u,v,&c0,&c1,&r0,&r1,&fu,&fv);
+    const unsigned int *t=l->texels;
+    unsigned int c[4]={t[r0+c0],t[r0+c1],t[r1+c0],t[r1+c1]};
+    double w0=w*(1-fv),w1=w*fv;
+    double cw[4]={w0*(1-fu),w0*fu,w1*(1-fu),w1*fu};
+    for(int k=0;k<4;++k){
+	acc[0]+=cw[k]*(c[k]&255);
+	acc[1]+=cw[k]*((c[k]>>8)&255);
+	acc[2]+=cw[k]*((c[k]>>16)&255);
+    }
+}
+
+#endif
+
+// log2(x) for x>0, exact at powers of 2 and linear in between (off by
+// less than .09), which is all the blend between levels needs. Reads the
+// exponent and the mantissa straight from the bits of x.
+static inline double fastLog2(double x){
+    unsigned long long b;
+    memcpy(&b,&x,sizeof(b));
+    int e=(int)((b>>52)&2047)-1023;
+    b=(b&((1ULL<<52)-1))|(1023ULL<<52);	// mantissa, in [1,2)
+    double m;
+    memcpy(&m,&b,sizeof(m));
+    return(e+m-1);
+}
+
+void texFetch(const struct texture *tex, double u, double v, double width, double *R, double *G, double *B){
+    //level of detail: log2 of the footprint's width in texels of level 0
+    int k=0;
+    double t=0;
+    if(width>0 && tex->levels>1){
+	double lod=fastLog2(width*(tex->sx>tex->sy?tex->sx:tex->sy));
+	if(lod>=tex->levels-1) k=tex->levels-1;
+	else if(lod>0){
+	    k=(int)lod;
+	    t=lod-k;
+	}
+    }
+
+#ifdef __AVX2__
+    double c[4];
+    __m128 acc=bilinearAdd(&tex->level[k],u,v,1-t,_mm_setzero_ps());
+    if(t>0) acc=bilinearAdd(&tex->level[k+1],u,v,t,acc);
+    _mm256_storeu_pd(c,_mm256_mul_pd(_mm256_cvtps_pd(acc),_mm256_set1_pd(1/255.0)));
+#else
+    double c[3]={0,0,0};
+    bilinearAdd(&tex->level[k],u,v,1-t,c);
+    if(t>0) bilinearAdd(&tex->level[k+1],u,v,t,c);
+    for(int i=0;i<3;++i) c[i]*=1/255.0;
+#endif
+    *R=c[0];
+    *G=c[1];
+    *B=c[2];
+}
@@ -0,0 +1,95 @@
+/*
+  texture.h - Compact textures with a mip pyramid.
+
+  readPPMimage() turns every texel into three doubles, 24 bytes for a 3
+  byte texel, and the texture lookups then walk rows of that array. A
+  large environment map alone spends most of the renderer's memory this
+  way, and the neighbours a bilinear fetch needs are a whole row (many
+  cache lines) apart.
+
+  A texture here keeps the 8 bit texels of the file, one 32 bit word per
+  texel (R in the low byte, the top byte unused) so a texel is a single
+  aligned load. The texels are stored in TEX_BLOCK x TEX_BLOCK blocks,
+  one after the other, and in Morton (Z) order within a block, so the
+  four texels of a bilinear fetch are almost always in the same 64 byte
+  block, and texels close in (u,v) are close in memory whatever the
+  direction the rays move across the texture.
+
+  The mip pyramid is built once, when the texture is read: every level
+  halves the size of the previous one (rounding up) with a 2x2 box
+  filter, down to a single texel. A fetch is given the width of the
+  pixel's footprint in texture coordinates and blends the bilinear
+  fetches of the two levels whose texel size brackets it (trilinear
+  filtering). Minified textures are then read from small levels, which
+  stay in cache, instead of aliasing over the full size one. A width of
+  0 is the plain bilinear fetch of the full size texture.
+
+  Level 0 is addressed like the original texMap(): texel i is at
+  u=i/sx, so the bilinear fetch of level 0 is the one the renderer has
+  always made. A texel of level k is the mean of 2^k x 2^k texels of
+  level 0, and is placed at their centre, so the levels line up (exactly
+  for sizes that are powers of 2). Fetches are clamped to the edges of
+  the texture.
+*/
+
+#ifndef __texture_header
+#define __texture_header
+
+#define TEX_FILTER_BILINEAR 0	// Full size texture only
+#define TEX_FILTER_TRILINEAR 1	// Mip levels by the width of the footprint
+#define TEX_FILTERS 2
+
+#define TEX_MAX_LEVELS 24
+#define TEX_BLOCK_SHIFT 2
+#define TEX_BLOCK (1<<TEX_BLOCK_SHIFT)	// Width and height of the blocks of texels
+
+struct texLevel{
+	int sx, sy;
+	int blocksX;		// Blocks along x
+	double offset;		// Of the texel centres, in texels, see above
+	unsigned int *texels;	// RGBA8, whole blocks
+};
+
+struct texture{
+	int sx, sy;		// Size of level 0
+	int levels;
+	long bytes;		// Memory used by the texels of all levels
+	struct texLevel level[TEX_MAX_LEVELS];
+};
+
+// Texture from sx x sy texels, 3 bytes (R,G,B) each, row by row from the
+// top. Builds the mip pyramid. Returns NULL if out of memory.
+struct texture *newTexture(const unsigned char *rgb, int sx, int sy);
+
+void deleteTexture(struct texture *tex);
+
+// Reads a binary (P6) .ppm file into a texture, NULL if it can not
+struct texture *readTexture(const char *filename);
+
+// TEX_FILTER_* with the given name ("bilinear" or "trilinear"), -1 if none
+int texFilterType(const char *name);
+const char *texFilterName(int type);
+
+// Colour at (u,v) in [0,1]x[0,1] of a footprint width wide, in texture
+// coordinates (0 for the bilinear fetch of level 0)
+void texFetch(const struct texture *tex, double u, double v, double width, double *R, double *G, double *B);
+
+// Position of texel (i,j) of a level in its texels: its block, then Morton
+// order within it (for blocks of 4 x 4). The column and the row give
+// separate terms of the sum, so neighbours share most of the work.
+static inline int texelColumn(int i)
+{
+ return(((i>>TEX_BLOCK_SHIFT)<<(2*TEX_BLOCK_SHIFT))|(i&1)|((i&2)<<1));
+}
+
+static inline int texelRow(const struct texLevel *l, int j)
+{
+ return((((j>>TEX_BLOCK_SHIFT)*l->blocksX)<<(2*TEX_BLOCK_SHIFT))|((j&1)<<1)|((j&2)<<2));
+}
+
+static inline int texelIndex(const struct texLevel *l, int i, int j)
+{
+ return(texelColumn(i)+texelRow(l,j));
+}
+
+#endif
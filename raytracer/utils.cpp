@@ -8,6 +8,7 @@
 */
 
 #include "utils.h"
+#include "texture.h"
 #include "cmath"
 #include "assert.h"
 
@@ -83,7 +84,10 @@ struct object3D *newPlane(double ra, double rd, double rs, double rg, double r,
   plane->alpha=alpha;
   plane->r_index=r_index;
   plane->shinyness=shiny;
+  plane->type=OBJ_PLANE;
   plane->intersect=&planeIntersect;
+  plane->hitDist=&planeHitDist;
+  plane->surface=&planeSurface;
   plane->texImg=NULL;
   memcpy(&plane->T[0][0],&eye4x4[0][0],16*sizeof(double));
   memcpy(&plane->Tinv[0][0],&eye4x4[0][0],16*sizeof(double));
@@ -91,7 +95,6 @@ struct object3D *newPlane(double ra, double rd, double rs, double rg, double r,
   plane->frontAndBack=1;
   plane->isLightSource=0;
   plane->isMirror=0;
-  plane->goingOut=0;
  }
  return(plane);
 }
@@ -125,7 +128,10 @@ struct object3D *newSphere(double ra, double rd, double rs, double rg, double r,
   sphere->alpha=alpha;
   sphere->r_index=r_index;
   sphere->shinyness=shiny;
+  sphere->type=OBJ_SPHERE;
   sphere->intersect=&sphereIntersect;
+  sphere->hitDist=&sphereHitDist;
+  sphere->surface=&sphereSurface;
   sphere->texImg=NULL;
   memcpy(&sphere->T[0][0],&eye4x4[0][0],16*sizeof(double));
   memcpy(&sphere->Tinv[0][0],&eye4x4[0][0],16*sizeof(double));
@@ -133,7 +139,6 @@ struct object3D *newSphere(double ra, double rd, double rs, double rg, double r,
   sphere->frontAndBack=0;
   sphere->isLightSource=0;
   sphere->isMirror=0;
-  sphere->goingOut=0;
  }
  return(sphere);
 }
@@ -158,7 +163,10 @@ struct object3D *newCone(double ra, double rd, double rs, double rg, double r, d
   cone->alpha=alpha;
   cone->r_index=r_index;
   cone->shinyness=shiny;
+  cone->type=OBJ_CONE;
   cone->intersect=&coneIntersect;
+  cone->hitDist=&coneHitDist;
+  cone->surface=&coneSurface;
   cone->texImg=NULL;
   memcpy(&cone->T[0][0],&eye4x4[0][0],16*sizeof(double));
   memcpy(&cone->Tinv[0][0],&eye4x4[0][0],16*sizeof(double));
@@ -166,7 +174,6 @@ struct object3D *newCone(double ra, double rd, double rs, double rg, double r, d
   cone->frontAndBack=1;
   cone->isLightSource=0;
   cone->isMirror=0;
-  cone->goingOut=0;
  }
  return(cone);
 }
@@ -191,7 +198,10 @@ struct object3D *newParaboloid(double ra, double rd, double rs, double rg, doubl
   paraboloid->alpha=alpha;
   paraboloid->r_index=r_index;
   paraboloid->shinyness=shiny;
+  paraboloid->type=OBJ_PARABOLOID;
   paraboloid->intersect=&paraboloidIntersect;
+  paraboloid->hitDist=&paraboloidHitDist;
+  paraboloid->surface=&paraboloidSurface;
   paraboloid->texImg=NULL;
   memcpy(&paraboloid->T[0][0],&eye4x4[0][0],16*sizeof(double));
   memcpy(&paraboloid->Tinv[0][0],&eye4x4[0][0],16*sizeof(double));
@@ -199,7 +209,6 @@ struct object3D *newParaboloid(double ra, double rd, double rs, double rg, doubl
   paraboloid->frontAndBack=1;
   paraboloid->isLightSource=0;
   paraboloid->isMirror=0;
-  paraboloid->goingOut=0;
 }
  return(paraboloid);
 }
@@ -227,7 +236,10 @@ struct object3D *newBox(double ra, double rd, double rs, double rg, double r, do
   box->alpha=alpha;
   box->r_index=r_index;
   box->shinyness=shiny;
+  box->type=OBJ_BOX;
   box->intersect=&boxIntersect;
+  box->hitDist=&boxHitDist;
+  box->surface=&boxSurface;
   box->texImg=NULL;
   memcpy(&box->T[0][0],&eye4x4[0][0],16*sizeof(double));
   memcpy(&box->Tinv[0][0],&eye4x4[0][0],16*sizeof(double));
@@ -235,7 +247,6 @@ struct object3D *newBox(double ra, double rd, double rs, double rg, double r, do
   box->frontAndBack=0;
   box->isLightSource=0;
   box->isMirror=0;
-  box->goingOut=0;
 }
  return(box);
 }
@@ -246,385 +257,120 @@ struct object3D *newBox(double ra, double rd, double rs, double rg, double r, do
 //      and canonical sphere with a given ray. This is the most fundamental component
 //      of the raytracer.
 ///////////////////////////////////////////////////////////////////////////////////////
-void planeIntersect(struct object3D *plane, struct ray3D *ray, double *lambda,
-			struct point3D *_p, struct point3D *_n, double *a, double *b)
+// Every primitive provides two functions. xHitDist(), inline in utils.h,
+// only finds lambda and is what the traversal and the shadow rays use.
+// xSurface() computes the hit point, normal, goingOut and texture
+// coordinates for a lambda returned by xHitDist(), and is called once for
+// the closest hit. The xIntersect() functions do both.
+
+void planeSurface(struct object3D *plane, const struct ray3D *ray, double lambda,
+			struct point3D *_p, struct point3D *_n, double *a, double *b, int *goingOut)
 {
-    //transform the ray into Model world
-    matRayMult(plane->Tinv,ray);
-
-    double x,y,t;
-    struct point3D *p,*d;
-    p=&(ray->p0);
-    d=&(ray->d);
-    *lambda=-1;
-    
-    if(d->pz==0){
-    	matRayMult(plane->T,ray);
-	return;
+    //assign vectors in the model world
+    struct ray3D mray;
+    modelRay(plane,ray,&mray);
+    mray.rayPos(&mray, lambda, _p);
+    _n->px=0;
+    _n->py=0;
+    _n->pz=-1;
+    _n->pw=0;
+    if(goingOut) *goingOut=0;
+
+    if( a && b && plane->texImg!=NULL){
+	*a = (_p->px+1.0)/2.0;
+	*b = (_p->py+1.0)/2.0;
     }
-
-    t = -(p->pz/d->pz);
-    if(t<0){
-	matRayMult(plane->T,ray);
-	return;
-    }
-
-    x = p->px+t*d->px;
-    y = p->py+t*d->py;
-
-    //check the boundaries
-    if(x>=-1 && x<=1 && y>=-1 && y<=1){
-	//assign vectors in the model world
-	*lambda=t;
-	ray->rayPos(ray, t, _p);
-	_n->px=0;
-	_n->py=0;
-	_n->pz=-1;
-	_n->pw=0;
-
-	if( a && b && plane->texImg!=NULL){
-	    *a = (_p->px+1.0)/2.0;
-	    *b = (_p->py+1.0)/2.0;
-	    //printf("%.3f %.3f   ",*a,*b);
-	}
-    }
-    //convert back the ray into the object world
-    matRayMult(plane->T,ray);
 }
 
-void sphereIntersect(struct object3D *sphere, struct ray3D *ray, double *lambda, struct point3D *_p,
-					struct point3D *_n, double *u, double *v)
+// Hit point in Model world
+static inline void quadricPoint(struct object3D *obj, const struct ray3D *ray, double lambda, struct point3D *_p)
 {
-    //transform the ray into Model world
-    matRayMult(sphere->Tinv,ray);
-
-    double A,B,C;
-    double px,py,pz,dx,dy,dz;
-    *lambda=-1;
-    px=ray->p0.px;
-    py=ray->p0.py;
-    pz=ray->p0.pz;
-    dx=ray->d.px;
-    dy=ray->d.py;
-    dz=ray->d.pz;
- 
-    A = dx*dx+dy*dy+dz*dz;
-    B = (px*dx+py*dy+pz*dz)*2;
-    C = px*px+py*py+pz*pz-1;
-    double delta = B*B-4*A*C,t;
-    if(A>0 && delta>=0){
-    	if(delta==0){
-	    //there is one root
-	    t = -B/(2*A);
-	}else{
-	    //2 roots
-	    //let t be the smaller root
-	    double t1,t2;
-	    delta = sqrt(delta);
-	    t1 = (-B-delta)/A;
-	    t2 = (-B+delta)/A;
-	    if(t1>0) t=t1/2;
-	    else t=t2/2;
-	}
-	if(t>0){
-	    //t is a positive (valid) root
-	    *lambda=t;
-	    ray->rayPos(ray, t, _p);
-	    _n->px=_p->px;
-	    _n->py=_p->py;
-	    _n->pz=_p->pz;
-	    _n->pw=0;
-
-	    //determine normal vector direction, i.e. towards the center or outwards
-	    if(dot(_n,&(ray->d))>0){
-		//the ray is shooting from inside the sphere to the world
-		multVector(-1.0,_n);
-		sphere->goingOut=1;
-	    }else
-		sphere->goingOut=0;
-
-	    //compute the texture (u,v) coordinates
-	    if(u && v && sphere->texImg != NULL && sphere->textureMap != NULL){
-		    //compute the radius
-		    double r = length(_p);
-		    *v = 1.0 - std::acos(_p->py/r)/PI;
-		    *u = 0.5 + std::atan2(_p->px,_p->pz)/(2.0*PI);
-	    }
-	}
-    }
-
-    //convert back the ray into the object world
-    matRayMult(sphere->T,ray);
-
+    ray->rayPos(ray, lambda, _p);
+    matVecMult(obj->Tinv,_p);
 }
 
-
-
-void coneIntersect(struct object3D *cone, struct ray3D *ray, double *lambda, struct point3D *_p,
-					struct point3D *_n, double *u, double *v)
+// Flips the model normal n towards the ray origin, goingOut is set to 1 if
+// the ray leaves the object
+static inline void faceForward(struct object3D *obj, const struct ray3D *ray, struct point3D *_n, int *goingOut)
 {
-    //transform the ray into Model world
-    matRayMult(cone->Tinv,ray);
-
-    double A,B,C;
-    double px,py,pz,dx,dy,dz;
-    *lambda=-1;
-    px=ray->p0.px;
-    py=ray->p0.py;
-    pz=ray->p0.pz;
-    dx=ray->d.px;
-    dy=ray->d.py;
-    dz=ray->d.pz;
- 
-    A = dx*dx-dy*dy+dz*dz;
-    B = (px*dx-py*dy+pz*dz)*2;
-    C = px*px-py*py+pz*pz;
-    double delta = B*B-4*A*C,t;
-    if(A!=0 && delta>=0){
-    	if(delta==0){
-	    //there is one root
-	    t = -B/(2*A);
-	}else{
-	    //2 roots
-	    //let t be the smaller root
-	    double t1,t2;
-	    delta = sqrt(delta);
-	    t1 = (-B-delta)/A;
-	    t2 = (-B+delta)/A;
-	    if(t1>0) t=t1/2;
-	    else t=t2/2;
-	}
-	if(t>0){
-	    //t is a positive (valid) root
-	    //now check the bound of y
-	    ray->rayPos(ray, t, _p);
-	    if(_p->py>=-1 && _p->py<=0){
-		    *lambda=t;
-		    _n->px=_p->px;
-		    _n->py=-_p->py;
-		    _n->pz=_p->pz;
-		    _n->pw=0;
-	
-		    if(dot(_n,&(ray->d))>0){
-			//the ray is shooting from inside the sphere to the world
-			multVector(-1.0,_n);
-			cone->goingOut=1;
-		    }else
-			cone->goingOut=0;
-
-		    //compute the texture (u,v) coordinates
-		    if( u && v && cone->texImg != NULL && cone->textureMap != NULL){
-			    //compute the radius
-			    double r = sqrt(_p->px*_p->px+_p->pz*_p->pz);
-			    *v = 1.0 + _p->py;
-			    *u = 0.5 + std::atan2(_p->px,_p->pz)/(2.0*PI);
-		    }
-	    }
-	}
-    }
-
-    //convert back the ray into the object world
-    matRayMult(cone->T,ray);
+    struct point3D md=ray->d;
+    md.pw=0;
+    matVecMult(obj->Tinv,&md);
+    if(dot(_n,&md)>0){
+	//the ray is shooting from inside the object to the world
+	multVector(-1.0,_n);
+	if(goingOut) *goingOut=1;
+    }else
+	if(goingOut) *goingOut=0;
 }
 
-
-
-
-void paraboloidIntersect(struct object3D *paraboloid, struct ray3D *ray, double *lambda, struct point3D *_p,
-					struct point3D *_n, double *u, double *v)
+void sphereSurface(struct object3D *sphere, const struct ray3D *ray, double lambda,
+			struct point3D *_p, struct point3D *_n, double *u, double *v, int *goingOut)
 {
-    //transform the ray into Model world
-    matRayMult(paraboloid->Tinv,ray);
-
-    double A,B,C;
-    double px,py,pz,dx,dy,dz;
-    *lambda=-1;
-    px=ray->p0.px;
-    py=ray->p0.py;
-    pz=ray->p0.pz;
-    dx=ray->d.px;
-    dy=ray->d.py;
-    dz=ray->d.pz;
- 
-    A = dx*dx+dz*dz;
-    B = (px*dx+pz*dz)*2+dy;
-    C = px*px+pz*pz+py;
-    double delta = B*B-4*A*C,t;
-    if(A!=0 && delta>=0){
-    	if(delta==0){
-	    //there is one root
-	    t = -B/(2*A);
-	}else{
-	    //2 roots
-	    //let t be the smaller root
-	    double t1,t2;
-	    delta = sqrt(delta);
-	    t1 = (-B-delta)/A;
-	    t2 = (-B+delta)/A;
-	    if(t1>0) t=t1/2;
-	    else t=t2/2;
-	}
-	if(t>0){
-	    //t is a positive (valid) root
-	    //now check the bound of y
-	    ray->rayPos(ray, t, _p);
-	    if(_p->py>=-1 && _p->py<=0){
-		    *lambda=t;
-		    _n->px=_p->px*2;
-		    _n->py=1.0;
-		    _n->pz=_p->pz*2;
-		    _n->pw=0;
-	
-		    if(dot(_n,&(ray->d))>0){
-			//the ray is shooting from inside the sphere to the world
-			multVector(-1.0,_n);
-			paraboloid->goingOut=1;
-		    }else
-			paraboloid->goingOut=0;
-
-		    //compute the texture (u,v) coordinates
-/*		    if(paraboloid->texImg != NULL && paraboloid->textureMap != NULL){
-			    //compute the radius
-			    double r = sqrt(_p->px*_p->px+_p->pz*_p->pz);
-			    *v = 1.0 + _p->py;
-			    *u = 0.5 + std::atan2(_p->px,_p->pz)/(2.0*PI);
-		    }
-*/
-	    }
-	}
+    quadricPoint(sphere,ray,lambda,_p);
+    _n->px=_p->px;
+    _n->py=_p->py;
+    _n->pz=_p->pz;
+    _n->pw=0;
+    faceForward(sphere,ray,_n,goingOut);
+
+    //compute the texture (u,v) coordinates
+    if(u && v && sphere->texImg != NULL && sphere->textureMap != NULL){
+	//compute the radius
+	double r = length(_p);
+	*v = 1.0 - std::acos(_p->py/r)/PI;
+	*u = 0.5 + std::atan2(_p->px,_p->pz)/(2.0*PI);
     }
-
-    //convert back the ray into the object world
-    matRayMult(paraboloid->T,ray);
 }
 
-
-
-
-void boxIntersect(struct object3D *box, struct ray3D *ray, double *lambda, struct point3D *_p,
-					struct point3D *_n, double *u, double *v)
+void coneSurface(struct object3D *cone, const struct ray3D *ray, double lambda,
+			struct point3D *_p, struct point3D *_n, double *u, double *v, int *goingOut)
 {
-    //transform the ray into Model world
-    matRayMult(box->Tinv,ray);
-
-    double px,py,pz,dx,dy,dz,txy,tzy,tzx;
-    *lambda=-1;
-    txy=-1;
-    tzy=-1;
-    tzx=-1;
-    px=ray->p0.px;
-    py=ray->p0.py;
-    pz=ray->p0.pz;
-    dx=ray->d.px;
-    dy=ray->d.py;
-    dz=ray->d.pz;
-    memset(_n,0,sizeof(struct point3D));
- 
-    //xy plane
-    //if no valid txy, txy<=0
-    if(dz!=0){
-	struct point3D p1,p2;
-	double t1,t2;
-	t1=(1-pz)/dz;
-	t2=(-1-pz)/dz; 
-	//note t2 < t1 always
-	if(t2<=0) txy=t1;
-	else{
-    	    ray->rayPos(ray,t2,&p2);
-	    if(p2.px<=1 && p2.px>=-1 &&
-		p2.py<=1 && p2.py>=-1)
-		    txy=t2;
-	    else
-		txy=t1;
-	}
-	if(txy==t1){
-	    if(t1>0){
-    		ray->rayPos(ray,t1,&p1);
-		if(p1.px>1 || p1.px<-1 ||
-		    p1.py>1 || p1.py<-1)
-			txy=-1;
-	    }
-	}
-    }
-    //zy plane
-    //if no valid tzy, tzy<=0
-    if(dx!=0){
-	struct point3D p1,p2;
-	double t1,t2;
-	t1=(1-px)/dx;
-	t2=(-1-px)/dx;
-	if(t2<0) tzy=t1;
-	else{
-	    ray->rayPos(ray,t2,&p2);
-	    if(p2.py<=1 && p2.py>=-1 &&
-		p2.pz<=1 && p2.pz>=-1)
-		    tzy=t2;
-	    else tzy=t1;
-
-	}
-	if(tzy==t1){
-	    if(t1>0){
-    		ray->rayPos(ray,t1,&p1);
-		if(p1.pz>1 || p1.pz<-1 ||
-		    p1.py>1 || p1.py<-1)
-			tzy=-1;
-	    }
-	}
-    }
-    //zx plane
-    //if no valid tzx, tzx<=0
-    if(dy!=0){
-	struct point3D p1,p2;
-	double t1,t2;
-	t1=(1-py)/dy;
-	t2=(-1-py)/dy; 
-	//note t2 < t1 always
-	if(t2<=0) tzx=t1;
-	else{
-    	    ray->rayPos(ray,t2,&p2);
-	    if(p2.px<=1 && p2.px>=-1 &&
-		p2.pz<=1 && p2.pz>=-1)
-		    tzx=t2;
-	    else
-		tzx=t1;
-	}
-	if(tzx==t1){
-	    if(t1>0){
-    		ray->rayPos(ray,t1,&p1);
-		if(p1.px>1 || p1.px<-1 ||
-		    p1.pz>1 || p1.pz<-1)
-			tzx=-1;
-	    }
-	}
-    }
-
-    double tmin=-1;
-    if(txy>0) tmin=txy;
-    else if(tzy>0) tmin=tzy;
-    else if(tzx>0) tmin=tzx;
-    else{
-	matRayMult(box->T,ray);
-	return;
+    quadricPoint(cone,ray,lambda,_p);
+    _n->px=_p->px;
+    _n->py=-_p->py;
+    _n->pz=_p->pz;
+    _n->pw=0;
+    faceForward(cone,ray,_n,goingOut);
+
+    //compute the texture (u,v) coordinates
+    if( u && v && cone->texImg != NULL && cone->textureMap != NULL){
+	*v = 1.0 + _p->py;
+	*u = 0.5 + std::atan2(_p->px,_p->pz)/(2.0*PI);
     }
+}
 
-    if(tzy>0 && tzy<tmin) tmin=tzy;
-    if(tzx>0 && tzx<tmin) tmin=tzx;
+void paraboloidSurface(struct object3D *paraboloid, const struct ray3D *ray, double lambda,
+			struct point3D *_p, struct point3D *_n, double *u, double *v, int *goingOut)
+{
+    quadricPoint(paraboloid,ray,lambda,_p);
+    _n->px=_p->px*2;
+    _n->py=1.0;
+    _n->pz=_p->pz*2;
+    _n->pw=0;
+    faceForward(paraboloid,ray,_n,goingOut);
+}
 
+void boxSurface(struct object3D *box, const struct ray3D *ray, double lambda,
+			struct point3D *_p, struct point3D *_n, double *u, double *v, int *goingOut)
+{
+    struct ray3D mray;
+    int axis=2;
+    modelRay(box,ray,&mray);
+    boxSlab(&mray,&axis);	//only for the face, lambda is given
 
-    //if reach here, we have a valid min root
-    assert(tmin>0);
-    *lambda=tmin;
-    ray->rayPos(ray,tmin,_p);
+    mray.rayPos(&mray,lambda,_p);
+    memset(_n,0,sizeof(struct point3D));
 
     //set normal vectors
-    if(tmin==txy){
+    if(axis==2){
 	if(_p->pz>0) _n->pz=1;
 	else _n->pz=-1;
 	if(u && v && box->texImg!=NULL){
 	    *u = _p->px/2+0.5;
 	    *v = _p->py/2+0.5;
 	}
-    }else if(tmin==tzy){
+    }else if(axis==0){
 	if(_p->px>0) _n->px=1;
 	else _n->px=-1;
 
@@ -633,7 +379,6 @@ void boxIntersect(struct object3D *box, struct ray3D *ray, double *lambda, struc
 	    *v = _p->py/2+0.5;
 	}
     }else{
-	assert(tmin==tzx);
 	if(_p->py>0) _n->py=1;
 	else _n->py=-1;
 
@@ -641,17 +386,49 @@ void boxIntersect(struct object3D *box, struct ray3D *ray, double *lambda, struc
 	    *u = _p->px/2+0.5;
 	    *v = _p->pz/2+0.5;
 	}
-}
+    }
 
-    if(dot(_n,&(ray->d))>0){
-	//the ray is shooting from inside the sphere to the world
+    if(dot(_n,&(mray.d))>0){
+	//the ray is shooting from inside the box to the world
 	multVector(-1.0,_n);
-	box->goingOut=1;
+	if(goingOut) *goingOut=1;
     }else
-	box->goingOut=0;
+	if(goingOut) *goingOut=0;
+}
+
+void planeIntersect(struct object3D *plane, const struct ray3D *ray, double *lambda,
+			struct point3D *_p, struct point3D *_n, double *a, double *b, int *goingOut)
+{
+    *lambda=planeHitDist(plane,ray);
+    if(*lambda>0) planeSurface(plane,ray,*lambda,_p,_n,a,b,goingOut);
+}
+
+void sphereIntersect(struct object3D *sphere, const struct ray3D *ray, double *lambda, struct point3D *_p,
+					struct point3D *_n, double *u, double *v, int *goingOut)
+{
+    *lambda=sphereHitDist(sphere,ray);
+    if(*lambda>0) sphereSurface(sphere,ray,*lambda,_p,_n,u,v,goingOut);
+}
+
+void coneIntersect(struct object3D *cone, const struct ray3D *ray, double *lambda, struct point3D *_p,
+					struct point3D *_n, double *u, double *v, int *goingOut)
+{
+    *lambda=coneHitDist(cone,ray);
+    if(*lambda>0) coneSurface(cone,ray,*lambda,_p,_n,u,v,goingOut);
+}
+
+void paraboloidIntersect(struct object3D *paraboloid, const struct ray3D *ray, double *lambda, struct point3D *_p,
+					struct point3D *_n, double *u, double *v, int *goingOut)
+{
+    *lambda=paraboloidHitDist(paraboloid,ray);
+    if(*lambda>0) paraboloidSurface(paraboloid,ray,*lambda,_p,_n,u,v,goingOut);
+}
 
-    //convert back the ray into the object world
-    matRayMult(box->T,ray);
+void boxIntersect(struct object3D *box, const struct ray3D *ray, double *lambda, struct point3D *_p,
+					struct point3D *_n, double *u, double *v, int *goingOut)
+{
+    *lambda=boxHitDist(box,ray);
+    if(*lambda>0) boxSurface(box,ray,*lambda,_p,_n,u,v,goingOut);
 }
 
 
@@ -663,12 +440,8 @@ void loadTexture(struct object3D *o, const char *filename)
  // specified object
  if (o!=NULL)
  {
-  if (o->texImg!=NULL)	// We have previously loaded a texture
-  {			// for this object, need to de-allocate it
-   if (o->texImg->rgbdata!=NULL) free(o->texImg->rgbdata);
-   free(o->texImg);
-  }
-  o->texImg=readPPMimage(filename);	// Allocate new texture
+  deleteTexture(o->texImg);	// In case we have previously loaded a texture
+  o->texImg=readTexture(filename);	// Allocate new texture, and its mip levels
  }
 }
 
@@ -678,44 +451,19 @@ void loadTexture(struct object3D *o, const char *filename)
  the normalized texture coordinates (u,v).
 
  u and v are texture coordinates in [0 1].
- img is a pointer to the image structure holding the texture for
-  a given object.
+ tex is a pointer to the texture of a given object.
+ width is the width of the pixel's footprint in texture coordinates,
+  0 for none.
 
  The colour is returned in R, G, B. Uses bi-linear interpolation
- to determine texture colour.
+ to determine texture colour, between two mip levels when a width is
+ given (see texture.h).
 */
-void texMap(struct image *img, double u, double v, double *R, double *G, double *B)
+void texMap(struct texture *tex, double u, double v, double width, double *R, double *G, double *B)
 {
     assert(u<=1 && v<=1 && u>=0 && v>=0);
-    if(!img || !(img->rgbdata)) return;
-    double* rgb = (double *)img->rgbdata;
-    double nx=img->sx;
-    double ny=img->sy;
-    double _u, _v, i, j;
-    double *c00, *c01, *c10, *c11;
-
-    i = floor(u*nx);
-    j = floor(v*ny);
-    _u = u*nx -i;
-    _v = v*ny -j;
-
-    c00 = (rgb+(int)i*3+(int)(j*nx)*3);
-    c10 = (rgb+(int)i*3+3+(int)(j*nx)*3);
-    //in case the last row
-    if(j==(ny-1)){
-	c01=c00;
-	c11=c10;
-    }else{
-    	c01 = (rgb+(int)i*3+(int)(j*nx)*3+(int)nx*3);
-       	c11 = (rgb+(int)i*3+3+(int)(j*nx)*3+(int)nx*3);
-    }
-
-    *R = (1-_u)*(1-_v)*(*c00) + _u*(1-_v)*(*c10)
-	+(1-_u)*_v*(*c01) + _u*_v*(*c11);;
-    *G = (1-_u)*(1-_v)*(*(c00+1)) + _u*(1-_v)*(*(c10+1))
-	+(1-_u)*_v*(*(c01+1)) + _u*_v*(*(c11+1));;
-    *B = (1-_u)*(1-_v)*(*(c00+2)) + _u*(1-_v)*(*(c10+2))
-	+(1-_u)*_v*(*(c01+2)) + _u*_v*(*(c11+2));;
+    if(!tex) return;
+    texFetch(tex,u,v,width,R,G,B);
 }
 
 void insertObject(struct object3D *o, struct object3D **list)
@@ -849,6 +597,57 @@ void invert(double *T, double *Tinv)
  free(V);
 }
 
+// Computes Tinv for an object, together with the data the intersection
+// code derives from it, so none of it is recomputed for every ray: the
+// normal matrix Tnorm and, for quadrics, the world-space surface Q.
+// Must be called once the object is in its final position.
+void invertObject(struct object3D *o)
+{
+ double Qm[4][4],M[4][4];
+ int i,j,k;
+
+ invert(&o->T[0][0],&o->Tinv[0][0]);
+ transpose(&o->Tinv[0][0],&o->Tnorm[0][0]);
+
+ // Texture coordinates per world unit, for the mip level of a footprint. The
+ // texture spans 2 model units across planes and the faces of boxes, and a
+ // turn around the quadrics, scaled by the mean scale of the object
+ double s=0;
+ for (i=0;i<3;i++)
+  s+=sqrt(o->T[0][i]*o->T[0][i]+o->T[1][i]*o->T[1][i]+o->T[2][i]*o->T[2][i])/3;
+ if (o->type==OBJ_SPHERE || o->type==OBJ_CONE || o->type==OBJ_PARABOLOID) s*=2*PI;
+ else s*=2;
+ o->texScale=s>0?1/s:0;
+
+ // Canonical quadrics in Model world, p^T*Qm*p=0 with p=(x,y,z,1)
+ memset(Qm,0,16*sizeof(double));
+ if (o->type==OBJ_SPHERE)
+ {
+  Qm[0][0]=1; Qm[1][1]=1; Qm[2][2]=1; Qm[3][3]=-1;	// x^2+y^2+z^2-1
+ }
+ else if (o->type==OBJ_CONE)
+ {
+  Qm[0][0]=1; Qm[1][1]=-1; Qm[2][2]=1;			// x^2-y^2+z^2
+ }
+ else if (o->type==OBJ_PARABOLOID)
+ {
+  Qm[0][0]=1; Qm[2][2]=1; Qm[1][3]=.5; Qm[3][1]=.5;	// x^2+z^2+y
+ }
+ else return;
+
+ // A world point P is on the surface if (Tinv*P)^T*Qm*(Tinv*P)=0, i.e.
+ // P^T*(Tinv^T*Qm*Tinv)*P=0
+ memset(M,0,16*sizeof(double));
+ for (i=0;i<4;i++)
+  for (j=0;j<4;j++)
+   for (k=0;k<4;k++)
+    M[i][j]+=Qm[i][k]*o->Tinv[k][j];
+ k=0;
+ for (i=0;i<4;i++)
+  for (j=i;j<4;j++)
+   o->Q[k++]=(o->Tinv[0][i]*M[0][j])+(o->Tinv[1][i]*M[1][j])+(o->Tinv[2][i]*M[2][j])+(o->Tinv[3][i]*M[3][j]);
+}
+
 void RotateX(struct object3D *o, double theta)
 {
  // Multiply the current object transformation matrix T in object o
@@ -965,9 +764,7 @@ struct view *setupView(struct point3D *e, struct point3D *g, struct point3D *up,
    f - focal length
  */
  struct view *c;
- struct point3D *u, *v;
-
- u=v=NULL;
+ struct point3D u, v;
 
  // Allocate space for the camera structure
  c=(struct view *)calloc(1,sizeof(struct view));
@@ -991,19 +788,19 @@ struct view *setupView(struct point3D *e, struct point3D *g, struct point3D *up,
  normalize(&c->w);
 
  // Set up the horizontal direction, which must be perpenticular to w and up
- u=cross(&c->w, up);
- normalize(u);
- c->u.px=u->px;
- c->u.py=u->py;
- c->u.pz=u->pz;
+ cross(&c->w, up, &u);
+ normalize(&u);
+ c->u.px=u.px;
+ c->u.py=u.py;
+ c->u.pz=u.pz;
  c->u.pw=0;
 
  // Set up the remaining direction, v=(u x w)  - Mind the signs
- v=cross(&c->u, &c->w);
- normalize(v);
- c->v.px=v->px;
- c->v.py=v->py;
- c->v.pz=v->pz;
+ cross(&c->u, &c->w, &v);
+ normalize(&v);
+ c->v.px=v.px;
+ c->v.py=v.py;
+ c->v.pz=v.pz;
  c->v.pw=0;
 
  // Copy focal length and window size parameters
@@ -1057,8 +854,6 @@ struct view *setupView(struct point3D *e, struct point3D *g, struct point3D *up,
  c->W2C[2][3]=-dot(&c->w,&c->e);
  c->W2C[3][3]=1;
 
- free(u);
- free(v);
  return(c);
 }
 
@@ -1237,11 +1032,7 @@ void cleanup(struct object3D *o_list)
  while(p!=NULL)
  {
   q=p->next;
-  if (p->texImg!=NULL)
-  {
-   if (p->texImg->rgbdata!=NULL) free(p->texImg->rgbdata);
-   free(p->texImg);
-  }
+  deleteTexture(p->texImg);
   if(p->children!=NULL){
     cleanup(p->children);
   }
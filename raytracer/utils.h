@@ -64,6 +64,7 @@ inline void matRayMult(double A[4][4], struct ray3D *ray){
 
 void transpose(double *T, double *Ttrans);
 void invert(double *T, double *Tinv);
+void invertObject(struct object3D *o);	// Sets Tinv, Tnorm and Q, call once the object is in place
 void RotateX(struct object3D *o, double theta);	// Rotate theta radians CCW around X axis
 void RotateY(struct object3D *o, double theta);	// Rotate theta radians CCW around Y axis
 void RotateZ(struct object3D *o, double theta);	// Rotate theta radians CCW around Z axis
@@ -88,7 +89,7 @@ inline void normalize(struct point3D *v)
  v->pz*=l;
 }
 
-inline double dot(struct point3D *u, struct point3D *v)
+inline double dot(const struct point3D *u, const struct point3D *v)
 {
  // Computes the dot product of 3D vectors u and v.
  // The function assumes the w components of both vectors
@@ -96,19 +97,15 @@ inline double dot(struct point3D *u, struct point3D *v)
  return((u->px*v->px)+(u->py*v->py)+(u->pz*v->pz));
 }
 
-inline struct point3D *cross(struct point3D *u, struct point3D *v)
+inline void cross(const struct point3D *u, const struct point3D *v, struct point3D *cp)
 {
- // Allocates and returns a vector with the cross product u x v.
- // The function assumes the w components of both vectors
- // are 1.
- struct point3D *cp;
- cp=(struct point3D *)calloc(1,sizeof(struct point3D));
-
+ // Computes the cross product u x v and leaves it in cp, which
+ // must not be u or v. The function assumes the w components of
+ // both vectors are 1.
  cp->px=(u->py*v->pz)-(v->py*u->pz);
  cp->py=(v->px*u->pz)-(u->px*v->pz);
  cp->pz=(u->px*v->py)-(v->px*u->py);
  cp->pw=1;
- return(cp);
 }
 
 inline void addVectors(struct point3D *a, struct point3D *b)
@@ -142,7 +139,7 @@ inline void multVector(double a, struct point3D *b){
  b->pz=b->pz*a;
 }
 
-inline double length(struct point3D *a)
+inline double length(const struct point3D *a)
 {
  // Compute and return the length of a vector
  return(sqrt((a->px*a->px)+(a->py*a->py)+(a->pz*a->pz)));
@@ -153,7 +150,7 @@ struct point3D *newPoint(double px, double py, double pz);
 struct pointLS *newPLS(struct object3D *p0);
 
 // Ray management inlines
-inline void rayPosition(struct ray3D *ray, double lambda, struct point3D *pos)
+inline void rayPosition(const struct ray3D *ray, double lambda, struct point3D *pos)
 {
  // Compute and return 3D position corresponding to a given lambda
  // for the ray.
@@ -163,25 +160,28 @@ inline void rayPosition(struct ray3D *ray, double lambda, struct point3D *pos)
  pos->pw=1;
 }
 
+inline void initRay(struct ray3D *ray, const struct point3D *p0, const struct point3D *d)
+{
+ // Initialize a ray (usually a local variable, the tracer does
+ // not allocate rays) to the values given by p0 and d. Note that
+ // this function DOES NOT normalize d to be a unit vector.
+ memcpy(&ray->p0,p0,sizeof(struct point3D));
+ memcpy(&ray->d,d,sizeof(struct point3D));
+ ray->rayPos=&rayPosition;
+ //add an offset on p0 to avoid errors caused by rounding etc.
+ ray->p0.px+=0.001*d->px;
+ ray->p0.py+=0.001*d->py;
+ ray->p0.pz+=0.001*d->pz;
+}
+
 inline struct ray3D *newRay(struct point3D *p0, struct point3D *d)
 {
- // Allocate a new ray structure and initialize it to the values
- // given by p0 and d. Note that this function DOES NOT normalize
- // d to be a unit vector.
+ // Allocate a new ray structure and initialize it with initRay().
+ // Meant for code outside the rendering loop.
 
  struct ray3D *ray=(struct ray3D *)calloc(1,sizeof(struct ray3D));
  if (!ray) fprintf(stderr,"Out of memory allocating ray structure!\n");
- else
- {
-  memcpy(&ray->p0,p0,sizeof(struct point3D));
-  memcpy(&ray->d,d,sizeof(struct point3D));
-  ray->rayPos=&rayPosition;
-  //add an offset on p0 to avoid errors caused by rounding etc.
-  ray->p0.px+=0.001*d->px;
-  ray->p0.py+=0.001*d->py;
-  ray->p0.pz+=0.001*d->pz;
-
- }
+ else initRay(ray,p0,d);
  return(ray);
 }
 
@@ -204,6 +204,22 @@ inline void copyPoint(struct point3D *src,struct point3D *dest){
     dest->pw=src->pw;
 }
 
+inline void quadricCoefs(const double Q[10], const struct ray3D *ray, double *A, double *B, double *C)
+{
+ // Coefficients of A*t^2 + B*t + C = 0 for the ray and the world-space
+ // quadric Q of an object (see invertObject()). The ray origin is a
+ // point and its direction a vector, whatever their w components hold.
+ double px=ray->p0.px, py=ray->p0.py, pz=ray->p0.pz;
+ double dx=ray->d.px, dy=ray->d.py, dz=ray->d.pz;
+ double qd0=Q[0]*dx+Q[1]*dy+Q[2]*dz;
+ double qd1=Q[1]*dx+Q[4]*dy+Q[5]*dz;
+ double qd2=Q[2]*dx+Q[5]*dy+Q[7]*dz;
+ double qd3=Q[3]*dx+Q[6]*dy+Q[8]*dz;
+ *A=dx*qd0+dy*qd1+dz*qd2;
+ *B=2*(px*qd0+py*qd1+pz*qd2+qd3);
+ *C=px*(Q[0]*px+2*(Q[1]*py+Q[2]*pz+Q[3]))+py*(Q[4]*py+2*(Q[5]*pz+Q[6]))+pz*(Q[7]*pz+2*Q[8])+Q[9];
+}
+
 // Functions to create new objects, one for each type of object implemented.
 // You'll need to add code for these functions in utils.c
 struct object3D *newPlane(double ra, double rd, double rs, double rg, double r, double g, double b, double alpha, double R_index, double shiny);
@@ -217,20 +233,200 @@ struct object3D *newBox(double ra, double rd, double rs, double rg, double r, do
 
 // Functions to compute intersections for objects.
 // You'll need to add code for these in utils.c
-void planeIntersect(struct object3D *plane, struct ray3D *r, double *lambda, struct point3D *p, struct point3D *n, double *a, double *b);
-void sphereIntersect(struct object3D *sphere, struct ray3D *r, double *lambda, struct point3D *p, struct point3D *n, double *a, double *b);
-void coneIntersect(struct object3D *cone, struct ray3D *ray, double *lambda, struct point3D *_p,
-					struct point3D *_n, double *u, double *v);
-void paraboloidIntersect(struct object3D *paraboloid, struct ray3D *ray, double *lambda, struct point3D *_p,
-					struct point3D *_n, double *u, double *v);
-void boxIntersect(struct object3D *box, struct ray3D *ray, double *lambda, struct point3D *_p,
-					struct point3D *_n, double *u, double *v);
+void planeIntersect(struct object3D *plane, const struct ray3D *r, double *lambda, struct point3D *p, struct point3D *n, double *a, double *b, int *goingOut);
+void sphereIntersect(struct object3D *sphere, const struct ray3D *r, double *lambda, struct point3D *p, struct point3D *n, double *a, double *b, int *goingOut);
+void coneIntersect(struct object3D *cone, const struct ray3D *ray, double *lambda, struct point3D *_p,
+					struct point3D *_n, double *u, double *v, int *goingOut);
+void paraboloidIntersect(struct object3D *paraboloid, const struct ray3D *ray, double *lambda, struct point3D *_p,
+					struct point3D *_n, double *u, double *v, int *goingOut);
+void boxIntersect(struct object3D *box, const struct ray3D *ray, double *lambda, struct point3D *_p,
+					struct point3D *_n, double *u, double *v, int *goingOut);
+
+// Surface attributes at a given lambda (see object3D.surface)
+void planeSurface(struct object3D *plane, const struct ray3D *ray, double lambda, struct point3D *_p,
+					struct point3D *_n, double *a, double *b, int *goingOut);
+void sphereSurface(struct object3D *sphere, const struct ray3D *ray, double lambda, struct point3D *_p,
+					struct point3D *_n, double *u, double *v, int *goingOut);
+void coneSurface(struct object3D *cone, const struct ray3D *ray, double lambda, struct point3D *_p,
+					struct point3D *_n, double *u, double *v, int *goingOut);
+void paraboloidSurface(struct object3D *paraboloid, const struct ray3D *ray, double lambda, struct point3D *_p,
+					struct point3D *_n, double *u, double *v, int *goingOut);
+void boxSurface(struct object3D *box, const struct ray3D *ray, double lambda, struct point3D *_p,
+					struct point3D *_n, double *u, double *v, int *goingOut);
+
+// Distance-only intersection tests of the built-in primitives, used by
+// hitDistance() below. They are here so they can be inlined in the BVH
+// leaves and the shadow ray loops. The surface attributes are computed by
+// the xSurface() functions in utils.c.
+
+// Ray transformed into Model world
+inline void modelRay(struct object3D *obj, const struct ray3D *ray, struct ray3D *mray)
+{
+    *mray=*ray;
+    matRayMult(obj->Tinv,mray);
+}
+
+inline double planeHitDist(struct object3D *plane, const struct ray3D *ray)
+{
+    struct ray3D mray;
+    modelRay(plane,ray,&mray);
+
+    double x,y,t;
+    const struct point3D *p,*d;
+    p=&(mray.p0);
+    d=&(mray.d);
+
+    if(d->pz==0) return -1;
+
+    t = -(p->pz/d->pz);
+    if(t<0) return -1;
+
+    x = p->px+t*d->px;
+    y = p->py+t*d->py;
+
+    //check the boundaries
+    if(x>=-1 && x<=1 && y>=-1 && y<=1) return t;
+    return -1;
+}
+
+// Root of A*t^2+B*t+C=0 for the world-space quadric of obj (see
+// invertObject()): the smaller one if it is in front of the ray, the
+// larger one otherwise. Returns -1 if there is no root in front of the ray.
+inline double quadricRoot(struct object3D *obj, const struct ray3D *ray)
+{
+    double A,B,C,t;
+    quadricCoefs(obj->Q,ray,&A,&B,&C);
+    double delta = B*B-4*A*C;
+    if(A==0 || delta<0) return -1;
+    if(delta==0){
+	//there is one root
+	t = -B/(2*A);
+    }else{
+	//2 roots
+	double t1,t2;
+	delta = sqrt(delta);
+	t1 = (-B-delta)/A;
+	t2 = (-B+delta)/A;
+	if(t1>0) t=t1/2;
+	else t=t2/2;
+    }
+    return (t>0)?t:-1;
+}
+
+// Model y of the hit point, for the quadrics clipped to y in [-1,0]
+inline double modelY(struct object3D *obj, const struct ray3D *ray, double lambda)
+{
+    struct point3D h;
+    ray->rayPos(ray, lambda, &h);
+    return obj->Tinv[1][0]*h.px+obj->Tinv[1][1]*h.py+obj->Tinv[1][2]*h.pz+obj->Tinv[1][3]*h.pw;
+}
+
+inline double sphereHitDist(struct object3D *sphere, const struct ray3D *ray)
+{
+    //the quadric is intersected in world coordinates, the ray is not transformed
+    return quadricRoot(sphere,ray);
+}
+
+inline double coneHitDist(struct object3D *cone, const struct ray3D *ray)
+{
+    double t=quadricRoot(cone,ray);
+    if(t<=0) return -1;
+    //check the bound of y in Model world
+    double y=modelY(cone,ray,t);
+    if(y>=-1 && y<=0) return t;
+    return -1;
+}
+
+inline double paraboloidHitDist(struct object3D *paraboloid, const struct ray3D *ray)
+{
+    double t=quadricRoot(paraboloid,ray);
+    if(t<=0) return -1;
+    //check the bound of y in Model world
+    double y=modelY(paraboloid,ray,t);
+    if(y>=-1 && y<=0) return t;
+    return -1;
+}
+
+// Slab test on the unit box for a ray in Model world. Returns the lambda
+// of the nearest face in front of the ray origin (the exit face if the ray
+// starts inside the box), or -1, and the axis of that face.
+inline double boxSlab(const struct ray3D *mray, int *axis)
+{
+    double p[3]={mray->p0.px,mray->p0.py,mray->p0.pz};
+    double d[3]={mray->d.px,mray->d.py,mray->d.pz};
+
+    //the ray is inside the box between the largest entry and the
+    //smallest exit over the three pairs of faces
+    double tnear=-1e300, tfar=1e300;
+    int anear=-1, afar=-1;	//axis of the faces hit at tnear and tfar
+    for(int k=0;k<3;++k){
+	if(d[k]==0){
+	    //parallel to this pair of faces
+	    if(p[k]<-1 || p[k]>1) return -1;
+	    continue;
+	}
+	double t1=(-1-p[k])/d[k];
+	double t2=(1-p[k])/d[k];
+	if(t1>t2){ double tt=t1; t1=t2; t2=tt; }
+	if(t1>tnear){ tnear=t1; anear=k; }
+	if(t2<tfar){ tfar=t2; afar=k; }
+    }
+    if(tnear>tfar || tfar<=0) return -1;
+
+    if(tnear>0){ *axis=anear; return tnear; }
+    *axis=afar;
+    return tfar;
+}
+
+inline double boxHitDist(struct object3D *box, const struct ray3D *ray)
+{
+    struct ray3D mray;
+    int axis;
+    modelRay(box,ray,&mray);
+    return boxSlab(&mray,&axis);
+}
+
+inline double hitDistance(struct object3D *obj, const struct ray3D *ray)
+{
+ // Lambda of the hit of the ray with obj, -1 if it misses. Dispatches on
+ // the type of the built-in primitives (a switch the compiler can inline),
+ // OBJ_CUSTOM objects go through their hitDist function pointer.
+#ifndef FNPTR_DISPATCH
+ switch(obj->type)
+ {
+  case OBJ_PLANE: return planeHitDist(obj,ray);
+  case OBJ_SPHERE: return sphereHitDist(obj,ray);
+  case OBJ_CONE: return coneHitDist(obj,ray);
+  case OBJ_PARABOLOID: return paraboloidHitDist(obj,ray);
+  case OBJ_BOX: return boxHitDist(obj,ray);
+ }
+#endif
+ return obj->hitDist(obj,ray);
+}
+
+inline void surfaceAt(struct object3D *obj, const struct ray3D *ray, double lambda,
+			struct point3D *p, struct point3D *n, double *a, double *b, int *goingOut)
+{
+ // Surface attributes at a lambda returned by hitDistance(), same dispatch
+#ifndef FNPTR_DISPATCH
+ switch(obj->type)
+ {
+  case OBJ_PLANE: planeSurface(obj,ray,lambda,p,n,a,b,goingOut); return;
+  case OBJ_SPHERE: sphereSurface(obj,ray,lambda,p,n,a,b,goingOut); return;
+  case OBJ_CONE: coneSurface(obj,ray,lambda,p,n,a,b,goingOut); return;
+  case OBJ_PARABOLOID: paraboloidSurface(obj,ray,lambda,p,n,a,b,goingOut); return;
+  case OBJ_BOX: boxSurface(obj,ray,lambda,p,n,a,b,goingOut); return;
+ }
+#endif
+ obj->surface(obj,ray,lambda,p,n,a,b,goingOut);
+}
+
 
 
 // Functions to texture-map objects
 // You will need to add code for these if you implement texture mapping.
 void loadTexture(struct object3D *o, const char *filename);
-void texMap(struct image *img, double a, double b, double *R, double *G, double *B);
+void texMap(struct texture *tex, double a, double b, double width, double *R, double *G, double *B);
 
 // Functions to insert objects and lights into their respective lists
 void insertObject(struct object3D *o, struct object3D **list);